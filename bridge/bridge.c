@@ -36,7 +36,7 @@ static void usage(void)
 {
 	fprintf(stderr,
 "Usage: bridge [ OPTIONS ] OBJECT { COMMAND | help }\n"
-"       bridge [ -force ] -batch filename\n"
+"       bridge [ -force ] [ -pipeline N ] [ -bulk ] -batch filename\n"
 "where	OBJECT := { link | fdb | mdb | vlan | monitor }\n"
 "	OPTIONS := { -V[ersion] | -s[tatistics] | -d[etails] |\n"
 "		     -o[neline] | -t[imestamp] | -n[etns] name |\n"
@@ -77,6 +77,18 @@ static int do_cmd(const char *argv0, int argc, char **argv)
 	return -1;
 }
 
+/* requests in flight with -pipeline, 0 waits for every ACK */
+static unsigned int pipeline;
+/* pack them into datagrams, ACK only the last of each */
+static int bulk;
+static int pipe_failed;
+
+static void batch_pipe_err(int lineno, int error, void *name)
+{
+	fprintf(stderr, "Command failed %s:%d\n", (const char *)name, lineno);
+	pipe_failed = 1;
+}
+
 static int batch(const char *name)
 {
 	char *line = NULL;
@@ -99,6 +111,16 @@ static int batch(const char *name)
 
 	rtnl_set_strict_dump(&rth);
 
+	if (bulk && !pipeline)
+		pipeline = 256;
+	if (pipeline &&
+	    (rtnl_pipe_open(&rth, pipeline, batch_pipe_err, (void *)name) < 0 ||
+	     (bulk && rtnl_pipe_bulk(&rth) < 0))) {
+		perror("Cannot pipeline requests");
+		rtnl_close(&rth);
+		return EXIT_FAILURE;
+	}
+
 	cmdlineno = 0;
 	while (getcmdline(&line, &len, stdin) != -1) {
 		char *largv[100];
@@ -108,6 +130,7 @@ static int batch(const char *name)
 		if (largc == 0)
 			continue;       /* blank line */
 
+		rtnl_pipe_tag(&rth, cmdlineno);
 		if (do_cmd(largv[0], largc, largv)) {
 			fprintf(stderr, "Command failed %s:%d\n",
 				name, cmdlineno);
@@ -115,7 +138,14 @@ static int batch(const char *name)
 			if (!force)
 				break;
 		}
+		/* a pipelined failure shows up a few lines late */
+		if (pipe_failed && !force) {
+			rtnl_pipe_abort(&rth);
+			break;
+		}
 	}
+	if (rtnl_pipe_flush(&rth) < 0 || pipe_failed)
+		ret = EXIT_FAILURE;
 	if (line)
 		free(line);
 
@@ -188,6 +218,12 @@ main(int argc, char **argv)
 			if (argc <= 1)
 				usage();
 			batch_file = argv[1];
+		} else if (matches(opt, "-pipeline") == 0) {
+			NEXT_ARG();
+			if (get_unsigned(&pipeline, argv[1], 0) || !pipeline)
+				invarg("invalid pipeline depth", argv[1]);
+		} else if (matches(opt, "-bulk") == 0) {
+			bulk = 1;
 		} else {
 			fprintf(stderr,
 				"Option \"%s\" is unknown, try \"bridge help\".\n",
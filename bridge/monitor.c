@@ -28,6 +28,7 @@
 
 static void usage(void) __attribute__((noreturn));
 static int prefix_banner;
+static int show_link;
 
 static void usage(void)
 {
@@ -35,10 +36,30 @@ static void usage(void)
 	exit(-1);
 }
 
+/* An AF_BRIDGE RTM_DELLINK only means the port left its bridge, the
+ * device itself is still there.
+ */
+static int remember_link(struct nlmsghdr *n)
+{
+	struct ifinfomsg *ifi = NLMSG_DATA(n);
+
+	if (n->nlmsg_type == RTM_DELLINK &&
+	    (n->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi)) ||
+	     ifi->ifi_family == AF_BRIDGE))
+		return 0;
+	return ll_remember_index(n, NULL);
+}
+
 static int accept_msg(struct rtnl_ctrl_data *ctrl,
 		      struct nlmsghdr *n, void *arg)
 {
 	FILE *fp = arg;
+	int err;
+
+	/* link events also keep the port names in fdb and mdb current */
+	if (!show_link &&
+	    (n->nlmsg_type == RTM_NEWLINK || n->nlmsg_type == RTM_DELLINK))
+		return remember_link(n);
 
 	if (timestamp)
 		print_timestamp(fp);
@@ -49,7 +70,9 @@ static int accept_msg(struct rtnl_ctrl_data *ctrl,
 		if (prefix_banner)
 			fprintf(fp, "[LINK]");
 
-		return print_linkinfo(n, arg);
+		err = print_linkinfo(n, arg);
+		remember_link(n);
+		return err;
 
 	case RTM_NEWNEIGH:
 	case RTM_DELNEIGH:
@@ -118,6 +141,9 @@ int do_monitor(int argc, char **argv)
 		groups |= nl_mgrp(RTNLGRP_MDB);
 	}
 
+	show_link = !!(groups & nl_mgrp(RTNLGRP_LINK));
+	groups |= nl_mgrp(RTNLGRP_LINK);
+
 	if (file) {
 		FILE *fp;
 		int err;
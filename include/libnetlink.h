@@ -24,7 +24,11 @@ struct rtnl_handle {
 #define RTNL_HANDLE_F_LISTEN_ALL_NSID		0x01
 #define RTNL_HANDLE_F_SUPPRESS_NLERR		0x02
 #define RTNL_HANDLE_F_STRICT_CHK		0x04
+#define RTNL_HANDLE_F_LISTEN_ENOBUFS		0x08
 	int			flags;
+	char		       *buf;
+	size_t			buflen;
+	struct rtnl_pipe       *pipe;
 };
 
 struct nlmsg_list {
@@ -121,6 +125,47 @@ int rtnl_dump_filter_nc(struct rtnl_handle *rth,
 			void *arg, __u16 nc_flags);
 #define rtnl_dump_filter(rth, filter, arg) \
 	rtnl_dump_filter_nc(rth, filter, arg, 0)
+
+struct rtnl_dump_arena {
+	char			**bufs;
+	int			nbufs;
+	struct nlmsghdr		**msgs;
+	int			count;
+	int			size;
+	int			*head;
+	int			*next;
+	int			max_index;
+};
+
+/* Pipelined requests, see rtnl_pipe_open().  The callback gets the tag
+ * that was set when the failed request was sent and the negative errno.
+ */
+typedef void (*rtnl_pipe_err_fn_t)(int tag, int error, void *arg);
+
+int rtnl_pipe_open(struct rtnl_handle *rth, unsigned int depth,
+		   rtnl_pipe_err_fn_t errfn, void *arg)
+	__attribute__((warn_unused_result));
+int rtnl_pipe_bulk(struct rtnl_handle *rth)
+	__attribute__((warn_unused_result));
+void rtnl_pipe_tag(struct rtnl_handle *rth, int tag);
+int rtnl_pipe_flush(struct rtnl_handle *rth);
+void rtnl_pipe_abort(struct rtnl_handle *rth);
+void rtnl_pipe_close(struct rtnl_handle *rth);
+
+int rtnl_dump_arena(struct rtnl_handle *rth, struct rtnl_dump_arena *a)
+	__attribute__((warn_unused_result));
+void rtnl_arena_free(struct rtnl_dump_arena *a);
+
+/* index into a->msgs of the first message about ifindex, or -1;
+ * the following ones are found through a->next[]
+ */
+static inline int rtnl_arena_first(const struct rtnl_dump_arena *a,
+				   int ifindex)
+{
+	if (!a->head || ifindex <= 0 || ifindex > a->max_index)
+		return -1;
+	return a->head[ifindex];
+}
 int rtnl_talk(struct rtnl_handle *rtnl, struct nlmsghdr *n,
 	      struct nlmsghdr **answer)
 	__attribute__((warn_unused_result));
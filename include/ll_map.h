@@ -2,9 +2,14 @@
 #ifndef __LL_MAP_H__
 #define __LL_MAP_H__ 1
 
+#include <stdbool.h>
+
 int ll_remember_index(struct nlmsghdr *n, void *arg);
 
 void ll_init_map(struct rtnl_handle *rth);
+int ll_map_subscribe(void);
+bool ll_map_subscribed(void);
+int ll_map_sync(void);
 unsigned ll_name_to_index(const char *name);
 const char *ll_index_to_name(unsigned idx);
 int ll_index_to_type(unsigned idx);
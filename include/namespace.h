@@ -50,6 +50,7 @@ static inline int setns(int fd, int nstype)
 #endif /* HAVE_SETNS */
 
 int netns_switch(char *netns);
+int netns_switch_net(char *netns);
 int netns_get_fd(const char *netns);
 int netns_foreach(int (*func)(char *nsname, void *arg), void *arg);
 
@@ -0,0 +1,74 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __VNIC_SNAPSHOT_H__
+#define __VNIC_SNAPSHOT_H__ 1
+
+#include <linux/types.h>
+
+/*
+ * On disk layout of "ip -snapshot FILE": a header followed by flat arrays
+ * of fixed size records, each section aligned to 8 bytes, so a reader can
+ * mmap the file and index it directly.  All fields are in host byte order;
+ * a byte swapped magic means the file came from the other endianness.
+ *
+ * Namespaces own a contiguous run of pids and interfaces, interfaces own
+ * a contiguous run of addresses.  The index section lists every address
+ * sorted by (family, address) for binary search.
+ */
+
+#define VNIC_SNAP_MAGIC		0x504e5356	/* "VSNP" */
+#define VNIC_SNAP_VERSION	1
+
+struct vnic_snap_sect {
+	__u32	off;		/* from the start of the file */
+	__u32	count;		/* number of records */
+};
+
+struct vnic_snap_hdr {
+	__u32	magic;
+	__u16	version;
+	__u16	hdr_len;
+	__u64	created;	/* seconds since the epoch */
+	__u64	size;		/* total length of the snapshot */
+	struct vnic_snap_sect ns;	/* struct vnic_snap_ns */
+	struct vnic_snap_sect ifs;	/* struct vnic_snap_if */
+	struct vnic_snap_sect addrs;	/* struct vnic_snap_addr */
+	struct vnic_snap_sect pids;	/* __u32 */
+	struct vnic_snap_sect index;	/* __u32 into addrs */
+};
+
+struct vnic_snap_ns {
+	__u64	dev;		/* of /proc/<pid>/ns/net */
+	__u64	ino;
+	__s32	nsid;		/* as seen from the host, -1 if none */
+	__u32	pid_first;
+	__u32	pid_count;
+	__u32	if_first;
+	__u32	if_count;
+	__u32	pad;
+};
+
+struct vnic_snap_if {
+	__u32	ns;		/* owning namespace record */
+	__u32	ifindex;	/* inside the namespace */
+	__u32	host_ifindex;	/* host side peer, 0 if none */
+	__u32	addr_first;
+	__u32	addr_count;
+	char	ifname[16];
+	char	host_ifname[16];
+};
+
+struct vnic_snap_addr {
+	__u32	iface;		/* owning interface record */
+	__u8	family;
+	__u8	prefixlen;
+	__u16	pad;
+	__u8	addr[16];
+};
+
+static inline const void *vnic_snap_sect(const struct vnic_snap_hdr *hdr,
+					 const struct vnic_snap_sect *sect)
+{
+	return (const char *)hdr + sect->off;
+}
+
+#endif /* __VNIC_SNAPSHOT_H__ */
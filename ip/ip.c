@@ -49,7 +49,17 @@ int force;
 int max_flush_loops = 10;
 int batch_mode;
 bool do_all;
-char pid_list[1024][100];
+static int use_exec;
+static int use_daemon;
+static const char *vnicd_path = VNICD_SOCKET;
+static int workers;
+static const char *proc_name = "envoy";
+static const char *batch_file;
+static int repeat;
+static int reverse;
+static const char *snapshot_file;
+static const char *load_file;
+static struct netns_pid *pid_list;
 char integer[]={0,1,2,3,4,5,6,7,8,9};
 
 struct rtnl_handle rth = { .fd = -1 };
@@ -59,20 +69,15 @@ static void usage(void) __attribute__((noreturn));
 static void usage(void)
 {
 	fprintf(stderr,
-		"Usage: ip [ OPTIONS ] OBJECT { COMMAND | help }\n"
-		"       ip [ -force ] -batch filename\n"
-		"where  OBJECT := { link | address | addrlabel | route | rule | neigh | ntable |\n"
-		"                   tunnel | tuntap | maddress | mroute | mrule | monitor | xfrm |\n"
-		"                   netns | l2tp | fou | macsec | tcp_metrics | token | netconf | ila |\n"
-		"                   vrf | sr | nexthop | mptcp }\n"
-		"       OPTIONS := { -V[ersion] | -s[tatistics] | -d[etails] | -r[esolve] |\n"
-		"                    -h[uman-readable] | -iec | -j[son] | -p[retty] |\n"
-		"                    -f[amily] { inet | inet6 | mpls | bridge | link } |\n"
-		"                    -4 | -6 | -I | -D | -M | -B | -0 |\n"
-		"                    -l[oops] { maximum-addr-flush-attempts } | -br[ief] |\n"
-		"                    -o[neline] | -t[imestamp] | -ts[hort] | -b[atch] [filename] |\n"
-		"                    -rc[vbuf] [size] | -n[etns] name | -N[umeric] | -a[ll] |\n"
-		"                    -c[olor]}\n");
+		"Usage: ip [ OPTIONS ] ADDRESS\n"
+		"       ip [ OPTIONS ] -b[atch] FILE\n"
+		"       ip [ -j[son] [ -pretty ] ] -rev[erse] { IFNAME | IFINDEX }\n"
+		"       ip [ OPTIONS ] -sn[apshot] FILE\n"
+		"       ip [ -pretty ] -l[oad] FILE\n"
+		"       ip [ -p[rocess] PATTERN ] [ -s[ocket] PATH ] -d[aemon]\n"
+		"       OPTIONS := { -e[xec] | -p[rocess] PATTERN | -w[orkers] COUNT |\n"
+		"                    -q[uery] | -s[ocket] PATH | -j[son] [ -pretty ] |\n"
+		"                    -r[epeat] COUNT }\n");
 	exit(-1);
 }
 
@@ -82,29 +87,6 @@ static int do_help(int argc, char **argv)
 	return 0;
 }
 
-void separate_enter(char *s){
-	char *p=s;
-	p=strstr(s,"\n");
-	if(p!=NULL){
-		strcpy(p,p+strlen("\n"));
-	}
-}
-
-void separate_space(char *s){
-	char *p=s;
-	p=strstr(s," ");
-	if(p!=NULL){
-		strcpy(p,p+strlen(" "));
-		separate_space(p+1);
-	}
-}
-
-void separate_ps(char *s, int k){
-	strncpy(pid_list[k], s, 7);
-	separate_space(pid_list[k]);
-	return ;
-}
-
 pid_t Fork(void){
 	pid_t	pid;
 
@@ -116,72 +98,189 @@ pid_t Fork(void){
 }
 
 int make_pidlist(void){
-	FILE *fp;
-	char *cmdline="pgrep envoy";
-	if((fp=popen(cmdline,"r"))==NULL){
-		perror("Searching pid command fail");
+	__u64 start = vnic_trace_now();
+	int count;
+
+	free(pid_list);
+	pid_list = NULL;
+
+	count = netns_pid_scan(proc_name, &pid_list);
+	if (count < 0)
 		exit(EXIT_FAILURE);
+	netns_sock_prune(pid_list, count);
+
+	vnic_trace_add(VNIC_TRACE_PIDS, start);
+	return count;
+}
+
+static int seach_vnic_setns(int count, char *ipaddr)
+{
+	int index;
+
+	make_iflist();
+
+	index = netns_peer_search(pid_list, count, ipaddr, workers);
+	if (index <= 0)
+		return -1;
+
+	search_name(index);
+	return 0;
+}
+
+/* Returns -EOPNOTSUPP when the namespaces have to be entered instead */
+static int seach_vnic_nsid(char *ipaddr)
+{
+	int index;
+
+	index = vnic_nsid_lookup(&rth, ipaddr);
+	if (index <= 0)
+		return index;
+
+	make_iflist();
+	search_name(index);
+	return 0;
+}
+
+void seach_vnic(int count, char *ipaddr){
+	pid_t *children;
+	int i = 0, running = 0, found = 0;
+	int pfd[2], index;
+	FILE *fp;
+
+	if (!use_exec) {
+		seach_vnic_setns(count, ipaddr);
+		return;
 	}
-	int i=0;
-	char tmp[1024][100];
-	while(!feof(fp)){
-		fgets(tmp[i], sizeof(tmp[i]), fp);
-		separate_enter(tmp[i]);
-		separate_space(tmp[i]);
-		i++;
+
+	children = calloc(count, sizeof(*children));
+	if (!children) {
+		fprintf(stderr, "Cannot allocate child list\n");
+		return;
 	}
-	(void) pclose(fp);
 
-	for(int j=0; j<i-1; j++){
-		strcpy(pid_list[j],tmp[i-j+1]);
+	/* the children report the host ifindex, names are resolved here */
+	if (pipe(pfd) < 0) {
+		perror("Cannot create pipe");
+		free(children);
+		return;
 	}
-	i--;
+	make_iflist();
 
-	return i;
-}
+	/* keep up to workers children probing namespaces at once */
+	while (running || (i < count && !found)) {
+		if (i < count && !found && running < workers) {
+			pid_t pid = Fork();
 
-int make_pidlist_ps(void){
-	FILE *fp;
-	char *cmdline="ps h -A";
-	if((fp=popen(cmdline,"r"))==NULL){
-		perror("Searching pid command fail");
-		exit(EXIT_FAILURE);
+			if (pid == -1)
+				break;
+			if (pid == 0) {
+				close(pfd[0]);
+				if (dup2(pfd[1], STDOUT_FILENO) < 0)
+					exit(EXIT_FAILURE);
+				close(pfd[1]);
+				if (get_vnic(pid_list[i].pid, ipaddr) == -1)
+					exit(EXIT_FAILURE);
+				exit(EXIT_SUCCESS);
+			}
+			children[i++] = pid;
+			running++;
+			continue;
+		}
+
+		int status = 0;
+		pid_t pid = wait(&status);
+
+		if (pid < 0)
+			break;
+		running--;
+
+		/* reaped, the pid may be reused from now on */
+		for (int j = 0; j < i; j++) {
+			if (children[j] == pid)
+				children[j] = 0;
+		}
+		if (found || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			continue;
+
+		/* first match wins, the others are no longer needed */
+		found = 1;
+		for (int j = 0; j < i; j++) {
+			if (children[j])
+				kill(children[j], SIGTERM);
+		}
 	}
-	int i=0;
-	char tmp[1024][100];
-	while(!feof(fp)){
-		fgets(tmp[i], sizeof(tmp[i]), fp);
-		separate_ps(tmp,i);
-		i++;
+
+	close(pfd[1]);
+	fp = fdopen(pfd[0], "r");
+	if (fp) {
+		if (found && fscanf(fp, "%d", &index) == 1)
+			search_name(index);
+		fclose(fp);
+	} else {
+		close(pfd[0]);
 	}
-	(void) pclose(fp);
+	free(children);
+}
 
-	i--;
+static void vnic_lookup(char *ipaddr)
+{
+	if (use_daemon < 0) {
+		vnicd_query(vnicd_path, ipaddr);
+	} else if (use_exec || seach_vnic_nsid(ipaddr) == -EOPNOTSUPP) {
+		int pidnum = make_pidlist();
 
-	return i;
+		seach_vnic(pidnum, ipaddr);
+	}
 }
 
-void seach_vnic(int count, char *ipaddr){
-    int i=0;
-    for (i=0; i<count; ++i){
-        pid_t pid=Fork();
-        if(pid==-1) break;
-        else if(pid==0){
-            if(get_vnic(pid_list[i], ipaddr)==-1) exit(EXIT_FAILURE);
-	        exit (EXIT_SUCCESS);
-        }
-        else{
-            int status=0;
-            pid=wait(&status);
-			if(status==EXIT_SUCCESS) return;
-            }
-    }
+/* Without -repeat print the lookup time in nanoseconds as before.  With
+ * it, run the lookup COUNT times, keep the output of the first run only
+ * and print the per-phase percentiles as JSON.
+ */
+static int vnic_lookup_timed(char *ipaddr)
+{
+	int runs = repeat ? repeat : 1;
+	int i, out = -1;
+	__u64 total = 0;
+
+	if (vnic_trace_init(runs, repeat != 0) < 0)
+		return -1;
+
+	/* later runs find the host links without dumping them again */
+	if (runs > 1 && ll_map_subscribe() < 0)
+		fprintf(stderr, "Cannot subscribe to link events\n");
+
+	for (i = 0; i < runs; i++) {
+		if (i == 1) {
+			int null = open("/dev/null", O_WRONLY);
+
+			fflush(stdout);
+			out = dup(STDOUT_FILENO);
+			if (null >= 0) {
+				dup2(null, STDOUT_FILENO);
+				close(null);
+			}
+		}
+		vnic_trace_begin();
+		vnic_lookup(ipaddr);
+		total = vnic_trace_end();
+	}
+
+	if (out >= 0) {
+		fflush(stdout);
+		dup2(out, STDOUT_FILENO);
+		close(out);
+	}
+
+	if (repeat)
+		vnic_trace_print(stdout);
+	else
+		printf("%llu\n", (unsigned long long)total);
+	return 0;
 }
 
 int main(int argc, char **argv)
 {
-	struct timespec tsStart, tsEnd;
-	
 	char *basename;
 	int color = 0;
 
@@ -193,6 +292,97 @@ int main(int argc, char **argv)
 	else
 		basename++;
 
+	while (argc > 1) {
+		char *opt = argv[1];
+
+		if (strcmp(opt, "--") == 0) {
+			argc--;
+			argv++;
+			break;
+		}
+		if (opt[0] != '-')
+			break;
+		if (opt[1] == '-')
+			opt++;
+		if (matches(opt, "-exec") == 0) {
+			use_exec = 1;
+		} else if (matches(opt, "-daemon") == 0) {
+			use_daemon = 1;
+		} else if (matches(opt, "-query") == 0) {
+			use_daemon = -1;
+		} else if (matches(opt, "-socket") == 0) {
+			argc--;
+			argv++;
+			if (argc <= 1)
+				usage();
+			vnicd_path = argv[1];
+		} else if (matches(opt, "-process") == 0) {
+			argc--;
+			argv++;
+			if (argc <= 1)
+				usage();
+			proc_name = argv[1];
+		} else if (matches(opt, "-pretty") == 0) {
+			pretty = 1;
+		} else if (matches(opt, "-json") == 0) {
+			++json;
+		} else if (matches(opt, "-batch") == 0) {
+			argc--;
+			argv++;
+			if (argc <= 1)
+				usage();
+			batch_file = argv[1];
+		} else if (matches(opt, "-workers") == 0) {
+			argc--;
+			argv++;
+			if (argc <= 1)
+				usage();
+			if (get_integer(&workers, argv[1], 0) || workers < 1)
+				invarg("invalid worker count", argv[1]);
+		} else if (matches(opt, "-repeat") == 0) {
+			argc--;
+			argv++;
+			if (argc <= 1)
+				usage();
+			if (get_integer(&repeat, argv[1], 0) || repeat < 1)
+				invarg("invalid repeat count", argv[1]);
+		} else if (matches(opt, "-reverse") == 0) {
+			reverse = 1;
+		} else if (matches(opt, "-snapshot") == 0) {
+			argc--;
+			argv++;
+			if (argc <= 1)
+				usage();
+			snapshot_file = argv[1];
+		} else if (matches(opt, "-load") == 0) {
+			argc--;
+			argv++;
+			if (argc <= 1)
+				usage();
+			load_file = argv[1];
+		} else if (matches(opt, "-help") == 0) {
+			usage();
+		} else {
+			fprintf(stderr,
+				"Option \"%s\" is unknown, try \"ip -help\".\n",
+				opt);
+			exit(-1);
+		}
+		argc--;
+		argv++;
+	}
+
+	if (load_file)
+		return vnic_snapshot_show(load_file) < 0 ? 1 : 0;
+
+	if (argc < 2 && use_daemon <= 0 && !batch_file && !snapshot_file)
+		usage();
+
+	if (!workers)
+		workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers < 1)
+		workers = 1;
+
 	_SL_ = oneline ? "\\" : "\n";
 
 	check_enable_color(color, json);
@@ -202,26 +392,40 @@ int main(int argc, char **argv)
 
 	rtnl_set_strict_dump(&rth);
 
-	if(argc==2){
-		timespec_get(&tsStart, TIME_UTC);
+	if (use_daemon > 0)
+		return do_vnicd(vnicd_path, proc_name) < 0 ? 1 : 0;
 
-		int pidnum=make_pidlist();
-		//int pidnum=make_pidlist_ps();
-		seach_vnic(pidnum, argv[1]);
+	if (batch_file) {
+		int count = make_pidlist();
+		int ret = vnic_batch(batch_file, pid_list, count, workers);
+
+		rtnl_close(&rth);
+		return ret < 0 ? 1 : 0;
 	}
-	else if(strcmp(argv[1],ANOTHER_KEY)==0){
-		if(coll_name(argv)==-1) return -1;
-		else return 0;
-	} 
-	else printf("No command\n"); 
-	
-	timespec_get(&tsEnd, TIME_UTC);
-    int nsec = tsEnd.tv_nsec - tsStart.tv_nsec;
-    int secSpan = tsEnd.tv_sec - tsStart.tv_sec;
-    if(0 < secSpan){
-    	nsec += secSpan * 1000000000;
-    }
-	printf("%d\n", nsec);
+
+	if (snapshot_file) {
+		int count = make_pidlist();
+		int ret = vnic_snapshot(snapshot_file, pid_list, count, workers);
+
+		rtnl_close(&rth);
+		return ret < 0 ? 1 : 0;
+	}
+
+	if (reverse) {
+		int ret = argc == 2 ? vnic_reverse(argv[1]) : -1;
+
+		rtnl_close(&rth);
+		return ret < 0 ? 1 : 0;
+	}
+
+	if (argc == 2) {
+		vnic_lookup_timed(argv[1]);
+	} else if (strcmp(argv[1], ANOTHER_KEY) == 0) {
+		return coll_name(argv) == -1 ? -1 : 0;
+	} else {
+		printf("No command\n");
+	}
+
 	rtnl_close(&rth);
 
 	return 0;
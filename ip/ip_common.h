@@ -10,8 +10,6 @@
 
 #define COMMAND_NAME "ip"
 
-struct timespec tsStart, tsEnd;
-
 struct link_filter {
 	int ifindex;
 	int family;
@@ -33,13 +31,17 @@ struct link_filter {
 	int target_nsid;
 };
 
-struct nic_info{
-	int if_count;
-	int if_index[1024];
-	char if_name[1024][20];
+struct vnic_veth {
+	int	ifindex;
+	int	nsid;
+	int	peer;
 };
 
-struct nic_info nic_info;
+struct netns_pid {
+	dev_t	dev;
+	ino_t	ino;
+	char	pid[16];
+};
 
 int get_operstate(const char *name);//
 int print_linkinfo(struct nlmsghdr *n, void *arg);//
@@ -49,13 +51,56 @@ void ipaddr_reset_filter(int oneline, int ifindex);
 void netns_nsid_socket_init(void);//
 int coll_name(char **argv);//
 int do_netns(int argc, char **argv);//
+int do_netns_net(int argc, char **argv);
 int back_netns(int argc, char **argv);//
 int get_vnic(char *pid, char *ipaddr);
+typedef int (*netns_rtnl_fn_t)(struct rtnl_handle *rth,
+			       const struct netns_pid *ns, void *arg);
+int netns_pool_foreach(const struct netns_pid *list, int count, int workers,
+		       netns_rtnl_fn_t fn, void *arg);
+int netns_peer_search(const struct netns_pid *list, int count,
+		      const char *ipaddr, int workers);
+int vnic_batch(const char *file, const struct netns_pid *list, int count,
+	       int workers);
+int netns_pid_scan(const char *comm, struct netns_pid **list);
+int netns_pid_scan_all(const char *comm, struct netns_pid **list);
+int netns_pid_members(const struct netns_pid *ns, int **pids);
+int netns_pid_by_nsid(int nsid, struct netns_pid *ns);
+int netns_rtnl_open(const char *pid, struct rtnl_handle *rth);
+int netns_sock_prune(const struct netns_pid *list, int count);
+int get_netnsid_from_fd(int fd);
+int get_netnsid_from_pid(const char *pid);
+int do_vnicd(const char *path, const char *comm);
+int vnicd_query(const char *path, const char *ipaddr);
+int vnic_peer_index(struct rtnl_handle *rth, const char *ipaddr);
+int vnic_nsid_lookup(struct rtnl_handle *rth, const char *ipaddr);
+int vnic_reverse(const char *dev);
+int vnic_veth_dump(struct rtnl_handle *rth, struct vnic_veth **veth);
+int vnic_snapshot(const char *file, const struct netns_pid *list, int count,
+		  int workers);
+int vnic_snapshot_show(const char *file);
+
+enum {
+	VNIC_TRACE_PIDS,
+	VNIC_TRACE_NETNS,
+	VNIC_TRACE_LINK,
+	VNIC_TRACE_ADDR,
+	VNIC_TRACE_MATCH,
+	VNIC_TRACE_OUTPUT,
+	VNIC_TRACE_TOTAL,
+	__VNIC_TRACE_MAX
+};
+
+__u64 vnic_trace_now(void);
+void vnic_trace_add(int phase, __u64 start);
+int vnic_trace_init(int runs, bool phases);
+void vnic_trace_begin(void);
+__u64 vnic_trace_end(void);
+void vnic_trace_print(FILE *fp);
 
 void vrf_reset(void);
 
-int ip_link_list(req_filter_fn_t filter_fn, struct nlmsg_chain *linfo);//
-void free_nlmsg_chain(struct nlmsg_chain *info);
+int ip_link_list(req_filter_fn_t filter_fn, struct rtnl_dump_arena *linfo);
 
 extern struct rtnl_handle rth;
 
@@ -75,12 +120,10 @@ int iplink_parse(int argc, char **argv, struct iplink_req *req, char **type);
 #define     LABEL_MAX_MASK          0xFFFFFU
 #endif
 
-int set_iflist(struct nlmsghdr *n, void *arg, int *index, char *name);
-int set_iplist(struct ifinfomsg *ifi, struct nlmsg_list *ainfo, FILE *fp, char *addr);
 void make_iflist(void);
 void search_name(int number);
-void separate_enter(char *s);
-void separate_space(char *s);
+
+#define VNICD_SOCKET "/var/run/ip-vnicd.sock"
 
 #define DEFAULT_KEY "back_to_default_nns"
 #define ANOTHER_KEY "go_to_another_nns"
@@ -22,7 +22,6 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <string.h>
-#include <fnmatch.h>
 
 #include <linux/netdevice.h>
 #include <linux/if_arp.h>
@@ -41,123 +40,6 @@ enum {
 
 static struct link_filter filter;
 
-static unsigned int get_ifa_flags(struct ifaddrmsg *ifa,
-				  struct rtattr *ifa_flags_attr)
-{
-	return ifa_flags_attr ? rta_getattr_u32(ifa_flags_attr) :
-		ifa->ifa_flags;
-}
-
-static int ifa_label_match_rta(int ifindex, const struct rtattr *rta)
-{
-	const char *label;
-
-	if (!filter.label)
-		return 0;
-
-	if (rta)
-		label = RTA_DATA(rta);
-	else
-		label = ll_index_to_name(ifindex);
-
-	return fnmatch(filter.label, label, 0);
-}
-
-static int store_nlmsg(struct nlmsghdr *n, void *arg)
-{
-	struct nlmsg_chain *lchain = (struct nlmsg_chain *)arg;
-	struct nlmsg_list *h;
-
-	h = malloc(n->nlmsg_len+sizeof(void *));
-	if (h == NULL)
-		return -1;
-
-	memcpy(&h->h, n, n->nlmsg_len);
-	h->next = NULL;
-
-	if (lchain->tail)
-		lchain->tail->next = h;
-	else
-		lchain->head = h;
-	lchain->tail = h;
-
-	ll_remember_index(n, NULL);
-	return 0;
-}
-
-void free_nlmsg_chain(struct nlmsg_chain *info)
-{
-	struct nlmsg_list *l, *n;
-
-	for (l = info->head; l; l = n) {
-		n = l->next;
-		free(l);
-	}
-}
-
-static void ipaddr_filter(struct nlmsg_chain *linfo, struct nlmsg_chain *ainfo)
-{
-	struct nlmsg_list *l, **lp;
-
-	lp = &linfo->head;
-	while ((l = *lp) != NULL) {
-		int ok = 0;
-		int missing_net_address = 1;
-		struct ifinfomsg *ifi = NLMSG_DATA(&l->h);
-		struct nlmsg_list *a;
-
-		for (a = ainfo->head; a; a = a->next) {
-			struct nlmsghdr *n = &a->h;
-			struct ifaddrmsg *ifa = NLMSG_DATA(n);
-			struct rtattr *tb[IFA_MAX + 1];
-			unsigned int ifa_flags;
-
-			if (ifa->ifa_index != ifi->ifi_index)
-				continue;
-			missing_net_address = 0;
-			if (filter.family && filter.family != ifa->ifa_family)
-				continue;
-			if ((filter.scope^ifa->ifa_scope)&filter.scopemask)
-				continue;
-
-			parse_rtattr(tb, IFA_MAX, IFA_RTA(ifa), IFA_PAYLOAD(n));
-			ifa_flags = get_ifa_flags(ifa, tb[IFA_FLAGS]);
-
-			if ((filter.flags ^ ifa_flags) & filter.flagmask)
-				continue;
-
-			if (ifa_label_match_rta(ifa->ifa_index, tb[IFA_LABEL]))
-				continue;
-
-			if (!tb[IFA_LOCAL])
-				tb[IFA_LOCAL] = tb[IFA_ADDRESS];
-			if (inet_addr_match_rta(&filter.pfx, tb[IFA_LOCAL]))
-				continue;
-
-			ok = 1;
-			break;
-		}
-		if (missing_net_address &&
-		    (filter.family == AF_UNSPEC || filter.family == AF_PACKET))
-			ok = 1;
-		if (!ok) {
-			*lp = l->next;
-			free(l);
-		} else
-			lp = &l->next;
-	}
-}
-
-static int ipaddr_dump_filter(struct nlmsghdr *nlh, int reqlen)
-{
-	struct ifaddrmsg *ifa = NLMSG_DATA(nlh);
-
-	ifa->ifa_index = filter.ifindex;
-
-	return 0;
-}
-
-
 static int iplink_filter_req(struct nlmsghdr *nlh, int reqlen)
 {
 	int err;
@@ -188,334 +70,553 @@ static int iplink_filter_req(struct nlmsghdr *nlh, int reqlen)
 	return 0;
 }
 
-static int ipaddr_link_get(int index, struct nlmsg_chain *linfo)
+/* fills in linfo with link data, the messages stay in the receive
+ * buffers; caller must call rtnl_arena_free when done
+ */
+int ip_link_list(req_filter_fn_t filter_fn, struct rtnl_dump_arena *linfo)
+{
+	if (rtnl_linkdump_req_filter_fn(&rth, preferred_family,
+					filter_fn) < 0) {
+		perror("Cannot send dump request");
+		return 1;
+	}
+
+	if (rtnl_dump_arena(&rth, linfo) < 0) {
+		fprintf(stderr, "Dump terminated\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+void ipaddr_reset_filter(int oneline, int ifindex)
+{
+	memset(&filter, 0, sizeof(filter)); //&filterの指すアドレスからfilterのサイズ分unsiged char型に変換された0を書き込む
+	filter.oneline = oneline; //link_filter構造体のオブジェクトfilterのメンバであるonelineに引数で与えられたonelineを代入する
+	filter.ifindex = ifindex; //同様にメンバifindexに引数ifindexを代入する
+	filter.group = -1; //メンバgroupに-1を代入する
+}
+
+struct vnic_lookup {
+	inet_prefix	pfx;
+	int		ifindex;
+};
+
+static int vnic_match_addr(struct nlmsghdr *n, void *arg)
+{
+	struct vnic_lookup *vl = arg;
+	struct ifaddrmsg *ifa = NLMSG_DATA(n);
+	struct rtattr *rta_tb[IFA_MAX+1];
+	__u64 start;
+
+	if (n->nlmsg_type != RTM_NEWADDR)
+		return 0;
+
+	if (n->nlmsg_len < NLMSG_LENGTH(sizeof(*ifa)))
+		return -1;
+
+	/* non strict kernels ignore the family in the request */
+	if (ifa->ifa_family != vl->pfx.family)
+		return 0;
+
+	start = vnic_trace_now();
+	parse_rtattr(rta_tb, IFA_MAX, IFA_RTA(ifa), IFA_PAYLOAD(n));
+	if (!rta_tb[IFA_LOCAL])
+		rta_tb[IFA_LOCAL] = rta_tb[IFA_ADDRESS];
+	if (rta_tb[IFA_LOCAL] &&
+	    RTA_PAYLOAD(rta_tb[IFA_LOCAL]) == vl->pfx.bytelen &&
+	    !memcmp(RTA_DATA(rta_tb[IFA_LOCAL]), vl->pfx.data, vl->pfx.bytelen))
+		vl->ifindex = ifa->ifa_index;
+	vnic_trace_add(VNIC_TRACE_MATCH, start);
+
+	/* once the owner is known, stop reading the rest of the dump */
+	return vl->ifindex ? -1 : 0;
+}
+
+/* Fetch a single link and parse its attributes into tb, which point into
+ * the returned message; the caller frees it.
+ */
+static struct nlmsghdr *vnic_link_get(struct rtnl_handle *rth, int ifindex,
+				      struct rtattr **tb)
 {
 	struct iplink_req req = {
 		.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg)),
 		.n.nlmsg_flags = NLM_F_REQUEST,
 		.n.nlmsg_type = RTM_GETLINK,
-		.i.ifi_family = filter.family,
-		.i.ifi_index = index,
+		.i.ifi_index = ifindex,
 	};
-	__u32 filt_mask = RTEXT_FILTER_VF;
 	struct nlmsghdr *answer;
+	struct ifinfomsg *ifi;
 
-	if (!show_stats)
-		filt_mask |= RTEXT_FILTER_SKIP_STATS;
+	addattr32(&req.n, sizeof(req), IFLA_EXT_MASK, RTEXT_FILTER_SKIP_STATS);
 
-	addattr32(&req.n, sizeof(req), IFLA_EXT_MASK, filt_mask);
+	if (rtnl_talk(rth, &req.n, &answer) < 0)
+		return NULL;
 
-	if (rtnl_talk(&rth, &req.n, &answer) < 0) {
-		perror("Cannot send link request");
-		return 1;
-	}
-
-	if (store_nlmsg(answer, linfo) < 0) {
-		fprintf(stderr, "Failed to process link information\n");
-		return 1;
-	}
-
-	return 0;
+	ifi = NLMSG_DATA(answer);
+	parse_rtattr_flags(tb, IFLA_MAX, IFLA_RTA(ifi), IFLA_PAYLOAD(answer),
+			   NLA_F_NESTED);
+	return answer;
 }
 
-/* fills in linfo with link data and optionally ainfo with address info
- * caller can walk lists as desired and must call free_nlmsg_chain for
- * both when done
+/* Find the interface owning ipaddr in the namespace rth was opened in and
+ * return its IFLA_LINK, i.e. the host side ifindex of the veth pair.
+ * It uses neither the global rth nor the filter, so it may run from a
+ * thread that has switched network namespaces.  The address is parsed
+ * once and compared as raw bytes against a dump of its family only, which
+ * is abandoned as soon as the owner is known.
  */
-int ip_link_list(req_filter_fn_t filter_fn, struct nlmsg_chain *linfo)
+int vnic_peer_index(struct rtnl_handle *rth, const char *ipaddr)
 {
-	if (rtnl_linkdump_req_filter_fn(&rth, preferred_family,
-					filter_fn) < 0) {
+	struct vnic_lookup vl = {};
+	struct rtattr *tb[IFLA_MAX+1];
+	struct nlmsghdr *answer;
+	int index = 0;
+	__u64 start;
+
+	if (get_addr_1(&vl.pfx, ipaddr, preferred_family) || !vl.pfx.bytelen) {
+		fprintf(stderr, "Invalid address \"%s\"\n", ipaddr);
+		return -1;
+	}
+
+	start = vnic_trace_now();
+	if (rtnl_addrdump_req(rth, vl.pfx.family, NULL) < 0) {
 		perror("Cannot send dump request");
-		return 1;
+		return -1;
 	}
 
-	if (rtnl_dump_filter(&rth, store_nlmsg, linfo) < 0) {
+	if (rtnl_dump_filter(rth, vnic_match_addr, &vl) < 0 && !vl.ifindex) {
 		fprintf(stderr, "Dump terminated\n");
-		return 1;
+		return -1;
 	}
+	vnic_trace_add(VNIC_TRACE_ADDR, start);
+
+	if (!vl.ifindex)
+		return 0;
 
+	start = vnic_trace_now();
+	answer = vnic_link_get(rth, vl.ifindex, tb);
+	if (!answer)
+		return -1;
+	vnic_trace_add(VNIC_TRACE_LINK, start);
+
+	if (tb[IFLA_LINK])
+		index = rta_getattr_u32(tb[IFLA_LINK]);
+
+	free(answer);
+	return index;
+}
+
+struct vnic_nsid_lookup {
+	inet_prefix	pfx;
+	struct vnic_veth *veth;
+	int		count;
+	int		size;
+	int		ifindex;
+	bool		unsupported;
+};
+
+static int vnic_collect_veth(struct nlmsghdr *n, void *arg)
+{
+	struct vnic_nsid_lookup *vl = arg;
+	struct ifinfomsg *ifi = NLMSG_DATA(n);
+	struct rtattr *tb[IFLA_MAX+1];
+	struct vnic_veth *veth;
+
+	if (n->nlmsg_type != RTM_NEWLINK)
+		return 0;
+
+	if (n->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi)))
+		return -1;
+
+	parse_rtattr_flags(tb, IFLA_MAX, IFLA_RTA(ifi), IFLA_PAYLOAD(n),
+			   NLA_F_NESTED);
+	if (!tb[IFLA_LINK] || !tb[IFLA_LINK_NETNSID])
+		return 0;
+
+	if (vl->count == vl->size) {
+		vl->size = vl->size ? vl->size * 2 : 64;
+		veth = realloc(vl->veth, vl->size * sizeof(*veth));
+		if (!veth)
+			return -1;
+		vl->veth = veth;
+	}
+
+	veth = &vl->veth[vl->count++];
+	veth->ifindex = ifi->ifi_index;
+	veth->nsid = rta_getattr_s32(tb[IFLA_LINK_NETNSID]);
+	veth->peer = rta_getattr_u32(tb[IFLA_LINK]);
 	return 0;
 }
 
-static int ip_addr_list(struct nlmsg_chain *ainfo)
+/* Dump the links of rth's namespace that have a peer in another one.
+ * Returns their number, stored in *veth which the caller frees, or -1.
+ */
+int vnic_veth_dump(struct rtnl_handle *rth, struct vnic_veth **veth)
 {
-	if (rtnl_addrdump_req(&rth, filter.family, ipaddr_dump_filter) < 0) {
+	struct vnic_nsid_lookup vl = {};
+
+	if (rtnl_linkdump_req_filter(rth, AF_UNSPEC,
+				     RTEXT_FILTER_SKIP_STATS) < 0) {
 		perror("Cannot send dump request");
-		return 1;
+		return -1;
 	}
-
-	if (rtnl_dump_filter(&rth, store_nlmsg, ainfo) < 0) {
+	if (rtnl_dump_filter(rth, vnic_collect_veth, &vl) < 0) {
 		fprintf(stderr, "Dump terminated\n");
-		return 1;
+		free(vl.veth);
+		return -1;
 	}
 
-	return 0;
+	*veth = vl.veth;
+	return vl.count;
 }
 
-void ipaddr_reset_filter(int oneline, int ifindex)
+static int vnic_match_target(struct nlmsghdr *n, void *arg)
 {
-	memset(&filter, 0, sizeof(filter)); //&filterの指すアドレスからfilterのサイズ分unsiged char型に変換された0を書き込む
-	filter.oneline = oneline; //link_filter構造体のオブジェクトfilterのメンバであるonelineに引数で与えられたonelineを代入する
-	filter.ifindex = ifindex; //同様にメンバifindexに引数ifindexを代入する
-	filter.group = -1; //メンバgroupに-1を代入する
+	struct vnic_nsid_lookup *vl = arg;
+	struct ifaddrmsg *ifa = NLMSG_DATA(n);
+	struct rtattr *tb[IFA_MAX+1];
+	__u64 start;
+
+	if (n->nlmsg_type != RTM_NEWADDR)
+		return 0;
+
+	if (n->nlmsg_len < NLMSG_LENGTH(sizeof(*ifa)))
+		return -1;
+
+	parse_rtattr(tb, IFA_MAX, IFA_RTA(ifa), IFA_PAYLOAD(n));
+
+	/* a kernel that ignored the target answers for our own namespace */
+	if (!tb[IFA_TARGET_NETNSID]) {
+		vl->unsupported = true;
+		return 0;
+	}
+
+	if (!tb[IFA_LOCAL])
+		tb[IFA_LOCAL] = tb[IFA_ADDRESS];
+	if (!tb[IFA_LOCAL] || vl->ifindex)
+		return 0;
+
+	start = vnic_trace_now();
+	if (ifa->ifa_family == vl->pfx.family &&
+	    RTA_PAYLOAD(tb[IFA_LOCAL]) == vl->pfx.bytelen &&
+	    !memcmp(RTA_DATA(tb[IFA_LOCAL]), vl->pfx.data, vl->pfx.bytelen))
+		vl->ifindex = ifa->ifa_index;
+	vnic_trace_add(VNIC_TRACE_MATCH, start);
+
+	return 0;
 }
 
-int set_iflist(struct nlmsghdr *n, void *arg, int *index, char *name)
+static int vnic_target_dump(struct rtnl_handle *rth,
+			    struct vnic_nsid_lookup *vl, int nsid)
 {
-	FILE *fp = (FILE *)arg;
-	struct ifinfomsg *ifi = NLMSG_DATA(n);
-	struct rtattr *tb[IFLA_MAX+1];
-	int len = n->nlmsg_len;
+	struct {
+		struct nlmsghdr		n;
+		struct ifaddrmsg	ifa;
+		char			buf[64];
+	} req = {
+		.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifaddrmsg)),
+		.n.nlmsg_type = RTM_GETADDR,
+		.ifa.ifa_family = vl->pfx.family,
+	};
+	__u64 start = vnic_trace_now();
+	int saved = rth->flags;
+	int err;
 
-	len -= NLMSG_LENGTH(sizeof(*ifi));
+	addattr32(&req.n, sizeof(req), IFA_TARGET_NETNSID, nsid);
 
-	parse_rtattr_flags(tb, IFLA_MAX, IFLA_RTA(ifi), len, NLA_F_NESTED);
-	*index=ifi->ifi_index;
-	strcpy(name,get_ifname_rta(ifi->ifi_index, tb[IFLA_IFNAME]));
+	if (rtnl_dump_request_n(rth, &req.n) < 0) {
+		perror("Cannot send dump request");
+		return -1;
+	}
 
-	fflush(fp);
-	return 1;
+	rth->flags |= RTNL_HANDLE_F_SUPPRESS_NLERR;
+	err = rtnl_dump_filter(rth, vnic_match_target, vl);
+	rth->flags = saved;
+	vnic_trace_add(VNIC_TRACE_ADDR, start);
+
+	if (err < 0 && (errno == EINVAL || errno == EOPNOTSUPP))
+		vl->unsupported = true;
+	if (vl->unsupported)
+		return -1;
+	if (err < 0)
+		fprintf(stderr, "Dump terminated\n");
+	return err;
 }
 
-int set_iplist(struct ifinfomsg *ifi, struct nlmsg_list *ainfo, FILE *fp, char *addr)
+/* Resolve ipaddr to the host side veth without entering any namespace:
+ * the host link dump already carries IFLA_LINK_NETNSID and IFLA_LINK for
+ * every veth, so one address dump per peer nsid via IFA_TARGET_NETNSID
+ * finds the owner, which maps straight back to the host ifindex.
+ * Returns the host ifindex, 0 if not found, -1 on error and -EOPNOTSUPP
+ * if the kernel cannot dump other namespaces by nsid.
+ */
+int vnic_nsid_lookup(struct rtnl_handle *rth, const char *ipaddr)
 {
-	for ( ; ainfo ;  ainfo = ainfo->next) { //第2引数で与えられたリストを走査する
-		struct nlmsghdr *n = &ainfo->h;
-		struct ifaddrmsg *ifa = NLMSG_DATA(n);
-		struct rtattr *rta_tb[IFA_MAX+1];
+	struct vnic_nsid_lookup vl = {};
+	int i, j, ret = 0;
+	__u64 start;
 
+	if (get_addr_1(&vl.pfx, ipaddr, preferred_family) || !vl.pfx.bytelen)
+		invarg("invalid address", ipaddr);
 
-		if (n->nlmsg_type != RTM_NEWADDR)
-			continue;
+	/* older kernels silently ignore attributes they do not know */
+	if (!(rth->flags & RTNL_HANDLE_F_STRICT_CHK))
+		return -EOPNOTSUPP;
 
-		if (n->nlmsg_len < NLMSG_LENGTH(sizeof(*ifa)))
-			return -1;
+	start = vnic_trace_now();
+	vl.count = vnic_veth_dump(rth, &vl.veth);
+	if (vl.count < 0)
+		return -1;
+	vnic_trace_add(VNIC_TRACE_LINK, start);
 
-		if (ifa->ifa_index != ifi->ifi_index ||
-		    (filter.family && filter.family != ifa->ifa_family))
-			continue;
+	for (i = 0; i < vl.count && !ret; i++) {
+		int nsid = vl.veth[i].nsid;
 
-		if (filter.up && !(ifi->ifi_flags&IFF_UP))
+		/* each namespace only needs to be dumped once */
+		for (j = 0; j < i; j++)
+			if (vl.veth[j].nsid == nsid)
+				break;
+		if (j < i || nsid < 0)
 			continue;
 
-		open_json_object(NULL);
+		if (vnic_target_dump(rth, &vl, nsid) < 0) {
+			ret = vl.unsupported ? -EOPNOTSUPP : -1;
+			goto out;
+		}
 
-		if (!rta_tb[IFA_LOCAL])
-		rta_tb[IFA_LOCAL] = rta_tb[IFA_ADDRESS];
+		for (j = 0; j < vl.count && vl.ifindex; j++) {
+			if (vl.veth[j].nsid == nsid &&
+			    vl.veth[j].peer == vl.ifindex) {
+				ret = vl.veth[j].ifindex;
+				break;
+			}
+		}
+		/* not a veth towards us, e.g. loopback, keep looking */
+		vl.ifindex = 0;
+	}
 
-		parse_rtattr(rta_tb, IFA_MAX, IFA_RTA(ifa),
-		    n->nlmsg_len - NLMSG_LENGTH(sizeof(*ifa)));
-			if (rta_tb[IFA_LOCAL]) strcpy(addr,format_host_rta(ifa->ifa_family, rta_tb[IFA_LOCAL]));
+out:
+	free(vl.veth);
+	return ret;
+}
 
-		close_json_object();
-	}
-	close_json_array(PRINT_JSON, NULL);
-	return 0;
+int coll_ip(char *ipaddr)
+{
+	int index = vnic_peer_index(&rth, ipaddr);
+
+	return index > 0 ? index : 0;
 }
 
-int search_ip(struct ifinfomsg *ifi, struct nlmsg_list *ainfo, FILE *fp,char *ipaddr){
-	for ( ; ainfo ;  ainfo = ainfo->next) { //第2引数で与えられたリストを走査する
-		struct nlmsghdr *n = &ainfo->h;
-		struct ifaddrmsg *ifa = NLMSG_DATA(n);
-		struct rtattr *rta_tb[IFA_MAX+1];
+/* Load the host side veths into the ll_map cache, so that the peer
+ * indexes found in the namespaces resolve without further requests.
+ */
+void make_iflist(void)
+{
+	struct rtnl_dump_arena linfo = {};
+	__u64 start = vnic_trace_now();
+	int i;
+
+	/* a subscribed cache is kept current by link notifications */
+	if (ll_map_subscribed()) {
+		ll_map_sync();
+		vnic_trace_add(VNIC_TRACE_LINK, start);
+		return;
+	}
 
+	ipaddr_reset_filter(oneline, 0);
+	filter.kind = "veth";
 
-		if (n->nlmsg_type != RTM_NEWADDR)
-			continue;
+	if (ip_link_list(iplink_filter_req, &linfo) == 0) {
+		for (i = 0; i < linfo.count; i++)
+			ll_remember_index(linfo.msgs[i], NULL);
+	}
 
-		if (n->nlmsg_len < NLMSG_LENGTH(sizeof(*ifa)))
-			return -1;
+	rtnl_arena_free(&linfo);
+	vnic_trace_add(VNIC_TRACE_LINK, start);
+}
 
-		if (ifa->ifa_index != ifi->ifi_index ||
-		    (filter.family && filter.family != ifa->ifa_family))
-			continue;
+void search_name(int number)
+{
+	__u64 start = vnic_trace_now();
 
-		if (filter.up && !(ifi->ifi_flags&IFF_UP))
-			continue;
+	printf("%s\n", ll_index_to_name(number));
+	fflush(stdout);
+	vnic_trace_add(VNIC_TRACE_OUTPUT, start);
+}
 
-		open_json_object(NULL);
+/* Runs inside the container namespace: report the host side ifindex of
+ * the veth owning ipaddr on stdout, the caller maps it to a name.
+ */
+int coll_name(char **argv)
+{
+	int number = coll_ip(argv[2]);
 
-		if (!rta_tb[IFA_LOCAL])
-		rta_tb[IFA_LOCAL] = rta_tb[IFA_ADDRESS];
+	if (number == 0)
+		return -1;
 
-		parse_rtattr(rta_tb, IFA_MAX, IFA_RTA(ifa),
-		    n->nlmsg_len - NLMSG_LENGTH(sizeof(*ifa)));
-			if (rta_tb[IFA_LOCAL]) {
-				if(strcmp(ipaddr,format_host_rta(ifa->ifa_family, rta_tb[IFA_LOCAL]))==0){
-					return 1;
-				}
-			}
-		close_json_object();
-	}
-	close_json_array(PRINT_JSON, NULL);
+	printf("%d\n", number);
 	return 0;
 }
 
-int search_index(struct nlmsghdr *n, void *arg)
+int get_vnic(char *pid, char *ipaddr)
 {
-	struct ifinfomsg *ifi = NLMSG_DATA(n);
-	struct rtattr *tb[IFLA_MAX+1];
-	int len = n->nlmsg_len;
-	int index;
-
-	len -= NLMSG_LENGTH(sizeof(*ifi));
+	char *new_argv[] = { pid, COMMAND_NAME, ANOTHER_KEY, ipaddr, NULL };
 
-	parse_rtattr_flags(tb, IFLA_MAX, IFLA_RTA(ifi), len, NLA_F_NESTED);
-	if(tb[IFLA_LINK]){
-		index=rta_getattr_u32(tb[IFLA_LINK]);
-	}
-
-	return index;
+	return do_netns_net(4, new_argv) == -1 ? -1 : 0;
 }
 
-int coll_ip(char *ipaddr){
-	struct nlmsg_chain linfo = { NULL, NULL};
-	struct nlmsg_chain _ainfo = { NULL, NULL}, *ainfo = &_ainfo;
-	struct nlmsg_list *l;
-	int no_link = 0;
-	int index=0;
-
-	ipaddr_reset_filter(oneline, 0);
-	filter.showqueue = 1;
-	filter.family = preferred_family;
+struct vnic_reverse {
+	int			peer;
+	char			ifname[IFNAMSIZ];
+	struct rtnl_dump_arena	addrs;
+};
 
-	/*
-	 * Initialize a json_writer and open an array object
-	 * if -json was specified.
-	 */
-	new_json_obj(json);
+/* Runs inside the pod namespace: name the peer and collect its addresses */
+static int vnic_reverse_fn(struct rtnl_handle *rth, const struct netns_pid *ns,
+			   void *arg)
+{
+	struct vnic_reverse *vr = arg;
+	struct rtattr *tb[IFLA_MAX+1];
+	struct nlmsghdr *answer;
+	__u64 start;
 
-	if (filter.ifindex) {
-		if (ipaddr_link_get(filter.ifindex, &linfo) != 0)
-			goto out;
-	} else {
-		if (ip_link_list(iplink_filter_req, &linfo) != 0)
-			goto out;
+	start = vnic_trace_now();
+	answer = vnic_link_get(rth, vr->peer, tb);
+	if (!answer)
+		return -1;
+	if (tb[IFLA_IFNAME])
+		strlcpy(vr->ifname, rta_getattr_str(tb[IFLA_IFNAME]),
+			sizeof(vr->ifname));
+	free(answer);
+	vnic_trace_add(VNIC_TRACE_LINK, start);
+
+	start = vnic_trace_now();
+	if (rtnl_addrdump_req(rth, preferred_family, NULL) < 0) {
+		perror("Cannot send dump request");
+		return -1;
+	}
+	if (rtnl_dump_arena(rth, &vr->addrs) < 0) {
+		fprintf(stderr, "Dump terminated\n");
+		return -1;
 	}
+	vnic_trace_add(VNIC_TRACE_ADDR, start);
+
+	return 1;
+}
 
-	if (filter.family != AF_PACKET) {
-		if (filter.oneline)
-			no_link = 1;
+static void vnic_reverse_print(struct vnic_reverse *vr)
+{
+	struct nlmsghdr *n;
+	int i;
 
-		if (ip_addr_list(ainfo) != 0)
-			goto out;
+	open_json_array(PRINT_JSON, "addresses");
+	for (i = rtnl_arena_first(&vr->addrs, vr->peer); i >= 0;
+	     i = vr->addrs.next[i]) {
+		struct rtattr *tb[IFA_MAX+1];
+		struct ifaddrmsg *ifa;
 
-		ipaddr_filter(&linfo, ainfo);
-	}
-	int i=0;
-	for (l = linfo.head; l; l = l->next) {
-		if(i==0){
-			i=1;
+		n = vr->addrs.msgs[i];
+		if (n->nlmsg_type != RTM_NEWADDR)
+			continue;
+
+		ifa = NLMSG_DATA(n);
+		parse_rtattr(tb, IFA_MAX, IFA_RTA(ifa), IFA_PAYLOAD(n));
+		if (!tb[IFA_LOCAL])
+			tb[IFA_LOCAL] = tb[IFA_ADDRESS];
+		if (!tb[IFA_LOCAL])
 			continue;
-		}
-		struct nlmsghdr *n = &l->h;
-		struct ifinfomsg *ifi = NLMSG_DATA(n);
 
 		open_json_object(NULL);
-		if (brief || !no_link)
-			if(search_ip(ifi, ainfo->head, stdout, ipaddr)==1) index=search_index(n, stdout);
+		print_string(PRINT_FP, NULL, "    %s ",
+			     ifa->ifa_family == AF_INET6 ? "inet6" : "inet");
+		print_string(PRINT_ANY, "local", "%s",
+			     format_host_rta(ifa->ifa_family, tb[IFA_LOCAL]));
+		print_uint(PRINT_ANY, "prefixlen", "/%u\n", ifa->ifa_prefixlen);
 		close_json_object();
 	}
-	return index;
-
-out:
-	free_nlmsg_chain(ainfo);
-	free_nlmsg_chain(&linfo);
-	delete_json_obj();
+	close_json_array(PRINT_JSON, NULL);
 }
 
-void make_iflist(void){
-	struct nlmsg_chain linfo = { NULL, NULL};
-    struct nlmsg_chain _ainfo = { NULL, NULL}, *ainfo = &_ainfo;
-    struct nlmsg_list *l;
-    struct nic_info *ninf=&nic_info;
-    int no_link = 0;
-    
-	ipaddr_reset_filter(oneline, 0);
-    filter.showqueue = 1;
-    filter.family = preferred_family;
-	
-	new_json_obj(json);
+/* Reverse of the address lookup: starting from a host veth, given by name
+ * or ifindex, enter only the namespace its peer lives in and report the
+ * peer's addresses and the processes sharing that namespace.
+ */
+int vnic_reverse(const char *dev)
+{
+	struct vnic_reverse vr = {};
+	struct rtattr *tb[IFLA_MAX+1];
+	struct netns_pid ns;
+	struct nlmsghdr *answer;
+	unsigned int ifindex;
+	int *pids = NULL;
+	int i, nsid, count;
+	__u64 start;
 
-    if (filter.ifindex) {
-        if (ipaddr_link_get(filter.ifindex, &linfo) != 0)
-            goto out;
-    } else {
-        if (ip_link_list(iplink_filter_req, &linfo) != 0)
-            goto out;
-    }
-
-    if (filter.family != AF_PACKET) {
-        if (filter.oneline)
-            no_link = 1;
-
-        if (ip_addr_list(ainfo) != 0)
-            goto out;
-
-        ipaddr_filter(&linfo, ainfo);
-    }
-
-    int i=0;
-    for (l = linfo.head; l; l = l->next) {
-        struct nlmsghdr *n = &l->h;
-        struct ifinfomsg *ifi = NLMSG_DATA(n);
-        int *index=&ninf->if_index[i];
-        char *name=ninf->if_name[i];
-
-        open_json_object(NULL);
-        if (brief || !no_link) set_iflist(n, stdout,index,name);
-        i++;
-        close_json_object();
-    }
-    ninf->if_count=i;
+	make_iflist();
 
-out:
-    free_nlmsg_chain(ainfo);
-    free_nlmsg_chain(&linfo);
-    delete_json_obj();
-    return ;
-}
+	if (get_unsigned(&ifindex, dev, 0) || !ifindex)
+		ifindex = ll_name_to_index(dev);
+	if (!ifindex) {
+		fprintf(stderr, "Cannot find device \"%s\"\n", dev);
+		return -1;
+	}
+
+	start = vnic_trace_now();
+	answer = vnic_link_get(&rth, ifindex, tb);
+	if (!answer)
+		return -1;
+	vnic_trace_add(VNIC_TRACE_LINK, start);
 
-int coll_name(char **argv){
-	char *ipaddr=argv[2];
-	int count=(int)argv[3][0];
-	int temp_index;
+	if (!tb[IFLA_LINK] || !tb[IFLA_LINK_NETNSID]) {
+		fprintf(stderr, "Device \"%s\" has no peer in another namespace\n",
+			dev);
+		free(answer);
+		return -1;
+	}
+	vr.peer = rta_getattr_u32(tb[IFLA_LINK]);
+	nsid = rta_getattr_s32(tb[IFLA_LINK_NETNSID]);
+	free(answer);
 
-    int number=coll_ip(ipaddr);
-	if(number==0) return -1;
+	start = vnic_trace_now();
+	if (netns_pid_by_nsid(nsid, &ns) < 0) {
+		fprintf(stderr, "No process found in netns id %d\n", nsid);
+		return -1;
+	}
+	count = netns_pid_members(&ns, &pids);
+	vnic_trace_add(VNIC_TRACE_PIDS, start);
+	if (count < 0)
+		return -1;
 
-	for(int i=0;i<count;i++){
-		temp_index=(int)argv[2*i+4][0];
-		if(temp_index==number){
-			printf("%s\n",argv[2*i+5]);
-		}
+	if (netns_pool_foreach(&ns, 1, 1, vnic_reverse_fn, &vr) <= 0) {
+		rtnl_arena_free(&vr.addrs);
+		free(pids);
+		return -1;
 	}
-    return 0;
-}
 
-int get_vnic(char *pid, char *ipaddr)
-{
-    char tmp_count;
-    struct nic_info *ninf=&nic_info;
-
-    make_iflist();
-
-	char *new_argv[2*(ninf->if_count)+8];
-    char tmp_index[ninf->if_count];
-    tmp_count=(char)ninf->if_count;
-    new_argv[0]=pid;
-    new_argv[1]=COMMAND_NAME;
-    new_argv[2]=ANOTHER_KEY;
-    new_argv[3]=ipaddr;
-    new_argv[4]=&tmp_count;
-
-    for(int i=0;i<ninf->if_count;i++){
-        tmp_index[i]=(char)(ninf->if_index[i]);
-        new_argv[2*i+5]=&tmp_index[i];
-        new_argv[2*i+6]=ninf->if_name[i];
-        }
-        if(do_netns(2*(ninf->if_count)+5,new_argv)==-1) return -1;
-
-    return 0;
+	start = vnic_trace_now();
+	new_json_obj(json);
+	open_json_object(NULL);
+	print_string(PRINT_ANY, "ifname", "%s", ll_index_to_name(ifindex));
+	print_uint(PRINT_ANY, "ifindex", "(%u) ", ifindex);
+	print_string(PRINT_ANY, "peer", "peer %s", vr.ifname);
+	print_int(PRINT_ANY, "peer_ifindex", "(%d) ", vr.peer);
+	print_int(PRINT_ANY, "link_netnsid", "link-netnsid %d ", nsid);
+	print_lluint(PRINT_ANY, "netns_inode", "netns %llu\n",
+		     (unsigned long long)ns.ino);
+	vnic_reverse_print(&vr);
+	open_json_array(PRINT_JSON, "pids");
+	print_string(PRINT_FP, NULL, "%s", "    pids");
+	for (i = 0; i < count; i++)
+		print_int(PRINT_ANY, NULL, " %d", pids[i]);
+	print_string(PRINT_FP, NULL, "%s", "\n");
+	close_json_array(PRINT_JSON, NULL);
+	close_json_object();
+	delete_json_obj();
+	fflush(stdout);
+	vnic_trace_add(VNIC_TRACE_OUTPUT, start);
+
+	rtnl_arena_free(&vr.addrs);
+	free(pids);
+	return 0;
 }
\ No newline at end of file
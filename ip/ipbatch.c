@@ -0,0 +1,334 @@
+/*
+ * ipbatch.c		Resolve many container addresses in one pass.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#include "utils.h"
+#include "ip_common.h"
+
+/*
+ * Instead of searching every namespace once per address, the addresses
+ * are put in a hash set and every namespace is visited exactly once: one
+ * address dump is matched against the whole set, and only namespaces that
+ * own something get a link dump to learn the host side peers.
+ */
+
+struct vnic_query {
+	char			*addr;
+	inet_prefix		pfx;
+	const struct netns_pid	*ns;
+	int			ifindex;
+};
+
+struct vnic_batch {
+	struct vnic_query	*q;
+	int			count;
+	int			*slots;
+	unsigned int		mask;
+	pthread_mutex_t		lock;
+};
+
+struct vnic_hit {
+	int			query;
+	int			ifindex;
+	int			peer;
+};
+
+struct vnic_batch_ns {
+	struct vnic_batch	*vb;
+	struct vnic_hit		*hits;
+	int			count;
+	int			size;
+};
+
+static unsigned int vnic_batch_hash(int family, const void *addr, int len)
+{
+	const __u8 *p = addr;
+	unsigned int hash = 2166136261u ^ family;
+
+	while (len--)
+		hash = (hash ^ *p++) * 16777619u;
+
+	return hash;
+}
+
+static int *vnic_batch_slot(struct vnic_batch *vb, int family,
+			    const void *addr, int len)
+{
+	unsigned int h = vnic_batch_hash(family, addr, len) & vb->mask;
+
+	while (vb->slots[h] >= 0) {
+		const inet_prefix *pfx = &vb->q[vb->slots[h]].pfx;
+
+		if (pfx->family == family && pfx->bytelen == len &&
+		    !memcmp(pfx->data, addr, len))
+			break;
+		h = (h + 1) & vb->mask;
+	}
+	return &vb->slots[h];
+}
+
+static int vnic_batch_build(struct vnic_batch *vb)
+{
+	unsigned int size = 16;
+	int i, n = 0;
+	int *slot;
+
+	while (size < 2 * vb->count)
+		size <<= 1;
+
+	vb->slots = malloc(size * sizeof(*vb->slots));
+	if (!vb->slots)
+		return -1;
+	memset(vb->slots, -1, size * sizeof(*vb->slots));
+	vb->mask = size - 1;
+
+	/* drop duplicates so that every address is reported once */
+	for (i = 0; i < vb->count; i++) {
+		struct vnic_query *q = &vb->q[i];
+
+		slot = vnic_batch_slot(vb, q->pfx.family, q->pfx.data,
+				       q->pfx.bytelen);
+		if (*slot >= 0) {
+			free(q->addr);
+			continue;
+		}
+		vb->q[n] = *q;
+		*slot = n++;
+	}
+	vb->count = n;
+	return 0;
+}
+
+static int vnic_batch_read(struct vnic_batch *vb, const char *file)
+{
+	char *line = NULL;
+	size_t len = 0;
+	int size = 0;
+	int lineno = 0;
+	FILE *fp;
+
+	if (strcmp(file, "-") == 0) {
+		fp = stdin;
+	} else {
+		fp = fopen(file, "r");
+		if (!fp) {
+			fprintf(stderr, "Cannot open file \"%s\" for reading: %s\n",
+				file, strerror(errno));
+			return -1;
+		}
+	}
+
+	while (getline(&line, &len, fp) > 0) {
+		struct vnic_query *q;
+		char *addr = line;
+
+		lineno++;
+		while (isspace(*addr))
+			addr++;
+		addr[strcspn(addr, " \t\r\n#")] = '\0';
+		if (!*addr)
+			continue;
+
+		if (vb->count == size) {
+			size = size ? size * 2 : 1024;
+			q = realloc(vb->q, size * sizeof(*q));
+			if (!q) {
+				fprintf(stderr, "Cannot allocate query list\n");
+				break;
+			}
+			vb->q = q;
+		}
+
+		q = &vb->q[vb->count];
+		memset(q, 0, sizeof(*q));
+		if (get_addr_1(&q->pfx, addr, AF_UNSPEC) || !q->pfx.bytelen) {
+			fprintf(stderr, "Invalid address \"%s\" on line %d\n",
+				addr, lineno);
+			continue;
+		}
+		q->addr = strdup(addr);
+		if (!q->addr)
+			break;
+		vb->count++;
+	}
+
+	free(line);
+	if (fp != stdin)
+		fclose(fp);
+
+	return vnic_batch_build(vb);
+}
+
+static int vnic_batch_addr(struct nlmsghdr *n, void *arg)
+{
+	struct vnic_batch_ns *bn = arg;
+	struct ifaddrmsg *ifa = NLMSG_DATA(n);
+	struct rtattr *tb[IFA_MAX+1];
+	struct vnic_hit *hit;
+	int *slot;
+
+	if (n->nlmsg_type != RTM_NEWADDR)
+		return 0;
+
+	if (n->nlmsg_len < NLMSG_LENGTH(sizeof(*ifa)))
+		return -1;
+
+	parse_rtattr(tb, IFA_MAX, IFA_RTA(ifa), IFA_PAYLOAD(n));
+	if (!tb[IFA_LOCAL])
+		tb[IFA_LOCAL] = tb[IFA_ADDRESS];
+	if (!tb[IFA_LOCAL])
+		return 0;
+
+	slot = vnic_batch_slot(bn->vb, ifa->ifa_family,
+			       RTA_DATA(tb[IFA_LOCAL]),
+			       RTA_PAYLOAD(tb[IFA_LOCAL]));
+	if (*slot < 0)
+		return 0;
+
+	if (bn->count == bn->size) {
+		bn->size = bn->size ? bn->size * 2 : 16;
+		hit = realloc(bn->hits, bn->size * sizeof(*hit));
+		if (!hit)
+			return -1;
+		bn->hits = hit;
+	}
+
+	hit = &bn->hits[bn->count++];
+	hit->query = *slot;
+	hit->ifindex = ifa->ifa_index;
+	hit->peer = 0;
+	return 0;
+}
+
+static int vnic_batch_link(struct nlmsghdr *n, void *arg)
+{
+	struct vnic_batch_ns *bn = arg;
+	struct ifinfomsg *ifi = NLMSG_DATA(n);
+	struct rtattr *tb[IFLA_MAX+1];
+	int i, peer;
+
+	if (n->nlmsg_type != RTM_NEWLINK)
+		return 0;
+
+	if (n->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi)))
+		return -1;
+
+	parse_rtattr_flags(tb, IFLA_MAX, IFLA_RTA(ifi), IFLA_PAYLOAD(n),
+			   NLA_F_NESTED);
+	if (!tb[IFLA_LINK])
+		return 0;
+
+	peer = rta_getattr_u32(tb[IFLA_LINK]);
+	for (i = 0; i < bn->count; i++) {
+		if (bn->hits[i].ifindex == ifi->ifi_index)
+			bn->hits[i].peer = peer;
+	}
+	return 0;
+}
+
+static int vnic_batch_fn(struct rtnl_handle *rth, const struct netns_pid *ns,
+			 void *arg)
+{
+	struct vnic_batch_ns bn = { .vb = arg };
+	struct vnic_batch *vb = arg;
+	int i;
+
+	if (rtnl_addrdump_req(rth, preferred_family, NULL) < 0) {
+		perror("Cannot send dump request");
+		return -1;
+	}
+	if (rtnl_dump_filter(rth, vnic_batch_addr, &bn) < 0) {
+		fprintf(stderr, "Dump terminated\n");
+		goto out;
+	}
+
+	if (!bn.count)
+		goto out;
+
+	if (rtnl_linkdump_req_filter(rth, AF_UNSPEC,
+				     RTEXT_FILTER_SKIP_STATS) < 0) {
+		perror("Cannot send dump request");
+		goto out;
+	}
+	if (rtnl_dump_filter(rth, vnic_batch_link, &bn) < 0) {
+		fprintf(stderr, "Dump terminated\n");
+		goto out;
+	}
+
+	pthread_mutex_lock(&vb->lock);
+	for (i = 0; i < bn.count; i++) {
+		struct vnic_query *q = &vb->q[bn.hits[i].query];
+
+		/* loopback and friends have no host side peer */
+		if (bn.hits[i].peer <= 0 || q->ifindex)
+			continue;
+		q->ifindex = bn.hits[i].peer;
+		q->ns = ns;
+	}
+	pthread_mutex_unlock(&vb->lock);
+
+out:
+	free(bn.hits);
+	return 0;
+}
+
+/* Read addresses, one per line, from file ("-" for stdin) and print the
+ * host veth of every address found in the namespaces of list, in input
+ * order.  Returns the number of addresses resolved or -1 on error.
+ */
+int vnic_batch(const char *file, const struct netns_pid *list, int count,
+	       int workers)
+{
+	struct vnic_batch vb = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+	};
+	int i, found = 0;
+
+	if (vnic_batch_read(&vb, file) < 0) {
+		free(vb.q);
+		return -1;
+	}
+
+	if (vb.count && netns_pool_foreach(list, count, workers,
+					   vnic_batch_fn, &vb) < 0)
+		found = -1;
+
+	ll_init_map(&rth);
+
+	new_json_obj(json);
+	for (i = 0; i < vb.count; i++) {
+		struct vnic_query *q = &vb.q[i];
+
+		if (q->ifindex) {
+			open_json_object(NULL);
+			print_string(PRINT_ANY, "address", "%s ", q->addr);
+			print_string(PRINT_ANY, "ifname", "%s",
+				     ll_index_to_name(q->ifindex));
+			print_string(PRINT_JSON, "pid", NULL, q->ns->pid);
+			print_string(PRINT_FP, NULL, "%s", "\n");
+			close_json_object();
+			if (found >= 0)
+				found++;
+		}
+		free(q->addr);
+	}
+	delete_json_obj();
+
+	pthread_mutex_destroy(&vb.lock);
+	free(vb.slots);
+	free(vb.q);
+	return found;
+}
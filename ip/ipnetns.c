@@ -14,11 +14,14 @@
 #include <errno.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <regex.h>
 #include <linux/limits.h>
 
 #include <linux/net_namespace.h>
 
 #include "utils.h"
+#include "list.h"
 #include "namespace.h"
 #include "ip_common.h"
 
@@ -95,6 +98,69 @@ void netns_nsid_socket_init(void)
 
 }
 
+/* Return the nsid our namespace uses for the network namespace fd refers
+ * to, -1 if none is assigned, or < -1 on error.
+ */
+int get_netnsid_from_fd(int fd)
+{
+	struct {
+		struct nlmsghdr n;
+		struct rtgenmsg g;
+		char            buf[1024];
+	} req = {
+		.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtgenmsg)),
+		.n.nlmsg_flags = NLM_F_REQUEST,
+		.n.nlmsg_type = RTM_GETNSID,
+		.g.rtgen_family = AF_UNSPEC,
+	};
+	struct rtattr *tb[NETNSA_MAX + 1];
+	struct nlmsghdr *answer;
+	struct rtgenmsg *rthdr;
+	int len, ret = -1;
+
+	netns_nsid_socket_init();
+	if (rtnsh.fd < 0)
+		return -2;
+
+	addattr32(&req.n, 1024, NETNSA_FD, fd);
+	if (rtnl_talk(&rtnsh, &req.n, &answer) < 0)
+		return -2;
+
+	/* Validate message and parse attributes */
+	if (answer->nlmsg_type == NLMSG_ERROR)
+		goto out;
+
+	rthdr = NLMSG_DATA(answer);
+	len = answer->nlmsg_len - NLMSG_SPACE(sizeof(*rthdr));
+	if (len < 0)
+		goto out;
+
+	parse_rtattr(tb, NETNSA_MAX, NETNS_RTA(rthdr), len);
+
+	if (tb[NETNSA_NSID])
+		ret = rta_getattr_s32(tb[NETNSA_NSID]);
+
+out:
+	free(answer);
+	return ret;
+}
+
+/* Same for the network namespace of pid */
+int get_netnsid_from_pid(const char *pid)
+{
+	char net_path[PATH_MAX];
+	int fd, ret;
+
+	snprintf(net_path, sizeof(net_path), "/proc/%s/ns/net", pid);
+	fd = open(net_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -2;
+
+	ret = get_netnsid_from_fd(fd);
+	close(fd);
+	return ret;
+}
+
 int netns_identify_pid(const char *pidstr, char *name, int len)
 {
 	char net_path[PATH_MAX];
@@ -159,6 +225,554 @@ out:
 
 }
 
+static int netns_ns_cmp(const void *a, const void *b)
+{
+	const struct netns_pid *na = a, *nb = b;
+
+	if (na->dev != nb->dev)
+		return na->dev < nb->dev ? -1 : 1;
+	if (na->ino != nb->ino)
+		return na->ino < nb->ino ? -1 : 1;
+	return 0;
+}
+
+static int netns_pid_cmp(const void *a, const void *b)
+{
+	const struct netns_pid *na = a, *nb = b;
+
+	return netns_ns_cmp(a, b) ?: atoi(na->pid) - atoi(nb->pid);
+}
+
+static int read_comm(const char *pid, char *comm, size_t len)
+{
+	char path[PATH_MAX];
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%s/comm", pid);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	n = read(fd, comm, len - 1);
+	close(fd);
+	if (n <= 0)
+		return -1;
+
+	if (comm[n - 1] == '\n')
+		n--;
+	comm[n] = '\0';
+	return 0;
+}
+
+/* Walk /proc for processes whose name matches the comm pattern (like
+ * pgrep), sorted by the (st_dev, st_ino) of /proc/<pid>/ns/net and pid.
+ * Our own namespace is skipped, it never holds the pod side of a veth.
+ * With unique only the lowest pid of every namespace is kept.  Returns
+ * the number of entries stored in *list, which the caller frees, or -1.
+ */
+static int netns_pid_collect(const char *comm, struct netns_pid **list,
+			     bool unique)
+{
+	struct netns_pid *nsp = NULL, *tmp;
+	struct dirent *entry;
+	struct stat self, st;
+	int count = 0, size = 0;
+	int i, n;
+	regex_t re;
+	DIR *dir;
+
+	if (regcomp(&re, comm, REG_EXTENDED | REG_NOSUB) != 0) {
+		fprintf(stderr, "Invalid process name pattern \"%s\"\n", comm);
+		return -1;
+	}
+
+	if (stat("/proc/self/ns/net", &self) < 0) {
+		fprintf(stderr, "Stat of netns failed: %s\n", strerror(errno));
+		goto err;
+	}
+
+	dir = opendir("/proc");
+	if (!dir) {
+		fprintf(stderr, "Failed to open directory /proc: %s\n",
+			strerror(errno));
+		goto err;
+	}
+
+	while ((entry = readdir(dir))) {
+		char net_path[PATH_MAX];
+		char name[64];
+
+		if (!isdigit(entry->d_name[0]))
+			continue;
+		if (read_comm(entry->d_name, name, sizeof(name)) < 0)
+			continue;
+		if (regexec(&re, name, 0, NULL, 0) != 0)
+			continue;
+
+		snprintf(net_path, sizeof(net_path), "/proc/%s/ns/net",
+			 entry->d_name);
+		if (stat(net_path, &st) < 0)
+			continue;
+		if (st.st_dev == self.st_dev && st.st_ino == self.st_ino)
+			continue;
+
+		if (count == size) {
+			size = size ? size * 2 : 64;
+			tmp = realloc(nsp, size * sizeof(*nsp));
+			if (!tmp) {
+				fprintf(stderr, "Cannot allocate pid list\n");
+				closedir(dir);
+				free(nsp);
+				goto err;
+			}
+			nsp = tmp;
+		}
+		nsp[count].dev = st.st_dev;
+		nsp[count].ino = st.st_ino;
+		strlcpy(nsp[count].pid, entry->d_name, sizeof(nsp[count].pid));
+		count++;
+	}
+	closedir(dir);
+	regfree(&re);
+
+	qsort(nsp, count, sizeof(*nsp), netns_pid_cmp);
+	for (i = 0, n = 0; i < count; i++) {
+		if (unique && n && nsp[n - 1].dev == nsp[i].dev &&
+		    nsp[n - 1].ino == nsp[i].ino)
+			continue;
+		nsp[n++] = nsp[i];
+	}
+
+	*list = nsp;
+	return n;
+
+err:
+	regfree(&re);
+	return -1;
+}
+
+/* One pid per network namespace of the processes matching comm */
+int netns_pid_scan(const char *comm, struct netns_pid **list)
+{
+	return netns_pid_collect(comm, list, true);
+}
+
+/* Every process matching comm, grouped by network namespace */
+int netns_pid_scan_all(const char *comm, struct netns_pid **list)
+{
+	return netns_pid_collect(comm, list, false);
+}
+
+static int netns_int_cmp(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/* Collect the pids of every process in the network namespace of ns, in
+ * ascending order.  Returns their number, stored in *pids which the caller
+ * frees, or -1 on error.
+ */
+int netns_pid_members(const struct netns_pid *ns, int **pids)
+{
+	struct dirent *entry;
+	int count = 0, size = 0;
+	int *list = NULL, *tmp;
+	struct stat st;
+	DIR *dir;
+
+	dir = opendir("/proc");
+	if (!dir) {
+		fprintf(stderr, "Failed to open directory /proc: %s\n",
+			strerror(errno));
+		return -1;
+	}
+
+	while ((entry = readdir(dir))) {
+		char net_path[PATH_MAX];
+
+		if (!isdigit(entry->d_name[0]))
+			continue;
+
+		snprintf(net_path, sizeof(net_path), "/proc/%s/ns/net",
+			 entry->d_name);
+		if (stat(net_path, &st) < 0 ||
+		    st.st_dev != ns->dev || st.st_ino != ns->ino)
+			continue;
+
+		if (count == size) {
+			size = size ? size * 2 : 16;
+			tmp = realloc(list, size * sizeof(*list));
+			if (!tmp) {
+				fprintf(stderr, "Cannot allocate pid list\n");
+				closedir(dir);
+				free(list);
+				return -1;
+			}
+			list = tmp;
+		}
+		list[count++] = atoi(entry->d_name);
+	}
+	closedir(dir);
+
+	qsort(list, count, sizeof(*list), netns_int_cmp);
+	*pids = list;
+	return count;
+}
+
+/* Find a process living in the namespace that has nsid in ours.  Returns
+ * 0 and fills ns, or -1 if there is none.
+ */
+int netns_pid_by_nsid(int nsid, struct netns_pid *ns)
+{
+	struct netns_pid *list;
+	int i, count, ret = -1;
+
+	count = netns_pid_scan(".", &list);
+	if (count < 0)
+		return -1;
+
+	for (i = 0; i < count; i++) {
+		if (get_netnsid_from_pid(list[i].pid) == nsid) {
+			*ns = list[i];
+			ret = 0;
+			break;
+		}
+	}
+
+	free(list);
+	return ret;
+}
+
+/* Move the calling thread into the network namespace of pid and open an
+ * rtnetlink socket there.
+ */
+static int netns_rtnl_enter(const char *pid, struct rtnl_handle *rth)
+{
+	if (netns_switch_net((char *)pid) < 0)
+		return -1;
+
+	if (rtnl_open(rth, 0) < 0)
+		return -1;
+	rtnl_set_strict_dump(rth);
+	return 0;
+}
+
+struct netns_open {
+	const char		*pid;
+	struct rtnl_handle	*rth;
+	int			err;
+};
+
+static void *netns_open_thread(void *arg)
+{
+	struct netns_open *no = arg;
+
+	no->err = netns_rtnl_enter(no->pid, no->rth);
+	return NULL;
+}
+
+/* Open an rtnetlink socket inside the network namespace of pid.  A socket
+ * stays bound to the namespace it was created in, so once the helper
+ * thread that made it is gone the caller can use it from any thread
+ * without ever leaving its own namespace.
+ */
+int netns_rtnl_open(const char *pid, struct rtnl_handle *rth)
+{
+	struct netns_open no = {
+		.pid = pid,
+		.rth = rth,
+		.err = -1,
+	};
+	pthread_t thread;
+	int err;
+
+	rth->fd = -1;
+	err = pthread_create(&thread, NULL, netns_open_thread, &no);
+	if (err) {
+		fprintf(stderr, "Cannot create netns thread: %s\n",
+			strerror(err));
+		return -1;
+	}
+	pthread_join(thread, NULL);
+
+	if (no.err)
+		rtnl_close(rth);
+	return no.err;
+}
+
+/*
+ * Sockets opened in pod namespaces are kept across lookups, keyed by the
+ * (st_dev, st_ino) of the namespace.  A socket pins its namespace, so the
+ * pool is pruned against every fresh pid scan to let deleted pods go.
+ */
+#define NETNS_SOCK_HASH		256
+
+struct netns_sock {
+	struct hlist_node	hash;
+	dev_t			dev;
+	ino_t			ino;
+	struct rtnl_handle	rth;
+};
+
+static struct hlist_head netns_sock_head[NETNS_SOCK_HASH];
+static pthread_mutex_t netns_sock_lock = PTHREAD_MUTEX_INITIALIZER;
+static int netns_home = -1;
+
+static struct netns_sock *netns_sock_lookup(dev_t dev, ino_t ino)
+{
+	struct hlist_node *n;
+
+	hlist_for_each(n, &netns_sock_head[ino % NETNS_SOCK_HASH]) {
+		struct netns_sock *sk = container_of(n, struct netns_sock, hash);
+
+		if (sk->dev == dev && sk->ino == ino)
+			return sk;
+	}
+	return NULL;
+}
+
+/* Open a socket in ns from the calling thread, which goes back to our
+ * own namespace right after; cheaper than a helper thread per socket.
+ */
+static struct netns_sock *netns_sock_open(const struct netns_pid *ns)
+{
+	struct netns_sock *sk;
+	int err;
+
+	pthread_mutex_lock(&netns_sock_lock);
+	if (netns_home < 0)
+		netns_home = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+	pthread_mutex_unlock(&netns_sock_lock);
+	if (netns_home < 0) {
+		fprintf(stderr, "Cannot open own network namespace: %s\n",
+			strerror(errno));
+		return NULL;
+	}
+
+	sk = calloc(1, sizeof(*sk));
+	if (!sk)
+		return NULL;
+	sk->dev = ns->dev;
+	sk->ino = ns->ino;
+	sk->rth.fd = -1;
+
+	err = netns_rtnl_enter(ns->pid, &sk->rth);
+	if (setns(netns_home, CLONE_NEWNET) < 0) {
+		fprintf(stderr, "Cannot return to own network namespace: %s\n",
+			strerror(errno));
+		err = -1;
+	}
+	if (err) {
+		rtnl_close(&sk->rth);
+		free(sk);
+		return NULL;
+	}
+	return sk;
+}
+
+/* Return the pooled socket of ns, opening it on first use.  The caller
+ * must be the only user of ns at a time, which netns_pool_foreach()
+ * guarantees by handing every namespace to a single worker.
+ */
+static struct rtnl_handle *netns_sock_get(const struct netns_pid *ns)
+{
+	struct netns_sock *sk, *old;
+	__u64 start = vnic_trace_now();
+
+	pthread_mutex_lock(&netns_sock_lock);
+	sk = netns_sock_lookup(ns->dev, ns->ino);
+	pthread_mutex_unlock(&netns_sock_lock);
+	if (sk)
+		return &sk->rth;
+
+	sk = netns_sock_open(ns);
+	if (!sk)
+		return NULL;
+
+	pthread_mutex_lock(&netns_sock_lock);
+	old = netns_sock_lookup(ns->dev, ns->ino);
+	if (!old)
+		hlist_add_head(&sk->hash,
+			       &netns_sock_head[ns->ino % NETNS_SOCK_HASH]);
+	pthread_mutex_unlock(&netns_sock_lock);
+
+	if (old) {
+		rtnl_close(&sk->rth);
+		free(sk);
+		sk = old;
+	}
+	vnic_trace_add(VNIC_TRACE_NETNS, start);
+	return &sk->rth;
+}
+
+/* A dump abandoned early is still running in the kernel and would make
+ * the next request on the socket fail with EBUSY, so read off whatever is
+ * left.  Pod namespaces are small, this is a handful of datagrams at most.
+ */
+static void netns_sock_drain(struct rtnl_handle *rth)
+{
+	char buf[8192];
+
+	while (recv(rth->fd, buf, sizeof(buf), MSG_DONTWAIT | MSG_TRUNC) >= 0)
+		;
+}
+
+/* Close the pooled sockets of namespaces no longer in list, as returned
+ * by netns_pid_scan().  Returns the number of sockets closed.
+ */
+int netns_sock_prune(const struct netns_pid *list, int count)
+{
+	struct hlist_node *n, *tmp;
+	int i, closed = 0;
+
+	pthread_mutex_lock(&netns_sock_lock);
+	for (i = 0; i < NETNS_SOCK_HASH; i++) {
+		hlist_for_each_safe(n, tmp, &netns_sock_head[i]) {
+			struct netns_sock *sk
+				= container_of(n, struct netns_sock, hash);
+			struct netns_pid key = {
+				.dev = sk->dev,
+				.ino = sk->ino,
+			};
+
+			if (bsearch(&key, list, count, sizeof(*list),
+				    netns_ns_cmp))
+				continue;
+
+			hlist_del(&sk->hash);
+			rtnl_close(&sk->rth);
+			free(sk);
+			closed++;
+		}
+	}
+	pthread_mutex_unlock(&netns_sock_lock);
+	return closed;
+}
+
+/* Run fn over the pooled rtnetlink socket of ns.  The calling thread only
+ * changes namespace, briefly, when the socket has to be opened.
+ */
+static int netns_rtnl_run(const struct netns_pid *ns, netns_rtnl_fn_t fn,
+			  void *arg)
+{
+	struct rtnl_handle *nsrth;
+	int ret;
+
+	nsrth = netns_sock_get(ns);
+	if (!nsrth)
+		return -1;
+
+	ret = fn(nsrth, ns, arg);
+
+	netns_sock_drain(nsrth);
+	return ret;
+}
+
+struct netns_pool {
+	pthread_mutex_t		lock;
+	const struct netns_pid	*list;
+	int			count;
+	int			next;
+	int			result;
+	netns_rtnl_fn_t		fn;
+	void			*arg;
+};
+
+static void *netns_pool_worker(void *arg)
+{
+	struct netns_pool *pool = arg;
+	int i, ret;
+
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		/* stop handing out namespaces once one of them asked to */
+		if (pool->result > 0 || pool->next >= pool->count) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		i = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+
+		ret = netns_rtnl_run(&pool->list[i], pool->fn, pool->arg);
+		if (ret <= 0)
+			continue;
+
+		pthread_mutex_lock(&pool->lock);
+		if (!pool->result)
+			pool->result = ret;
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	return NULL;
+}
+
+/* Run fn once in every namespace of list without leaving the process.
+ * Up to workers threads visit namespaces concurrently, each joining a
+ * namespace and handing fn an rtnetlink socket opened inside it.  The
+ * first positive value fn returns stops the remaining namespaces from
+ * being visited and is returned; otherwise 0, or -1 if no worker could
+ * be started.
+ */
+int netns_pool_foreach(const struct netns_pid *list, int count, int workers,
+		       netns_rtnl_fn_t fn, void *arg)
+{
+	struct netns_pool pool = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.list = list,
+		.count = count,
+		.fn = fn,
+		.arg = arg,
+	};
+	pthread_t *threads;
+	int i, started = 0;
+	int err;
+
+	if (workers > count)
+		workers = count;
+	if (workers < 1)
+		return 0;
+
+	threads = calloc(workers, sizeof(*threads));
+	if (!threads) {
+		fprintf(stderr, "Cannot allocate lookup threads\n");
+		return -1;
+	}
+
+	for (i = 0; i < workers; i++) {
+		err = pthread_create(&threads[i], NULL, netns_pool_worker, &pool);
+		if (err) {
+			fprintf(stderr, "Cannot create lookup thread: %s\n",
+				strerror(err));
+			break;
+		}
+		started++;
+	}
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+	pthread_mutex_destroy(&pool.lock);
+
+	return started ? pool.result : -1;
+}
+
+static int netns_peer_fn(struct rtnl_handle *rth, const struct netns_pid *ns,
+			 void *arg)
+{
+	return vnic_peer_index(rth, arg);
+}
+
+/* Resolve ipaddr in the namespaces of list, the first match wins.  Returns
+ * the host side peer ifindex, 0 if no namespace owns the address.
+ */
+int netns_peer_search(const struct netns_pid *list, int count,
+		      const char *ipaddr, int workers)
+{
+	return netns_pool_foreach(list, count, workers, netns_peer_fn,
+				  (void *)ipaddr);
+}
+
 static int do_switch(void *arg)
 {
 	char *netns = arg;
@@ -171,17 +785,35 @@ static int do_switch(void *arg)
 	return netns_switch(netns);
 }
 
-static int netns_exec(int argc, char **argv)
+/* For commands that only use netlink: no mount namespace, /sys or /etc */
+static int do_switch_net(void *arg)
+{
+	char *netns = arg;
+
+	vrf_reset();
+
+	return netns_switch_net(netns);
+}
+
+static int netns_exec(int argc, char **argv, int (*setup)(void *))
 {
 	if (argc < 1) {
 		fprintf(stderr, "No netns name specified\n");
 		return -1;
 	}
-	return cmd_exec(argv[1], argv + 1, false, do_switch, argv[0]);
+	return cmd_exec(argv[1], argv + 1, false, setup, argv[0]);
 }
 int do_netns(int argc, char **argv)
 {
 	netns_nsid_socket_init();
 
-    return netns_exec(argc, argv);
+    return netns_exec(argc, argv, do_switch);
+}
+
+/* Like do_netns(), but only the network namespace is switched */
+int do_netns_net(int argc, char **argv)
+{
+	netns_nsid_socket_init();
+
+	return netns_exec(argc, argv, do_switch_net);
 }
@@ -0,0 +1,654 @@
+/*
+ * ipsnap.c		Export the pod network map of the host in one pass.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <byteswap.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "utils.h"
+#include "json_writer.h"
+#include "vnic_snapshot.h"
+#include "ip_common.h"
+
+/*
+ * Every namespace is visited once by the worker pool, which dumps its
+ * links and addresses into a per namespace part.  The host side peers are
+ * then matched from a single host link dump by (nsid, peer ifindex), and
+ * the parts are laid out in the format of vnic_snapshot.h.
+ */
+
+#define VNIC_SNAP_ALIGN(len)	(((len) + 7) & ~7U)
+
+struct vnic_snap_part {
+	struct vnic_snap_if	*ifs;
+	int			if_count;
+	int			if_size;
+	struct vnic_snap_addr	*addrs;
+	int			addr_count;
+	int			addr_size;
+};
+
+struct vnic_snap_build {
+	const struct netns_pid	*list;
+	struct vnic_snap_part	*parts;
+};
+
+static int vnic_snap_link(struct nlmsghdr *n, void *arg)
+{
+	struct vnic_snap_part *part = arg;
+	struct ifinfomsg *ifi = NLMSG_DATA(n);
+	struct rtattr *tb[IFLA_MAX+1];
+	struct vnic_snap_if *sif;
+
+	if (n->nlmsg_type != RTM_NEWLINK)
+		return 0;
+
+	if (n->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi)))
+		return -1;
+
+	if (part->if_count == part->if_size) {
+		part->if_size = part->if_size ? part->if_size * 2 : 8;
+		sif = realloc(part->ifs, part->if_size * sizeof(*sif));
+		if (!sif)
+			return -1;
+		part->ifs = sif;
+	}
+
+	parse_rtattr_flags(tb, IFLA_MAX, IFLA_RTA(ifi), IFLA_PAYLOAD(n),
+			   NLA_F_NESTED);
+
+	sif = &part->ifs[part->if_count++];
+	memset(sif, 0, sizeof(*sif));
+	sif->ifindex = ifi->ifi_index;
+	if (tb[IFLA_IFNAME])
+		strlcpy(sif->ifname, rta_getattr_str(tb[IFLA_IFNAME]),
+			sizeof(sif->ifname));
+	return 0;
+}
+
+static int vnic_snap_addr(struct nlmsghdr *n, void *arg)
+{
+	struct vnic_snap_part *part = arg;
+	struct ifaddrmsg *ifa = NLMSG_DATA(n);
+	struct rtattr *tb[IFA_MAX+1];
+	struct vnic_snap_addr *sa;
+	int len;
+
+	if (n->nlmsg_type != RTM_NEWADDR)
+		return 0;
+
+	if (n->nlmsg_len < NLMSG_LENGTH(sizeof(*ifa)))
+		return -1;
+
+	parse_rtattr(tb, IFA_MAX, IFA_RTA(ifa), IFA_PAYLOAD(n));
+	if (!tb[IFA_LOCAL])
+		tb[IFA_LOCAL] = tb[IFA_ADDRESS];
+	if (!tb[IFA_LOCAL])
+		return 0;
+
+	len = RTA_PAYLOAD(tb[IFA_LOCAL]);
+	if (len > sizeof(sa->addr))
+		return 0;
+
+	if (part->addr_count == part->addr_size) {
+		part->addr_size = part->addr_size ? part->addr_size * 2 : 8;
+		sa = realloc(part->addrs, part->addr_size * sizeof(*sa));
+		if (!sa)
+			return -1;
+		part->addrs = sa;
+	}
+
+	sa = &part->addrs[part->addr_count++];
+	memset(sa, 0, sizeof(*sa));
+	/* the ifindex for now, turned into the interface record later */
+	sa->iface = ifa->ifa_index;
+	sa->family = ifa->ifa_family;
+	sa->prefixlen = ifa->ifa_prefixlen;
+	memcpy(sa->addr, RTA_DATA(tb[IFA_LOCAL]), len);
+	return 0;
+}
+
+static int vnic_snap_if_cmp(const void *a, const void *b)
+{
+	const struct vnic_snap_if *x = a, *y = b;
+
+	return x->ifindex < y->ifindex ? -1 : x->ifindex > y->ifindex;
+}
+
+/* Regroup the addresses of a part so that every interface owns a
+ * contiguous run of them, and point each at its interface record in the
+ * part; addresses on unknown links are dropped.
+ */
+static int vnic_snap_group(struct vnic_snap_part *part)
+{
+	struct vnic_snap_addr *sorted, *sa;
+	int *owner;
+	int i, n;
+
+	qsort(part->ifs, part->if_count, sizeof(*part->ifs), vnic_snap_if_cmp);
+
+	owner = malloc((part->addr_count + 1) * sizeof(*owner));
+	sorted = malloc((part->addr_count + 1) * sizeof(*sorted));
+	if (!owner || !sorted) {
+		free(owner);
+		free(sorted);
+		return -1;
+	}
+
+	for (i = 0; i < part->addr_count; i++) {
+		struct vnic_snap_if key = {
+			.ifindex = part->addrs[i].iface,
+		};
+		struct vnic_snap_if *sif;
+
+		sif = bsearch(&key, part->ifs, part->if_count,
+			      sizeof(*part->ifs), vnic_snap_if_cmp);
+		owner[i] = sif ? sif - part->ifs : -1;
+		if (sif)
+			sif->addr_count++;
+	}
+
+	for (i = 0, n = 0; i < part->if_count; i++) {
+		part->ifs[i].addr_first = n;
+		n += part->ifs[i].addr_count;
+		part->ifs[i].addr_count = 0;
+	}
+
+	for (i = 0; i < part->addr_count; i++) {
+		struct vnic_snap_if *sif;
+
+		if (owner[i] < 0)
+			continue;
+		sif = &part->ifs[owner[i]];
+		sa = &sorted[sif->addr_first + sif->addr_count++];
+		*sa = part->addrs[i];
+		sa->iface = owner[i];
+	}
+
+	free(part->addrs);
+	free(owner);
+	part->addrs = sorted;
+	part->addr_count = n;
+	part->addr_size = n;
+	return 0;
+}
+
+/* A namespace that could not be dumped completely is left out: its
+ * addresses may still carry raw ifindexes instead of interface records.
+ */
+static void vnic_snap_part_drop(struct vnic_snap_part *part)
+{
+	free(part->ifs);
+	free(part->addrs);
+	memset(part, 0, sizeof(*part));
+}
+
+static int vnic_snap_fn(struct rtnl_handle *rth, const struct netns_pid *ns,
+			void *arg)
+{
+	struct vnic_snap_build *sb = arg;
+	struct vnic_snap_part *part = &sb->parts[ns - sb->list];
+
+	if (rtnl_linkdump_req_filter(rth, AF_UNSPEC,
+				     RTEXT_FILTER_SKIP_STATS) < 0) {
+		perror("Cannot send dump request");
+		goto err;
+	}
+	if (rtnl_dump_filter(rth, vnic_snap_link, part) < 0) {
+		fprintf(stderr, "Dump terminated\n");
+		goto err;
+	}
+
+	if (rtnl_addrdump_req(rth, preferred_family, NULL) < 0) {
+		perror("Cannot send dump request");
+		goto err;
+	}
+	if (rtnl_dump_filter(rth, vnic_snap_addr, part) < 0) {
+		fprintf(stderr, "Dump terminated\n");
+		goto err;
+	}
+
+	if (vnic_snap_group(part) < 0)
+		goto err;
+	return 0;
+
+err:
+	vnic_snap_part_drop(part);
+	return -1;
+}
+
+static int vnic_veth_cmp(const void *a, const void *b)
+{
+	const struct vnic_veth *x = a, *y = b;
+
+	if (x->nsid != y->nsid)
+		return x->nsid < y->nsid ? -1 : 1;
+	return x->peer - y->peer;
+}
+
+static const struct vnic_snap_addr *vnic_snap_sort_base;
+
+static int vnic_snap_index_cmp(const void *a, const void *b)
+{
+	const struct vnic_snap_addr *x = &vnic_snap_sort_base[*(__u32 *)a];
+	const struct vnic_snap_addr *y = &vnic_snap_sort_base[*(__u32 *)b];
+
+	if (x->family != y->family)
+		return x->family - y->family;
+	return memcmp(x->addr, y->addr, sizeof(x->addr));
+}
+
+static void vnic_snap_sect_init(struct vnic_snap_sect *sect, size_t *len,
+				__u32 count, size_t size)
+{
+	sect->off = *len;
+	sect->count = count;
+	*len += VNIC_SNAP_ALIGN(count * size);
+}
+
+/* Lay the parts out as one snapshot image.  all holds every process
+ * outside our namespace grouped by namespace, like list, and supplies the
+ * pids; veth is the host link dump sorted by (nsid, peer).
+ */
+static struct vnic_snap_hdr *
+vnic_snap_layout(const struct netns_pid *list, struct vnic_snap_part *parts,
+		 int count, const struct netns_pid *all, int all_count,
+		 const struct vnic_veth *veth, int veth_count)
+{
+	struct vnic_snap_hdr layout = {};
+	struct vnic_snap_addr *addrs;
+	struct vnic_snap_hdr *hdr;
+	struct vnic_snap_ns *sns;
+	struct vnic_snap_if *ifs;
+	__u32 *pids, *index;
+	int if_count = 0, addr_count = 0;
+	int i, j, p, nif = 0, naddr = 0, npid = 0;
+	size_t len;
+
+	for (i = 0; i < count; i++) {
+		if_count += parts[i].if_count;
+		addr_count += parts[i].addr_count;
+	}
+
+	len = VNIC_SNAP_ALIGN(sizeof(layout));
+	vnic_snap_sect_init(&layout.ns, &len, count, sizeof(*sns));
+	vnic_snap_sect_init(&layout.ifs, &len, if_count, sizeof(*ifs));
+	vnic_snap_sect_init(&layout.addrs, &len, addr_count, sizeof(*addrs));
+	vnic_snap_sect_init(&layout.pids, &len, all_count, sizeof(*pids));
+	vnic_snap_sect_init(&layout.index, &len, addr_count, sizeof(*index));
+
+	hdr = calloc(1, len);
+	if (!hdr)
+		return NULL;
+	*hdr = layout;
+	hdr->magic = VNIC_SNAP_MAGIC;
+	hdr->version = VNIC_SNAP_VERSION;
+	hdr->hdr_len = sizeof(*hdr);
+	hdr->created = time(NULL);
+	hdr->size = len;
+
+	sns = (struct vnic_snap_ns *)vnic_snap_sect(hdr, &hdr->ns);
+	ifs = (struct vnic_snap_if *)vnic_snap_sect(hdr, &hdr->ifs);
+	addrs = (struct vnic_snap_addr *)vnic_snap_sect(hdr, &hdr->addrs);
+	pids = (__u32 *)vnic_snap_sect(hdr, &hdr->pids);
+	index = (__u32 *)vnic_snap_sect(hdr, &hdr->index);
+
+	for (i = 0, p = 0; i < count; i++) {
+		const struct netns_pid *ns = &list[i];
+		struct vnic_snap_part *part = &parts[i];
+		int nsid = get_netnsid_from_pid(ns->pid);
+
+		sns[i].dev = ns->dev;
+		sns[i].ino = ns->ino;
+		sns[i].nsid = nsid >= 0 ? nsid : -1;
+
+		/* both lists are sorted by namespace */
+		while (p < all_count && (all[p].dev < ns->dev ||
+		       (all[p].dev == ns->dev && all[p].ino < ns->ino)))
+			p++;
+		sns[i].pid_first = npid;
+		for (; p < all_count && all[p].dev == ns->dev &&
+		       all[p].ino == ns->ino; p++)
+			pids[npid++] = atoi(all[p].pid);
+		sns[i].pid_count = npid - sns[i].pid_first;
+
+		sns[i].if_first = nif;
+		sns[i].if_count = part->if_count;
+		for (j = 0; j < part->if_count; j++) {
+			struct vnic_snap_if *sif = &ifs[nif + j];
+			struct vnic_veth key = {
+				.nsid = nsid,
+				.peer = part->ifs[j].ifindex,
+			};
+			const struct vnic_veth *host = NULL;
+
+			*sif = part->ifs[j];
+			sif->ns = i;
+			sif->addr_first += naddr;
+
+			if (nsid >= 0)
+				host = bsearch(&key, veth, veth_count,
+					       sizeof(*veth), vnic_veth_cmp);
+			if (host) {
+				sif->host_ifindex = host->ifindex;
+				strlcpy(sif->host_ifname,
+					ll_index_to_name(host->ifindex),
+					sizeof(sif->host_ifname));
+			}
+		}
+
+		for (j = 0; j < part->addr_count; j++) {
+			addrs[naddr + j] = part->addrs[j];
+			addrs[naddr + j].iface = nif +
+				addrs[naddr + j].iface;
+		}
+		nif += part->if_count;
+		naddr += part->addr_count;
+	}
+	hdr->pids.count = npid;
+
+	for (i = 0; i < naddr; i++)
+		index[i] = i;
+	vnic_snap_sort_base = addrs;
+	qsort(index, naddr, sizeof(*index), vnic_snap_index_cmp);
+
+	return hdr;
+}
+
+/* Check that a snapshot read from elsewhere is complete and consistent
+ * before any record of it is used.
+ */
+static int vnic_snap_check(const struct vnic_snap_hdr *hdr, size_t len)
+{
+	const struct vnic_snap_sect *sect[] = {
+		&hdr->ns, &hdr->ifs, &hdr->addrs, &hdr->pids, &hdr->index,
+	};
+	const size_t size[] = {
+		sizeof(struct vnic_snap_ns), sizeof(struct vnic_snap_if),
+		sizeof(struct vnic_snap_addr), sizeof(__u32), sizeof(__u32),
+	};
+	const struct vnic_snap_addr *addrs;
+	const struct vnic_snap_ns *sns;
+	const struct vnic_snap_if *ifs;
+	const __u32 *index;
+	int i;
+
+	if (len >= sizeof(*hdr) && hdr->magic == bswap_32(VNIC_SNAP_MAGIC)) {
+		fprintf(stderr, "Snapshot was written on a host of the other byte order\n");
+		return -1;
+	}
+	if (len < sizeof(*hdr) || hdr->magic != VNIC_SNAP_MAGIC) {
+		fprintf(stderr, "Not a snapshot\n");
+		return -1;
+	}
+	if (hdr->version != VNIC_SNAP_VERSION) {
+		fprintf(stderr, "Unsupported snapshot version %u\n",
+			hdr->version);
+		return -1;
+	}
+	if (hdr->hdr_len < sizeof(*hdr) || hdr->size > len)
+		goto bad;
+
+	for (i = 0; i < ARRAY_SIZE(sect); i++) {
+		if (sect[i]->off % 8 || sect[i]->off > hdr->size ||
+		    sect[i]->count > (hdr->size - sect[i]->off) / size[i])
+			goto bad;
+	}
+
+	sns = vnic_snap_sect(hdr, &hdr->ns);
+	for (i = 0; i < hdr->ns.count; i++) {
+		if ((__u64)sns[i].pid_first + sns[i].pid_count >
+		    hdr->pids.count ||
+		    (__u64)sns[i].if_first + sns[i].if_count > hdr->ifs.count)
+			goto bad;
+	}
+
+	/* names are printed as C strings */
+	ifs = vnic_snap_sect(hdr, &hdr->ifs);
+	for (i = 0; i < hdr->ifs.count; i++) {
+		if ((__u64)ifs[i].addr_first + ifs[i].addr_count >
+		    hdr->addrs.count ||
+		    !memchr(ifs[i].ifname, '\0', sizeof(ifs[i].ifname)) ||
+		    !memchr(ifs[i].host_ifname, '\0',
+			    sizeof(ifs[i].host_ifname)))
+			goto bad;
+	}
+
+	addrs = vnic_snap_sect(hdr, &hdr->addrs);
+	for (i = 0; i < hdr->addrs.count; i++) {
+		if (addrs[i].iface >= hdr->ifs.count)
+			goto bad;
+	}
+
+	/* the lookup searches addrs through the index */
+	if (hdr->index.count != hdr->addrs.count)
+		goto bad;
+	index = vnic_snap_sect(hdr, &hdr->index);
+	for (i = 0; i < hdr->index.count; i++) {
+		if (index[i] >= hdr->addrs.count)
+			goto bad;
+	}
+	return 0;
+
+bad:
+	fprintf(stderr, "Corrupt snapshot\n");
+	return -1;
+}
+
+static void vnic_snap_json(const struct vnic_snap_hdr *hdr, FILE *fp)
+{
+	const struct vnic_snap_ns *sns = vnic_snap_sect(hdr, &hdr->ns);
+	const struct vnic_snap_if *ifs = vnic_snap_sect(hdr, &hdr->ifs);
+	const struct vnic_snap_addr *addrs = vnic_snap_sect(hdr, &hdr->addrs);
+	const __u32 *pids = vnic_snap_sect(hdr, &hdr->pids);
+	json_writer_t *jw;
+	int i, j, k;
+
+	jw = jsonw_new(fp);
+	if (!jw) {
+		fprintf(stderr, "Cannot create JSON writer\n");
+		return;
+	}
+	jsonw_pretty(jw, pretty);
+
+	jsonw_start_object(jw);
+	jsonw_uint_field(jw, "version", hdr->version);
+	jsonw_u64_field(jw, "created", hdr->created);
+	jsonw_name(jw, "namespaces");
+	jsonw_start_array(jw);
+	for (i = 0; i < hdr->ns.count; i++) {
+		jsonw_start_object(jw);
+		jsonw_u64_field(jw, "netns_dev", sns[i].dev);
+		jsonw_u64_field(jw, "netns_inode", sns[i].ino);
+		jsonw_int_field(jw, "nsid", sns[i].nsid);
+
+		jsonw_name(jw, "pids");
+		jsonw_start_array(jw);
+		for (j = 0; j < sns[i].pid_count; j++)
+			jsonw_uint(jw, pids[sns[i].pid_first + j]);
+		jsonw_end_array(jw);
+
+		jsonw_name(jw, "interfaces");
+		jsonw_start_array(jw);
+		for (j = 0; j < sns[i].if_count; j++) {
+			const struct vnic_snap_if *sif = &ifs[sns[i].if_first + j];
+
+			jsonw_start_object(jw);
+			jsonw_string_field(jw, "ifname", sif->ifname);
+			jsonw_uint_field(jw, "ifindex", sif->ifindex);
+			if (sif->host_ifindex) {
+				jsonw_string_field(jw, "host_ifname",
+						   sif->host_ifname);
+				jsonw_uint_field(jw, "host_ifindex",
+						 sif->host_ifindex);
+			}
+
+			jsonw_name(jw, "addresses");
+			jsonw_start_array(jw);
+			for (k = 0; k < sif->addr_count; k++) {
+				const struct vnic_snap_addr *sa;
+				int alen;
+
+				sa = &addrs[sif->addr_first + k];
+				alen = sa->family == AF_INET6 ? 16 : 4;
+
+				jsonw_start_object(jw);
+				jsonw_string_field(jw, "local",
+					rt_addr_n2a(sa->family, alen, sa->addr));
+				jsonw_uint_field(jw, "prefixlen", sa->prefixlen);
+				jsonw_end_object(jw);
+			}
+			jsonw_end_array(jw);
+			jsonw_end_object(jw);
+		}
+		jsonw_end_array(jw);
+		jsonw_end_object(jw);
+	}
+	jsonw_end_array(jw);
+	jsonw_end_object(jw);
+	jsonw_destroy(&jw);
+}
+
+/* Write the binary image, or its JSON rendering with -json, to file ("-"
+ * for stdout).  A file is replaced atomically so that readers which mmap
+ * it never see a partial snapshot.
+ */
+static int vnic_snap_write(const char *file, const struct vnic_snap_hdr *hdr)
+{
+	char tmp[PATH_MAX];
+	FILE *fp;
+
+	if (strcmp(file, "-") == 0) {
+		fp = stdout;
+	} else {
+		snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+		fp = fopen(tmp, "w");
+		if (!fp) {
+			fprintf(stderr, "Cannot open file \"%s\" for writing: %s\n",
+				tmp, strerror(errno));
+			return -1;
+		}
+	}
+
+	if (json)
+		vnic_snap_json(hdr, fp);
+	else
+		fwrite(hdr, hdr->size, 1, fp);
+
+	if (fp == stdout)
+		return fflush(fp) ? -1 : 0;
+
+	if (ferror(fp) | fclose(fp)) {
+		fprintf(stderr, "Cannot write \"%s\"\n", tmp);
+		unlink(tmp);
+		return -1;
+	}
+	if (rename(tmp, file) < 0) {
+		fprintf(stderr, "Cannot rename \"%s\": %s\n", tmp,
+			strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/* Walk every namespace of list once and export the whole map: for each
+ * namespace its pids and interfaces, for each interface its addresses
+ * and host side peer.  Returns the number of namespaces or -1 on error.
+ */
+int vnic_snapshot(const char *file, const struct netns_pid *list, int count,
+		  int workers)
+{
+	struct vnic_snap_build sb = { .list = list };
+	struct netns_pid *all = NULL;
+	struct vnic_veth *veth = NULL;
+	struct vnic_snap_hdr *hdr = NULL;
+	int i, all_count, veth_count;
+	int ret = -1;
+
+	sb.parts = calloc(count + 1, sizeof(*sb.parts));
+	if (!sb.parts)
+		return -1;
+
+	if (netns_pool_foreach(list, count, workers, vnic_snap_fn, &sb) < 0)
+		goto out;
+
+	veth_count = vnic_veth_dump(&rth, &veth);
+	if (veth_count < 0)
+		goto out;
+	qsort(veth, veth_count, sizeof(*veth), vnic_veth_cmp);
+	make_iflist();
+
+	all_count = netns_pid_scan_all(".", &all);
+	if (all_count < 0)
+		goto out;
+
+	hdr = vnic_snap_layout(list, sb.parts, count, all, all_count,
+			       veth, veth_count);
+	if (!hdr) {
+		fprintf(stderr, "Cannot allocate snapshot\n");
+		goto out;
+	}
+
+	if (vnic_snap_write(file, hdr) == 0)
+		ret = count;
+
+out:
+	for (i = 0; i < count; i++) {
+		free(sb.parts[i].ifs);
+		free(sb.parts[i].addrs);
+	}
+	free(sb.parts);
+	free(veth);
+	free(all);
+	free(hdr);
+	return ret;
+}
+
+/* Map a snapshot written by vnic_snapshot() and print it as JSON */
+int vnic_snapshot_show(const char *file)
+{
+	struct vnic_snap_hdr *hdr;
+	struct stat st;
+	int fd, ret = -1;
+
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "Cannot open file \"%s\" for reading: %s\n",
+			file, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(*hdr)) {
+		fprintf(stderr, "Not a snapshot\n");
+		close(fd);
+		return -1;
+	}
+
+	hdr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	if (vnic_snap_check(hdr, st.st_size) == 0) {
+		vnic_snap_json(hdr, stdout);
+		ret = 0;
+	}
+
+	munmap(hdr, st.st_size);
+	return ret;
+}
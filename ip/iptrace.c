@@ -0,0 +1,155 @@
+/*
+ * iptrace.c		Per-phase timing of the veth resolver.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "utils.h"
+#include "json_writer.h"
+#include "ip_common.h"
+
+/*
+ * Every lookup is one sample.  The phases add up the time spent in them
+ * while the sample is open; with a worker pool that is the sum over all
+ * workers, so it may exceed the total.  The address dump includes the
+ * time spent matching, which is reported on its own as well.
+ */
+
+static const char *vnic_trace_names[__VNIC_TRACE_MAX] = {
+	[VNIC_TRACE_PIDS]	= "pids",
+	[VNIC_TRACE_NETNS]	= "netns",
+	[VNIC_TRACE_LINK]	= "link_dump",
+	[VNIC_TRACE_ADDR]	= "addr_dump",
+	[VNIC_TRACE_MATCH]	= "match",
+	[VNIC_TRACE_OUTPUT]	= "output",
+	[VNIC_TRACE_TOTAL]	= "total",
+};
+
+static __u64 vnic_trace_cur[__VNIC_TRACE_MAX];
+static __u64 *vnic_trace_samples[__VNIC_TRACE_MAX];
+static int vnic_trace_count;
+static int vnic_trace_size;
+static __u64 vnic_trace_start;
+
+/* A plain lookup only reports its total, the phases are timed only when
+ * vnic_trace_init() was asked to, that is with -repeat.
+ */
+static int vnic_tracing;
+
+static __u64 vnic_trace_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+__u64 vnic_trace_now(void)
+{
+	return vnic_tracing ? vnic_trace_clock() : 0;
+}
+
+void vnic_trace_add(int phase, __u64 start)
+{
+	if (!vnic_tracing)
+		return;
+
+	__atomic_fetch_add(&vnic_trace_cur[phase], vnic_trace_clock() - start,
+			   __ATOMIC_RELAXED);
+}
+
+int vnic_trace_init(int runs, bool phases)
+{
+	int i;
+
+	for (i = 0; i < __VNIC_TRACE_MAX; i++) {
+		vnic_trace_samples[i] = calloc(runs, sizeof(__u64));
+		if (!vnic_trace_samples[i]) {
+			fprintf(stderr, "Cannot allocate trace samples\n");
+			return -1;
+		}
+	}
+	vnic_trace_size = runs;
+	vnic_trace_count = 0;
+	vnic_tracing = phases;
+	return 0;
+}
+
+void vnic_trace_begin(void)
+{
+	memset(vnic_trace_cur, 0, sizeof(vnic_trace_cur));
+	vnic_trace_start = vnic_trace_clock();
+}
+
+/* Close the current sample and return its total in nanoseconds */
+__u64 vnic_trace_end(void)
+{
+	int i;
+
+	/* the total is always timed */
+	vnic_trace_cur[VNIC_TRACE_TOTAL] = vnic_trace_clock() - vnic_trace_start;
+
+	if (vnic_trace_count < vnic_trace_size) {
+		for (i = 0; i < __VNIC_TRACE_MAX; i++)
+			vnic_trace_samples[i][vnic_trace_count] =
+				vnic_trace_cur[i];
+		vnic_trace_count++;
+	}
+
+	return vnic_trace_cur[VNIC_TRACE_TOTAL];
+}
+
+static int vnic_trace_cmp(const void *a, const void *b)
+{
+	__u64 x = *(const __u64 *)a, y = *(const __u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* nearest rank percentile of a sorted sample */
+static __u64 vnic_trace_pct(const __u64 *v, int n, int pct)
+{
+	int rank = (n * pct + 99) / 100;
+
+	return v[rank > 0 ? rank - 1 : 0];
+}
+
+void vnic_trace_print(FILE *fp)
+{
+	json_writer_t *jw;
+	int i, n = vnic_trace_count;
+
+	jw = jsonw_new(fp);
+	if (!jw) {
+		fprintf(stderr, "Cannot create JSON writer\n");
+		return;
+	}
+	jsonw_pretty(jw, pretty);
+
+	jsonw_start_object(jw);
+	jsonw_int_field(jw, "runs", n);
+	jsonw_string_field(jw, "unit", "ns");
+	for (i = 0; i < __VNIC_TRACE_MAX && n; i++) {
+		__u64 *v = vnic_trace_samples[i];
+
+		qsort(v, n, sizeof(*v), vnic_trace_cmp);
+
+		jsonw_name(jw, vnic_trace_names[i]);
+		jsonw_start_object(jw);
+		jsonw_u64_field(jw, "p50", vnic_trace_pct(v, n, 50));
+		jsonw_u64_field(jw, "p90", vnic_trace_pct(v, n, 90));
+		jsonw_u64_field(jw, "p99", vnic_trace_pct(v, n, 99));
+		jsonw_u64_field(jw, "max", v[n - 1]);
+		jsonw_end_object(jw);
+	}
+	jsonw_end_object(jw);
+	jsonw_destroy(&jw);
+}
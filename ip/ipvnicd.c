@@ -0,0 +1,993 @@
+/*
+ * ipvnicd.c		Resident container address to host veth resolver.
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <net/if.h>
+
+#include <linux/net_namespace.h>
+
+#include "utils.h"
+#include "list.h"
+#include "namespace.h"
+#include "ip_common.h"
+
+/*
+ * The daemon keeps two tables current:
+ *
+ *  - addresses seen in pod namespaces, keyed by address and resolving to
+ *    (nsid, ifindex inside the pod),
+ *  - host side veths, keyed by (IFLA_LINK_NETNSID, IFLA_LINK) and
+ *    resolving to the host ifindex and name.
+ *
+ * A query is one lookup in each.  Both tables are fed by an initial dump
+ * and then by rtnetlink notifications received on one host socket that
+ * listens to every namespace with an nsid (NETLINK_LISTEN_ALL_NSID).
+ * The inode reported for a namespace comes from a process or bind mount
+ * in it; one that has neither yet is looked up again when it is needed.
+ */
+
+#define VNICD_HASH_SIZE	4096
+
+struct vnicd_addr {
+	struct hlist_node	hash;
+	int			nsid;
+	int			ifindex;
+	__u8			family;
+	__u8			len;
+	__u8			addr[16];
+};
+
+struct vnicd_veth {
+	struct hlist_node	peer_hash;
+	struct hlist_node	idx_hash;
+	int			nsid;
+	int			peer;
+	int			ifindex;
+	char			name[IFNAMSIZ];
+};
+
+struct vnicd_ns {
+	struct hlist_node	hash;
+	int			nsid;
+	ino_t			ino;		/* 0 until it is resolved */
+	time_t			retry;		/* next try at resolving it */
+};
+
+/* A namespace found through a process or a bind mount */
+struct vnicd_nsref {
+	int			nsid;
+	ino_t			ino;
+	char			pid[16];	/* empty for a bind mount */
+};
+
+struct vnicd_nsrefs {
+	struct vnicd_nsref	*ref;
+	int			count;
+	int			size;
+};
+
+/* Tables being loaded, private to the loader until they are swapped in */
+struct vnicd_load {
+	struct hlist_head	addrs;		/* struct vnicd_addr by hash */
+	struct hlist_head	veths;		/* struct vnicd_veth by idx_hash */
+	int			*nsids;
+	int			nsid_count;
+	int			nsid_size;
+	int			nsid;		/* whose addresses are dumped */
+};
+
+static struct hlist_head addr_head[VNICD_HASH_SIZE];
+static struct hlist_head peer_head[VNICD_HASH_SIZE];
+static struct hlist_head idx_head[VNICD_HASH_SIZE];
+static struct hlist_head ns_head[VNICD_HASH_SIZE];
+static pthread_mutex_t vnicd_lock = PTHREAD_MUTEX_INITIALIZER;
+/* serializes the nsid requests, which share one socket */
+static pthread_mutex_t vnicd_probe_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rtnl_handle lrth = { .fd = -1 };
+static const char *vnicd_comm;
+
+static unsigned int vnicd_addr_hash(int family, const __u8 *addr, int len)
+{
+	unsigned int hash = 2166136261u ^ family;
+
+	while (len--)
+		hash = (hash ^ *addr++) * 16777619u;
+
+	return hash & (VNICD_HASH_SIZE - 1);
+}
+
+static unsigned int vnicd_peer_hash(int nsid, int peer)
+{
+	return ((unsigned int)nsid * 2654435761u ^ peer) & (VNICD_HASH_SIZE - 1);
+}
+
+static struct vnicd_addr *vnicd_addr_get(int nsid, int family,
+					 const __u8 *addr, int len)
+{
+	struct vnicd_addr *va;
+	struct hlist_node *n;
+
+	hlist_for_each(n, &addr_head[vnicd_addr_hash(family, addr, len)]) {
+		va = container_of(n, struct vnicd_addr, hash);
+		if (va->nsid == nsid && va->family == family &&
+		    va->len == len && !memcmp(va->addr, addr, len))
+			return va;
+	}
+	return NULL;
+}
+
+static struct vnicd_veth *vnicd_veth_by_peer(int nsid, int peer)
+{
+	struct vnicd_veth *vv;
+	struct hlist_node *n;
+
+	hlist_for_each(n, &peer_head[vnicd_peer_hash(nsid, peer)]) {
+		vv = container_of(n, struct vnicd_veth, peer_hash);
+		if (vv->nsid == nsid && vv->peer == peer)
+			return vv;
+	}
+	return NULL;
+}
+
+static struct vnicd_veth *vnicd_veth_by_index(int ifindex)
+{
+	struct vnicd_veth *vv;
+	struct hlist_node *n;
+
+	hlist_for_each(n, &idx_head[ifindex & (VNICD_HASH_SIZE - 1)]) {
+		vv = container_of(n, struct vnicd_veth, idx_hash);
+		if (vv->ifindex == ifindex)
+			return vv;
+	}
+	return NULL;
+}
+
+static struct vnicd_ns *vnicd_ns_get(int nsid)
+{
+	struct vnicd_ns *vn;
+	struct hlist_node *n;
+
+	hlist_for_each(n, &ns_head[nsid & (VNICD_HASH_SIZE - 1)]) {
+		vn = container_of(n, struct vnicd_ns, hash);
+		if (vn->nsid == nsid)
+			return vn;
+	}
+	return NULL;
+}
+
+/* Called with vnicd_lock held */
+static struct vnicd_ns *vnicd_ns_remember(int nsid, ino_t ino)
+{
+	struct vnicd_ns *vn = vnicd_ns_get(nsid);
+
+	if (!vn) {
+		vn = calloc(1, sizeof(*vn));
+		if (!vn)
+			return NULL;
+		vn->nsid = nsid;
+		hlist_add_head(&vn->hash, &ns_head[nsid & (VNICD_HASH_SIZE - 1)]);
+	}
+	if (ino)
+		vn->ino = ino;
+	return vn;
+}
+
+/* Returns 1 and fills the address part of va for an address message, 0 for
+ * one without a usable address, or -1 if it is malformed.
+ */
+static int vnicd_addr_parse(struct nlmsghdr *n, struct vnicd_addr *va)
+{
+	struct ifaddrmsg *ifa = NLMSG_DATA(n);
+	struct rtattr *tb[IFA_MAX+1];
+	int len;
+
+	if (n->nlmsg_len < NLMSG_LENGTH(sizeof(*ifa)))
+		return -1;
+
+	parse_rtattr(tb, IFA_MAX, IFA_RTA(ifa), IFA_PAYLOAD(n));
+	if (!tb[IFA_LOCAL])
+		tb[IFA_LOCAL] = tb[IFA_ADDRESS];
+	if (!tb[IFA_LOCAL])
+		return 0;
+
+	len = RTA_PAYLOAD(tb[IFA_LOCAL]);
+	if (len > sizeof(va->addr))
+		return 0;
+
+	va->family = ifa->ifa_family;
+	va->len = len;
+	memcpy(va->addr, RTA_DATA(tb[IFA_LOCAL]), len);
+	va->ifindex = ifa->ifa_index;
+	return 1;
+}
+
+/* Called with vnicd_lock held, va is either linked or freed */
+static void vnicd_addr_add(struct vnicd_addr *va)
+{
+	struct vnicd_addr *old;
+
+	old = vnicd_addr_get(va->nsid, va->family, va->addr, va->len);
+	if (old) {
+		old->ifindex = va->ifindex;
+		free(va);
+		return;
+	}
+	hlist_add_head(&va->hash,
+		       &addr_head[vnicd_addr_hash(va->family, va->addr, va->len)]);
+}
+
+/* Called with vnicd_lock held */
+static int vnicd_addr_update(int nsid, struct nlmsghdr *n)
+{
+	struct vnicd_addr key = { .nsid = nsid }, *va;
+	int ret;
+
+	ret = vnicd_addr_parse(n, &key);
+	if (ret <= 0)
+		return ret;
+
+	if (n->nlmsg_type == RTM_DELADDR) {
+		va = vnicd_addr_get(nsid, key.family, key.addr, key.len);
+		if (va) {
+			hlist_del(&va->hash);
+			free(va);
+		}
+		return 0;
+	}
+
+	va = malloc(sizeof(*va));
+	if (!va)
+		return -1;
+	*va = key;
+	vnicd_addr_add(va);
+	return 0;
+}
+
+/* Returns 1 and fills vv for a host veth, 0 for any other link, or -1 if
+ * the message is malformed.
+ */
+static int vnicd_link_parse(struct nlmsghdr *n, struct vnicd_veth *vv)
+{
+	struct ifinfomsg *ifi = NLMSG_DATA(n);
+	struct rtattr *tb[IFLA_MAX+1];
+
+	if (n->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi)))
+		return -1;
+
+	parse_rtattr_flags(tb, IFLA_MAX, IFLA_RTA(ifi), IFLA_PAYLOAD(n),
+			   NLA_F_NESTED);
+	if (!tb[IFLA_LINK_NETNSID] || !tb[IFLA_LINK] || !tb[IFLA_IFNAME])
+		return 0;
+
+	vv->nsid = rta_getattr_s32(tb[IFLA_LINK_NETNSID]);
+	vv->peer = rta_getattr_u32(tb[IFLA_LINK]);
+	vv->ifindex = ifi->ifi_index;
+	strlcpy(vv->name, rta_getattr_str(tb[IFLA_IFNAME]), sizeof(vv->name));
+	return 1;
+}
+
+/* Called with vnicd_lock held */
+static void vnicd_veth_insert(struct vnicd_veth *vv)
+{
+	hlist_add_head(&vv->peer_hash,
+		       &peer_head[vnicd_peer_hash(vv->nsid, vv->peer)]);
+	hlist_add_head(&vv->idx_hash,
+		       &idx_head[vv->ifindex & (VNICD_HASH_SIZE - 1)]);
+}
+
+static void vnicd_veth_destroy(struct vnicd_veth *vv)
+{
+	hlist_del(&vv->peer_hash);
+	hlist_del(&vv->idx_hash);
+	free(vv);
+}
+
+/* Called with vnicd_lock held */
+static int vnicd_link_update(struct nlmsghdr *n)
+{
+	struct ifinfomsg *ifi = NLMSG_DATA(n);
+	struct vnicd_veth key = {}, *vv;
+	int ret;
+
+	if (n->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi)))
+		return -1;
+
+	vv = vnicd_veth_by_index(ifi->ifi_index);
+	if (n->nlmsg_type == RTM_DELLINK) {
+		if (vv)
+			vnicd_veth_destroy(vv);
+		return 0;
+	}
+
+	ret = vnicd_link_parse(n, &key);
+	if (ret <= 0) {
+		if (vv)
+			vnicd_veth_destroy(vv);
+		return ret;
+	}
+
+	if (vv && (vv->nsid != key.nsid || vv->peer != key.peer)) {
+		vnicd_veth_destroy(vv);
+		vv = NULL;
+	}
+
+	if (!vv) {
+		vv = malloc(sizeof(*vv));
+		if (!vv)
+			return -1;
+		*vv = key;
+		vnicd_veth_insert(vv);
+	}
+	strlcpy(vv->name, key.name, sizeof(vv->name));
+	return 0;
+}
+
+/* Called with vnicd_lock held */
+static void vnicd_ns_flush(int nsid)
+{
+	struct hlist_node *n, *tmp;
+	struct vnicd_ns *vn;
+	int i;
+
+	for (i = 0; i < VNICD_HASH_SIZE; i++) {
+		hlist_for_each_safe(n, tmp, &addr_head[i]) {
+			struct vnicd_addr *va
+				= container_of(n, struct vnicd_addr, hash);
+
+			if (va->nsid == nsid) {
+				hlist_del(&va->hash);
+				free(va);
+			}
+		}
+	}
+
+	vn = vnicd_ns_get(nsid);
+	if (vn) {
+		hlist_del(&vn->hash);
+		free(vn);
+	}
+}
+
+/* Called with vnicd_lock held */
+static void vnicd_flush(void)
+{
+	struct hlist_node *n, *tmp;
+	int i;
+
+	for (i = 0; i < VNICD_HASH_SIZE; i++) {
+		hlist_for_each_safe(n, tmp, &addr_head[i]) {
+			hlist_del(n);
+			free(container_of(n, struct vnicd_addr, hash));
+		}
+		hlist_for_each_safe(n, tmp, &idx_head[i])
+			vnicd_veth_destroy(container_of(n, struct vnicd_veth,
+							idx_hash));
+		hlist_for_each_safe(n, tmp, &ns_head[i]) {
+			hlist_del(n);
+			free(container_of(n, struct vnicd_ns, hash));
+		}
+	}
+}
+
+static int vnicd_nsref_add(struct vnicd_nsrefs *r, int nsid, ino_t ino,
+			   const char *pid)
+{
+	struct vnicd_nsref *tmp;
+
+	if (r->count == r->size) {
+		r->size = r->size ? r->size * 2 : 64;
+		tmp = realloc(r->ref, r->size * sizeof(*tmp));
+		if (!tmp)
+			return -1;
+		r->ref = tmp;
+	}
+	r->ref[r->count].nsid = nsid;
+	r->ref[r->count].ino = ino;
+	strlcpy(r->ref[r->count].pid, pid, sizeof(r->ref[r->count].pid));
+	r->count++;
+	return 0;
+}
+
+static int vnicd_nsref_name(char *name, void *arg)
+{
+	struct stat st;
+	int fd, nsid;
+
+	fd = netns_get_fd(name);
+	if (fd < 0)
+		return 0;
+	nsid = fstat(fd, &st) < 0 ? -1 : get_netnsid_from_fd(fd);
+	close(fd);
+
+	if (nsid >= 0)
+		vnicd_nsref_add(arg, nsid, st.st_ino, "");
+	return 0;
+}
+
+/* Pair nsids with namespace inodes, through the processes matching comm
+ * and the bind mounts in NETNS_RUN_DIR (where CNI plugins put a pod
+ * namespace before any process runs in it).
+ */
+static void vnicd_nsrefs_collect(struct vnicd_nsrefs *r)
+{
+	struct netns_pid *list = NULL;
+	int i, count, nsid;
+
+	pthread_mutex_lock(&vnicd_probe_lock);
+	count = netns_pid_scan(vnicd_comm, &list);
+	for (i = 0; i < count; i++) {
+		nsid = get_netnsid_from_pid(list[i].pid);
+		if (nsid >= 0)
+			vnicd_nsref_add(r, nsid, list[i].ino, list[i].pid);
+	}
+	free(list);
+	netns_foreach(vnicd_nsref_name, r);
+	pthread_mutex_unlock(&vnicd_probe_lock);
+}
+
+/* A namespace with a process first, it can be entered */
+static const struct vnicd_nsref *vnicd_nsref_find(const struct vnicd_nsrefs *r,
+						  int nsid)
+{
+	const struct vnicd_nsref *found = NULL;
+	int i;
+
+	for (i = 0; i < r->count; i++) {
+		if (r->ref[i].nsid != nsid)
+			continue;
+		if (r->ref[i].pid[0])
+			return &r->ref[i];
+		found = &r->ref[i];
+	}
+	return found;
+}
+
+/* Find the inode of a namespace known only by its nsid: at query time or
+ * on an address event, at most once a second per namespace.
+ */
+static void vnicd_ns_resolve(int nsid)
+{
+	struct vnicd_nsrefs r = {};
+	const struct vnicd_nsref *ref;
+	time_t now = time(NULL);
+	struct vnicd_ns *vn;
+
+	pthread_mutex_lock(&vnicd_lock);
+	vn = vnicd_ns_remember(nsid, 0);
+	if (!vn || vn->ino || vn->retry > now) {
+		pthread_mutex_unlock(&vnicd_lock);
+		return;
+	}
+	vn->retry = now + 1;
+	pthread_mutex_unlock(&vnicd_lock);
+
+	vnicd_nsrefs_collect(&r);
+	ref = vnicd_nsref_find(&r, nsid);
+	if (ref) {
+		pthread_mutex_lock(&vnicd_lock);
+		vn = vnicd_ns_get(nsid);
+		if (vn)
+			vn->ino = ref->ino;
+		pthread_mutex_unlock(&vnicd_lock);
+	}
+	free(r.ref);
+}
+
+static void vnicd_load_nsid(struct vnicd_load *ld, int nsid)
+{
+	int *tmp;
+
+	if (nsid < 0)
+		return;
+	if (ld->nsid_count == ld->nsid_size) {
+		ld->nsid_size = ld->nsid_size ? ld->nsid_size * 2 : 64;
+		tmp = realloc(ld->nsids, ld->nsid_size * sizeof(*tmp));
+		if (!tmp)
+			return;
+		ld->nsids = tmp;
+	}
+	ld->nsids[ld->nsid_count++] = nsid;
+}
+
+static int vnicd_load_link(struct nlmsghdr *n, void *arg)
+{
+	struct vnicd_load *ld = arg;
+	struct vnicd_veth *vv;
+
+	vv = calloc(1, sizeof(*vv));
+	if (!vv)
+		return -1;
+	if (vnicd_link_parse(n, vv) <= 0) {
+		free(vv);
+		return 0;
+	}
+	hlist_add_head(&vv->idx_hash, &ld->veths);
+	vnicd_load_nsid(ld, vv->nsid);
+	return 0;
+}
+
+static int vnicd_load_ns(struct nlmsghdr *n, void *arg)
+{
+	struct rtgenmsg *rthdr = NLMSG_DATA(n);
+	struct rtattr *tb[NETNSA_MAX + 1];
+
+	if (n->nlmsg_type != RTM_NEWNSID ||
+	    n->nlmsg_len < NLMSG_SPACE(sizeof(*rthdr)))
+		return 0;
+
+	parse_rtattr(tb, NETNSA_MAX, NETNS_RTA(rthdr),
+		     n->nlmsg_len - NLMSG_SPACE(sizeof(*rthdr)));
+	if (tb[NETNSA_NSID])
+		vnicd_load_nsid(arg, rta_getattr_s32(tb[NETNSA_NSID]));
+	return 0;
+}
+
+static int vnicd_load_addr(struct nlmsghdr *n, void *arg)
+{
+	struct vnicd_load *ld = arg;
+	struct vnicd_addr *va;
+
+	if (n->nlmsg_type != RTM_NEWADDR)
+		return 0;
+
+	va = calloc(1, sizeof(*va));
+	if (!va)
+		return -1;
+	va->nsid = ld->nsid;
+	if (vnicd_addr_parse(n, va) <= 0) {
+		free(va);
+		return 0;
+	}
+	hlist_add_head(&va->hash, &ld->addrs);
+	return 0;
+}
+
+static int vnicd_nsid_filter(struct nlmsghdr *nlh, int reqlen)
+{
+	return 0;
+}
+
+static int vnicd_target_nsid;
+
+static int vnicd_addr_filter(struct nlmsghdr *nlh, int reqlen)
+{
+	return addattr32(nlh, reqlen, IFA_TARGET_NETNSID, vnicd_target_nsid);
+}
+
+/* Dump the addresses of the namespace with nsid from the host, or from
+ * inside it on kernels without strict dump checking, which would ignore
+ * IFA_TARGET_NETNSID and return the host addresses instead.
+ */
+static int vnicd_load_ns_addrs(struct rtnl_handle *rth, struct vnicd_load *ld,
+			       int nsid, const struct vnicd_nsref *ref)
+{
+	struct rtnl_handle nsrth;
+	int err = -1;
+
+	ld->nsid = nsid;
+	if (rth->flags & RTNL_HANDLE_F_STRICT_CHK) {
+		vnicd_target_nsid = nsid;
+		if (rtnl_addrdump_req(rth, AF_UNSPEC, vnicd_addr_filter) < 0)
+			return -1;
+		return rtnl_dump_filter(rth, vnicd_load_addr, ld);
+	}
+
+	if (!ref || !ref->pid[0] || netns_rtnl_open(ref->pid, &nsrth) < 0)
+		return -1;
+	if (rtnl_addrdump_req(&nsrth, AF_UNSPEC, NULL) >= 0)
+		err = rtnl_dump_filter(&nsrth, vnicd_load_addr, ld);
+	rtnl_close(&nsrth);
+	return err;
+}
+
+static int vnicd_int_cmp(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+static void vnicd_load_free(struct vnicd_load *ld)
+{
+	struct hlist_node *n, *tmp;
+
+	hlist_for_each_safe(n, tmp, &ld->addrs)
+		free(container_of(n, struct vnicd_addr, hash));
+	hlist_for_each_safe(n, tmp, &ld->veths)
+		free(container_of(n, struct vnicd_veth, idx_hash));
+	free(ld->nsids);
+}
+
+/* With nsid < 0 dump the host veths and the addresses of every namespace
+ * that has an nsid (from RTM_GETNSID, IFLA_LINK_NETNSID and the processes
+ * matching comm) and replace both tables.  Otherwise only add the
+ * addresses of that namespace.  Nothing is dumped under vnicd_lock, the
+ * lock is only taken to put the results in place.
+ */
+static int vnicd_load(int nsid)
+{
+	struct rtnl_handle drth = { .fd = -1 };
+	struct vnicd_nsrefs r = {};
+	struct vnicd_load ld = {};
+	const struct vnicd_nsref *ref;
+	struct hlist_node *n, *tmp;
+	int i, k, err = -1;
+
+	if (rtnl_open(&drth, 0) < 0)
+		return -1;
+	rtnl_set_strict_dump(&drth);
+
+	if (nsid >= 0) {
+		vnicd_load_nsid(&ld, nsid);
+	} else {
+		if (rtnl_linkdump_req(&drth, AF_UNSPEC) < 0) {
+			perror("Cannot send dump request");
+			goto out;
+		}
+		if (rtnl_dump_filter(&drth, vnicd_load_link, &ld) < 0) {
+			fprintf(stderr, "Dump terminated\n");
+			goto out;
+		}
+		if (rtnl_nsiddump_req_filter_fn(&drth, AF_UNSPEC,
+						vnicd_nsid_filter) < 0) {
+			perror("Cannot send dump request");
+			goto out;
+		}
+		if (rtnl_dump_filter(&drth, vnicd_load_ns, &ld) < 0) {
+			fprintf(stderr, "Dump terminated\n");
+			goto out;
+		}
+	}
+
+	vnicd_nsrefs_collect(&r);
+	if (nsid < 0) {
+		for (i = 0; i < r.count; i++)
+			vnicd_load_nsid(&ld, r.ref[i].nsid);
+	}
+
+	qsort(ld.nsids, ld.nsid_count, sizeof(*ld.nsids), vnicd_int_cmp);
+	for (i = 0, k = 0; i < ld.nsid_count; i++) {
+		if (k && ld.nsids[k - 1] == ld.nsids[i])
+			continue;
+		ld.nsids[k++] = ld.nsids[i];
+	}
+	ld.nsid_count = k;
+
+	for (i = 0; i < ld.nsid_count; i++) {
+		ref = vnicd_nsref_find(&r, ld.nsids[i]);
+		if (vnicd_load_ns_addrs(&drth, &ld, ld.nsids[i], ref) < 0)
+			fprintf(stderr, "Cannot dump addresses of nsid %d\n",
+				ld.nsids[i]);
+	}
+
+	pthread_mutex_lock(&vnicd_lock);
+	if (nsid < 0) {
+		vnicd_flush();
+		hlist_for_each_safe(n, tmp, &ld.veths) {
+			hlist_del(n);
+			vnicd_veth_insert(container_of(n, struct vnicd_veth,
+						       idx_hash));
+		}
+	}
+	hlist_for_each_safe(n, tmp, &ld.addrs) {
+		hlist_del(n);
+		vnicd_addr_add(container_of(n, struct vnicd_addr, hash));
+	}
+	for (i = 0; i < ld.nsid_count; i++) {
+		ref = vnicd_nsref_find(&r, ld.nsids[i]);
+		vnicd_ns_remember(ld.nsids[i], ref ? ref->ino : 0);
+	}
+	pthread_mutex_unlock(&vnicd_lock);
+	err = 0;
+
+out:
+	vnicd_load_free(&ld);
+	free(r.ref);
+	rtnl_close(&drth);
+	return err;
+}
+
+static int vnicd_msg_nsid(struct nlmsghdr *n)
+{
+	struct rtgenmsg *rthdr = NLMSG_DATA(n);
+	struct rtattr *tb[NETNSA_MAX + 1];
+
+	if (n->nlmsg_len < NLMSG_SPACE(sizeof(*rthdr)))
+		return -1;
+	parse_rtattr(tb, NETNSA_MAX, NETNS_RTA(rthdr),
+		     n->nlmsg_len - NLMSG_SPACE(sizeof(*rthdr)));
+	if (!tb[NETNSA_NSID])
+		return -1;
+	return rta_getattr_s32(tb[NETNSA_NSID]);
+}
+
+static int vnicd_accept_msg(struct rtnl_ctrl_data *ctrl,
+			    struct nlmsghdr *n, void *arg)
+{
+	int nsid = ctrl ? ctrl->nsid : -1;
+	struct vnicd_ns *vn;
+	bool resolve;
+
+	switch (n->nlmsg_type) {
+	case RTM_NEWLINK:
+	case RTM_DELLINK:
+		/* pod side links are resolved through the host veth */
+		if (nsid >= 0)
+			break;
+		pthread_mutex_lock(&vnicd_lock);
+		vnicd_link_update(n);
+		pthread_mutex_unlock(&vnicd_lock);
+		break;
+	case RTM_NEWADDR:
+	case RTM_DELADDR:
+		if (nsid < 0)
+			break;
+		pthread_mutex_lock(&vnicd_lock);
+		vnicd_addr_update(nsid, n);
+		vn = vnicd_ns_get(nsid);
+		resolve = !vn || !vn->ino;
+		pthread_mutex_unlock(&vnicd_lock);
+		if (resolve)
+			vnicd_ns_resolve(nsid);
+		break;
+	case RTM_NEWNSID:
+		/* a new pod namespace became visible, pick up its state */
+		nsid = vnicd_msg_nsid(n);
+		if (nsid >= 0)
+			vnicd_load(nsid);
+		break;
+	case RTM_DELNSID:
+		nsid = vnicd_msg_nsid(n);
+		if (nsid < 0)
+			break;
+		pthread_mutex_lock(&vnicd_lock);
+		vnicd_ns_flush(nsid);
+		pthread_mutex_unlock(&vnicd_lock);
+		break;
+	}
+
+	return 0;
+}
+
+static void *vnicd_listen_thread(void *arg)
+{
+	/* notifications lost to a full socket buffer are gone for good,
+	 * only a fresh dump makes the tables current again
+	 */
+	while (rtnl_listen(&lrth, vnicd_accept_msg, NULL) == -ENOBUFS) {
+		fprintf(stderr, "Notifications lost, reloading the index\n");
+		if (vnicd_load(-1) < 0)
+			break;
+	}
+	fprintf(stderr, "Notification listener terminated\n");
+	exit(1);
+}
+
+static void vnicd_reply(FILE *fp, char *line)
+{
+	struct vnicd_addr *va = NULL;
+	struct vnicd_veth *vv = NULL;
+	char name[IFNAMSIZ];
+	struct hlist_node *n;
+	struct vnicd_ns *vn;
+	int nsid, peer;
+	inet_prefix pfx;
+	ino_t ino;
+
+	line[strcspn(line, " \t\r\n")] = '\0';
+	if (get_addr_1(&pfx, line, AF_UNSPEC) || !pfx.bytelen) {
+		fprintf(fp, "-\n");
+		return;
+	}
+
+	pthread_mutex_lock(&vnicd_lock);
+	/* the same address (loopback at least) lives in many namespaces,
+	 * take the one sitting behind a host veth
+	 */
+	hlist_for_each(n, &addr_head[vnicd_addr_hash(pfx.family,
+						     (__u8 *)pfx.data,
+						     pfx.bytelen)]) {
+		va = container_of(n, struct vnicd_addr, hash);
+		if (va->family != pfx.family || va->len != pfx.bytelen ||
+		    memcmp(va->addr, pfx.data, pfx.bytelen))
+			continue;
+		vv = vnicd_veth_by_peer(va->nsid, va->ifindex);
+		if (vv)
+			break;
+	}
+
+	if (!vv) {
+		pthread_mutex_unlock(&vnicd_lock);
+		fprintf(fp, "-\n");
+		return;
+	}
+
+	strlcpy(name, vv->name, sizeof(name));
+	nsid = vv->nsid;
+	peer = vv->peer;
+	vn = vnicd_ns_get(nsid);
+	ino = vn ? vn->ino : 0;
+	pthread_mutex_unlock(&vnicd_lock);
+
+	if (!ino) {
+		vnicd_ns_resolve(nsid);
+		pthread_mutex_lock(&vnicd_lock);
+		vn = vnicd_ns_get(nsid);
+		ino = vn ? vn->ino : 0;
+		pthread_mutex_unlock(&vnicd_lock);
+	}
+
+	fprintf(fp, "%s %lu %d\n", name, (unsigned long)ino, peer);
+}
+
+static int vnicd_socket(const char *path, struct sockaddr_un *sun)
+{
+	int fd;
+
+	if (strlen(path) >= sizeof(sun->sun_path)) {
+		fprintf(stderr, "Socket path \"%s\" is too long\n", path);
+		return -1;
+	}
+
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	strcpy(sun->sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		perror("Cannot create UNIX socket");
+	return fd;
+}
+
+/* Build the index over every namespace with an nsid, then answer
+ * "ADDRESS\n" requests on the UNIX socket at path with
+ * "IFNAME NETNS-INODE PEER-IFINDEX\n", or "-\n" when the address is not
+ * behind any host veth.  NETNS-INODE is 0 while no process matching comm
+ * or bind mount is found in the namespace.  Does not return on success.
+ */
+int do_vnicd(const char *path, const char *comm)
+{
+	struct timeval tv = { .tv_sec = 1 };
+	struct sockaddr_un sun;
+	pthread_t thread;
+	int fd, err;
+
+	vnicd_comm = comm;
+	signal(SIGPIPE, SIG_IGN);
+
+	/* subscribe before dumping so that nothing falls in between */
+	if (rtnl_open(&lrth, RTMGRP_LINK | RTMGRP_IPV4_IFADDR |
+		      RTMGRP_IPV6_IFADDR) < 0)
+		return -1;
+	if (rtnl_add_nl_group(&lrth, RTNLGRP_NSID) < 0) {
+		perror("Cannot subscribe to nsid notifications");
+		return -1;
+	}
+	if (rtnl_listen_all_nsid(&lrth) < 0)
+		return -1;
+	lrth.flags |= RTNL_HANDLE_F_LISTEN_ENOBUFS;
+
+	if (vnicd_load(-1) < 0)
+		return -1;
+
+	fd = vnicd_socket(path, &sun);
+	if (fd < 0)
+		return -1;
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+	    listen(fd, SOMAXCONN) < 0) {
+		fprintf(stderr, "Cannot listen on \"%s\": %s\n",
+			path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	err = pthread_create(&thread, NULL, vnicd_listen_thread, NULL);
+	if (err) {
+		fprintf(stderr, "Cannot create listener thread: %s\n",
+			strerror(err));
+		close(fd);
+		return -1;
+	}
+
+	while (1) {
+		char *line = NULL;
+		size_t len = 0;
+		FILE *in, *out;
+		int c;
+
+		c = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+		if (c < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("accept");
+			break;
+		}
+
+		/* don't let an idle client stall everybody else */
+		setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+		in = fdopen(c, "r");
+		if (!in) {
+			close(c);
+			continue;
+		}
+		out = fdopen(dup(c), "w");
+		if (!out) {
+			fclose(in);
+			continue;
+		}
+		while (getline(&line, &len, in) > 0) {
+			vnicd_reply(out, line);
+			fflush(out);
+		}
+		free(line);
+		fclose(out);
+		fclose(in);
+	}
+
+	close(fd);
+	return -1;
+}
+
+/* Ask a running resolver about ipaddr and print the host veth name */
+int vnicd_query(const char *path, const char *ipaddr)
+{
+	struct sockaddr_un sun;
+	char reply[256];
+	__u64 start;
+	FILE *fp;
+	int fd;
+
+	fd = vnicd_socket(path, &sun);
+	if (fd < 0)
+		return -1;
+
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		fprintf(stderr, "Cannot connect to \"%s\": %s\n",
+			path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	if (dprintf(fd, "%s\n", ipaddr) < 0) {
+		perror("Cannot send query");
+		close(fd);
+		return -1;
+	}
+	shutdown(fd, SHUT_WR);
+
+	fp = fdopen(fd, "r");
+	if (!fp) {
+		close(fd);
+		return -1;
+	}
+
+	if (!fgets(reply, sizeof(reply), fp) || reply[0] == '-') {
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+
+	reply[strcspn(reply, " \n")] = '\0';
+	start = vnic_trace_now();
+	printf("%s\n", reply);
+	fflush(stdout);
+	vnic_trace_add(VNIC_TRACE_OUTPUT, start);
+	return 0;
+}
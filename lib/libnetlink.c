@@ -180,12 +180,19 @@ int rtnl_add_nl_group(struct rtnl_handle *rth, unsigned int group)
 			  &group, sizeof(group));
 }
 
+static void rtnl_pipe_free(struct rtnl_pipe *p);
+
 void rtnl_close(struct rtnl_handle *rth)
 {
 	if (rth->fd >= 0) {
 		close(rth->fd);
 		rth->fd = -1;
 	}
+	free(rth->buf);
+	rth->buf = NULL;
+	rth->buflen = 0;
+	rtnl_pipe_free(rth->pipe);
+	rth->pipe = NULL;
 }
 
 int rtnl_open_byproto(struct rtnl_handle *rth, unsigned int subscriptions,
@@ -276,7 +283,7 @@ int rtnl_nexthopdump_req(struct rtnl_handle *rth, int family,
 			return err;
 	}
 
-	return send(rth->fd, &req, sizeof(req), 0);
+	return rtnl_send(rth, &req, sizeof(req));
 }
 
 int rtnl_addrdump_req(struct rtnl_handle *rth, int family,
@@ -302,7 +309,7 @@ int rtnl_addrdump_req(struct rtnl_handle *rth, int family,
 			return err;
 	}
 
-	return send(rth->fd, &req, sizeof(req), 0);
+	return rtnl_send(rth, &req, sizeof(req));
 }
 
 int rtnl_addrlbldump_req(struct rtnl_handle *rth, int family)
@@ -318,7 +325,7 @@ int rtnl_addrlbldump_req(struct rtnl_handle *rth, int family)
 		.ifal.ifal_family = family,
 	};
 
-	return send(rth->fd, &req, sizeof(req), 0);
+	return rtnl_send(rth, &req, sizeof(req));
 }
 
 int rtnl_routedump_req(struct rtnl_handle *rth, int family,
@@ -344,7 +351,7 @@ int rtnl_routedump_req(struct rtnl_handle *rth, int family,
 			return err;
 	}
 
-	return send(rth->fd, &req, sizeof(req), 0);
+	return rtnl_send(rth, &req, sizeof(req));
 }
 
 int rtnl_ruledump_req(struct rtnl_handle *rth, int family)
@@ -360,7 +367,7 @@ int rtnl_ruledump_req(struct rtnl_handle *rth, int family)
 		.frh.family = family
 	};
 
-	return send(rth->fd, &req, sizeof(req), 0);
+	return rtnl_send(rth, &req, sizeof(req));
 }
 
 int rtnl_neighdump_req(struct rtnl_handle *rth, int family,
@@ -386,7 +393,7 @@ int rtnl_neighdump_req(struct rtnl_handle *rth, int family,
 			return err;
 	}
 
-	return send(rth->fd, &req, sizeof(req), 0);
+	return rtnl_send(rth, &req, sizeof(req));
 }
 
 int rtnl_neightbldump_req(struct rtnl_handle *rth, int family)
@@ -402,7 +409,7 @@ int rtnl_neightbldump_req(struct rtnl_handle *rth, int family)
 		.ndtmsg.ndtm_family = family,
 	};
 
-	return send(rth->fd, &req, sizeof(req), 0);
+	return rtnl_send(rth, &req, sizeof(req));
 }
 
 int rtnl_mdbdump_req(struct rtnl_handle *rth, int family)
@@ -418,7 +425,7 @@ int rtnl_mdbdump_req(struct rtnl_handle *rth, int family)
 		.bpm.family = family,
 	};
 
-	return send(rth->fd, &req, sizeof(req), 0);
+	return rtnl_send(rth, &req, sizeof(req));
 }
 
 int rtnl_netconfdump_req(struct rtnl_handle *rth, int family)
@@ -435,7 +442,7 @@ int rtnl_netconfdump_req(struct rtnl_handle *rth, int family)
 		.ncm.ncm_family = family,
 	};
 
-	return send(rth->fd, &req, sizeof(req), 0);
+	return rtnl_send(rth, &req, sizeof(req));
 }
 
 int rtnl_nsiddump_req_filter_fn(struct rtnl_handle *rth, int family,
@@ -461,7 +468,7 @@ int rtnl_nsiddump_req_filter_fn(struct rtnl_handle *rth, int family,
 	if (err)
 		return err;
 
-	return send(rth->fd, &req, req.nlh.nlmsg_len, 0);
+	return rtnl_send(rth, &req, req.nlh.nlmsg_len);
 }
 
 static int __rtnl_linkdump_req(struct rtnl_handle *rth, int family)
@@ -477,7 +484,7 @@ static int __rtnl_linkdump_req(struct rtnl_handle *rth, int family)
 		.ifm.ifi_family = family,
 	};
 
-	return send(rth->fd, &req, sizeof(req), 0);
+	return rtnl_send(rth, &req, sizeof(req));
 }
 
 int rtnl_linkdump_req(struct rtnl_handle *rth, int family)
@@ -509,7 +516,7 @@ int rtnl_linkdump_req_filter(struct rtnl_handle *rth, int family,
 			.ext_filter_mask = filt_mask,
 		};
 
-		return send(rth->fd, &req, sizeof(req), 0);
+		return rtnl_send(rth, &req, sizeof(req));
 	}
 
 	return __rtnl_linkdump_req(rth, family);
@@ -539,7 +546,7 @@ int rtnl_linkdump_req_filter_fn(struct rtnl_handle *rth, int family,
 		if (err)
 			return err;
 
-		return send(rth->fd, &req, req.nlh.nlmsg_len, 0);
+		return rtnl_send(rth, &req, req.nlh.nlmsg_len);
 	}
 
 	return __rtnl_linkdump_req(rth, family);
@@ -565,7 +572,7 @@ int rtnl_fdb_linkdump_req_filter_fn(struct rtnl_handle *rth,
 	if (err)
 		return err;
 
-	return send(rth->fd, &req, sizeof(req), 0);
+	return rtnl_send(rth, &req, sizeof(req));
 }
 
 int rtnl_statsdump_req_filter(struct rtnl_handle *rth, int fam, __u32 filt_mask)
@@ -584,11 +591,14 @@ int rtnl_statsdump_req_filter(struct rtnl_handle *rth, int fam, __u32 filt_mask)
 	req.ifsm.family = fam;
 	req.ifsm.filter_mask = filt_mask;
 
-	return send(rth->fd, &req, sizeof(req), 0);
+	return rtnl_send(rth, &req, sizeof(req));
 }
 
 int rtnl_send(struct rtnl_handle *rth, const void *buf, int len)
 {
+	/* whatever was pipelined must be done before a dump starts */
+	if (rtnl_pipe_flush(rth) < 0)
+		return -1;
 	return send(rth->fd, buf, len, 0);
 }
 
@@ -598,7 +608,7 @@ int rtnl_send_check(struct rtnl_handle *rth, const void *buf, int len)
 	int status;
 	char resp[1024];
 
-	status = send(rth->fd, buf, len, 0);
+	status = rtnl_send(rth, buf, len);
 	if (status < 0)
 		return status;
 
@@ -646,6 +656,8 @@ int rtnl_dump_request(struct rtnl_handle *rth, int type, void *req, int len)
 		.msg_iovlen = 2,
 	};
 
+	if (rtnl_pipe_flush(rth) < 0)
+		return -1;
 	return sendmsg(rth->fd, &msg, 0);
 }
 
@@ -667,6 +679,8 @@ int rtnl_dump_request_n(struct rtnl_handle *rth, struct nlmsghdr *n)
 	n->nlmsg_pid = 0;
 	n->nlmsg_seq = rth->dump = ++rth->seq;
 
+	if (rtnl_pipe_flush(rth) < 0)
+		return -1;
 	return sendmsg(rth->fd, &msg, 0);
 }
 
@@ -747,44 +761,88 @@ static int __rtnl_recvmsg(int fd, struct msghdr *msg, int flags)
 	return len;
 }
 
-static int rtnl_recvmsg(int fd, struct msghdr *msg, char **answer)
+/* The receive buffer belongs to the handle and is sized after the socket
+ * receive buffer, so a whole dump batch always fits in it and there is no
+ * need to MSG_PEEK at every datagram to learn its size first.
+ */
+static char *rtnl_get_buf(struct rtnl_handle *rth, size_t *len)
+{
+	char *buf = rth->buf;
+
+	if (!buf) {
+		int size = 0;
+		socklen_t optlen = sizeof(size);
+
+		if (!rth->buflen &&
+		    getsockopt(rth->fd, SOL_SOCKET, SO_RCVBUF,
+			       &size, &optlen) == 0 && size > 0)
+			rth->buflen = size;
+		if (rth->buflen < 32768)
+			rth->buflen = 32768;
+
+		buf = malloc(rth->buflen);
+		if (!buf) {
+			fprintf(stderr, "malloc error: not enough buffer\n");
+			return NULL;
+		}
+	}
+
+	*len = rth->buflen;
+	rth->buf = NULL;
+	return buf;
+}
+
+/* Give back a buffer taken by rtnl_recvmsg().  Callbacks run while it was
+ * out may have talked on the same handle and allocated another one, keep
+ * the larger.
+ */
+static void rtnl_put_buf(struct rtnl_handle *rth, char *buf, size_t len)
+{
+	if (rth->buf && rth->buflen >= len) {
+		free(buf);
+		return;
+	}
+
+	free(rth->buf);
+	rth->buf = buf;
+	rth->buflen = len;
+}
+
+static int rtnl_recvmsg(struct rtnl_handle *rth, struct msghdr *msg,
+			char **answer)
 {
 	struct iovec *iov = msg->msg_iov;
+	size_t size;
 	char *buf;
 	int len;
 
-	iov->iov_base = NULL;
-	iov->iov_len = 0;
-
-	len = __rtnl_recvmsg(fd, msg, MSG_PEEK | MSG_TRUNC);
-	if (len < 0)
-		return len;
-
-	if (len < 32768)
-		len = 32768;
-	buf = malloc(len);
-	if (!buf) {
-		fprintf(stderr, "malloc error: not enough buffer\n");
+	buf = rtnl_get_buf(rth, &size);
+	if (!buf)
 		return -ENOMEM;
-	}
 
 	iov->iov_base = buf;
-	iov->iov_len = len;
+	iov->iov_len = size;
 
-	len = __rtnl_recvmsg(fd, msg, 0);
+	len = __rtnl_recvmsg(rth->fd, msg, MSG_TRUNC);
 	if (len < 0) {
-		free(buf);
+		rtnl_put_buf(rth, buf, size);
 		return len;
 	}
 
-	if (answer)
-		*answer = buf;
-	else
+	if (len > size) {
+		/* the datagram is gone, make sure the next one fits */
+		fprintf(stderr, "Message truncated, %d bytes needed\n", len);
 		free(buf);
+		rth->buflen = len;
+		return -EMSGSIZE;
+	}
 
+	*answer = buf;
 	return len;
 }
 
+static void rtnl_pipe_ack(struct rtnl_handle *rth, struct nlmsghdr *h);
+
 static int rtnl_dump_filter_l(struct rtnl_handle *rth,
 			      const struct rtnl_dump_filter_arg *arg)
 {
@@ -805,7 +863,7 @@ static int rtnl_dump_filter_l(struct rtnl_handle *rth,
 		int found_done = 0;
 		int msglen = 0;
 
-		status = rtnl_recvmsg(rth->fd, &msg, &buf);
+		status = rtnl_recvmsg(rth, &msg, &buf);
 		if (status < 0)
 			return status;
 
@@ -824,8 +882,12 @@ static int rtnl_dump_filter_l(struct rtnl_handle *rth,
 
 				if (nladdr.nl_pid != 0 ||
 				    h->nlmsg_pid != rth->local.nl_pid ||
-				    h->nlmsg_seq != rth->dump)
+				    h->nlmsg_seq != rth->dump) {
+					/* queued ahead of the dump */
+					if (rth->pipe && nladdr.nl_pid == 0)
+						rtnl_pipe_ack(rth, h);
 					goto skip_it;
+				}
 
 				if (h->nlmsg_flags & NLM_F_DUMP_INTR)
 					dump_intr = 1;
@@ -833,7 +895,7 @@ static int rtnl_dump_filter_l(struct rtnl_handle *rth,
 				if (h->nlmsg_type == NLMSG_DONE) {
 					err = rtnl_dump_done(h);
 					if (err < 0) {
-						free(buf);
+						rtnl_put_buf(rth, buf, iov.iov_len);
 						return -1;
 					}
 
@@ -843,14 +905,14 @@ static int rtnl_dump_filter_l(struct rtnl_handle *rth,
 
 				if (h->nlmsg_type == NLMSG_ERROR) {
 					rtnl_dump_error(rth, h);
-					free(buf);
+					rtnl_put_buf(rth, buf, iov.iov_len);
 					return -1;
 				}
 
 				if (!rth->dump_fp) {
 					err = a->filter(h, a->arg1);
 					if (err < 0) {
-						free(buf);
+						rtnl_put_buf(rth, buf, iov.iov_len);
 						return err;
 					}
 				}
@@ -859,7 +921,7 @@ skip_it:
 				h = NLMSG_NEXT(h, msglen);
 			}
 		}
-		free(buf);
+		rtnl_put_buf(rth, buf, iov.iov_len);
 
 		if (found_done) {
 			if (dump_intr)
@@ -891,6 +953,208 @@ int rtnl_dump_filter_nc(struct rtnl_handle *rth,
 	return rtnl_dump_filter_l(rth, a);
 }
 
+static int rtnl_arena_push(struct rtnl_dump_arena *a, struct nlmsghdr *n)
+{
+	if (a->count == a->size) {
+		int size = a->size ? a->size * 2 : 256;
+		struct nlmsghdr **msgs;
+
+		msgs = realloc(a->msgs, size * sizeof(*msgs));
+		if (!msgs)
+			return -1;
+		a->msgs = msgs;
+		a->size = size;
+	}
+
+	a->msgs[a->count++] = n;
+	return 0;
+}
+
+static int rtnl_arena_keep(struct rtnl_dump_arena *a, char *buf)
+{
+	char **bufs;
+
+	bufs = realloc(a->bufs, (a->nbufs + 1) * sizeof(*bufs));
+	if (!bufs)
+		return -1;
+
+	a->bufs = bufs;
+	a->bufs[a->nbufs++] = buf;
+	return 0;
+}
+
+static int rtnl_msg_ifindex(const struct nlmsghdr *n)
+{
+	switch (n->nlmsg_type) {
+	case RTM_NEWLINK:
+		if (n->nlmsg_len >= NLMSG_LENGTH(sizeof(struct ifinfomsg)))
+			return ((struct ifinfomsg *)NLMSG_DATA(n))->ifi_index;
+		break;
+	case RTM_NEWADDR:
+		if (n->nlmsg_len >= NLMSG_LENGTH(sizeof(struct ifaddrmsg)))
+			return ((struct ifaddrmsg *)NLMSG_DATA(n))->ifa_index;
+		break;
+	case RTM_NEWNEIGH:
+		if (n->nlmsg_len >= NLMSG_LENGTH(sizeof(struct ndmsg)))
+			return ((struct ndmsg *)NLMSG_DATA(n))->ndm_ifindex;
+		break;
+	}
+	return 0;
+}
+
+static int rtnl_arena_index(struct rtnl_dump_arena *a)
+{
+	int i, max = 0;
+
+	for (i = 0; i < a->count; i++) {
+		int ifindex = rtnl_msg_ifindex(a->msgs[i]);
+
+		if (ifindex > max)
+			max = ifindex;
+	}
+
+	free(a->head);
+	free(a->next);
+	a->head = malloc((max + 1) * sizeof(*a->head));
+	a->next = malloc((a->count + 1) * sizeof(*a->next));
+	if (!a->head || !a->next)
+		return -1;
+
+	a->max_index = max;
+	memset(a->head, -1, (max + 1) * sizeof(*a->head));
+
+	/* walk backwards so that every chain keeps the dump order */
+	for (i = a->count - 1; i >= 0; i--) {
+		int ifindex = rtnl_msg_ifindex(a->msgs[i]);
+
+		if (ifindex <= 0) {
+			a->next[i] = -1;
+			continue;
+		}
+		a->next[i] = a->head[ifindex];
+		a->head[ifindex] = i;
+	}
+	return 0;
+}
+
+/* Like rtnl_dump_filter(), but instead of handing every message to a
+ * callback the receive buffers are kept alive and the messages are left
+ * in place: a->msgs[] points straight into them, and a->head/a->next chain
+ * the messages of every ifindex (see rtnl_arena_first()).  Several dumps
+ * may be collected into the same arena; release it with rtnl_arena_free().
+ */
+int rtnl_dump_arena(struct rtnl_handle *rth, struct rtnl_dump_arena *a)
+{
+	struct sockaddr_nl nladdr;
+	struct iovec iov;
+	struct msghdr msg = {
+		.msg_name = &nladdr,
+		.msg_namelen = sizeof(nladdr),
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+	char *buf, *copy;
+	int dump_intr = 0;
+	int len = 0;
+
+	while (1) {
+		struct nlmsghdr *h;
+		int found_done = 0;
+		int kept = 0;
+		int status;
+
+		status = rtnl_recvmsg(rth, &msg, &buf);
+		if (status < 0)
+			return status;
+
+		if (rth->dump_fp)
+			fwrite(buf, 1, NLMSG_ALIGN(status), rth->dump_fp);
+
+		/* the handle buffer is reused, keep a copy of just this batch */
+		len = status;
+		copy = malloc(len);
+		if (!copy) {
+			rtnl_put_buf(rth, buf, iov.iov_len);
+			return -ENOMEM;
+		}
+		memcpy(copy, buf, len);
+		rtnl_put_buf(rth, buf, iov.iov_len);
+		buf = copy;
+
+		for (h = (struct nlmsghdr *)buf; NLMSG_OK(h, status);
+		     h = NLMSG_NEXT(h, status)) {
+			if (nladdr.nl_pid != 0 ||
+			    h->nlmsg_pid != rth->local.nl_pid ||
+			    h->nlmsg_seq != rth->dump) {
+				if (rth->pipe && nladdr.nl_pid == 0)
+					rtnl_pipe_ack(rth, h);
+				continue;
+			}
+
+			if (h->nlmsg_flags & NLM_F_DUMP_INTR)
+				dump_intr = 1;
+
+			if (h->nlmsg_type == NLMSG_DONE) {
+				if (rtnl_dump_done(h) < 0)
+					goto err;
+				found_done = 1;
+				break;
+			}
+
+			if (h->nlmsg_type == NLMSG_ERROR) {
+				rtnl_dump_error(rth, h);
+				goto err;
+			}
+
+			if (rtnl_arena_push(a, h) < 0)
+				goto err;
+			kept = 1;
+		}
+
+		if (!kept)
+			free(buf);
+		else if (rtnl_arena_keep(a, buf) < 0)
+			goto err;
+
+		if (found_done) {
+			if (dump_intr)
+				fprintf(stderr,
+					"Dump was interrupted and may be inconsistent.\n");
+			return rtnl_arena_index(a);
+		}
+
+		if (msg.msg_flags & MSG_TRUNC) {
+			fprintf(stderr, "Message truncated\n");
+			continue;
+		}
+		if (status) {
+			fprintf(stderr, "!!!Remnant of size %d\n", status);
+			exit(1);
+		}
+	}
+
+err:
+	/* drop whatever pointed into the buffer being discarded */
+	while (a->count && (char *)a->msgs[a->count - 1] >= buf &&
+	       (char *)a->msgs[a->count - 1] < buf + len)
+		a->count--;
+	free(buf);
+	return -1;
+}
+
+void rtnl_arena_free(struct rtnl_dump_arena *a)
+{
+	int i;
+
+	for (i = 0; i < a->nbufs; i++)
+		free(a->bufs[i]);
+	free(a->bufs);
+	free(a->msgs);
+	free(a->head);
+	free(a->next);
+	memset(a, 0, sizeof(*a));
+}
+
 static void rtnl_talk_error(struct nlmsghdr *h, struct nlmsgerr *err,
 			    nl_ext_ack_fn_t errfn)
 {
@@ -902,6 +1166,351 @@ static void rtnl_talk_error(struct nlmsghdr *h, struct nlmsgerr *err,
 }
 
 
+/* the handle buffer is reused, the caller gets a copy of its reply */
+static struct nlmsghdr *rtnl_answer_dup(const struct nlmsghdr *h)
+{
+	struct nlmsghdr *answer = malloc(h->nlmsg_len);
+
+	if (!answer) {
+		fprintf(stderr, "malloc error: not enough buffer\n");
+		return NULL;
+	}
+	memcpy(answer, h, h->nlmsg_len);
+	return answer;
+}
+
+/* Pipelined requests.  Once rtnl_pipe_open() was called on a handle,
+ * rtnl_talk() without an answer sends the request with NLM_F_ACK and
+ * returns right away, so the caller can build the next one while up to
+ * "depth" requests are in flight.  rtnetlink handles a request within
+ * sendmsg(), the ACKs queue up in order on the socket and are read in
+ * bulk: when the window is full, before any request that wants an answer
+ * (so the answer is never mixed up with them), whenever a dump runs into
+ * them, and from rtnl_pipe_flush().  Netlink hands out one datagram per
+ * recvmsg(), so the ACKs are read with recvmmsg() into small slots, one
+ * syscall for the whole window.  Failures are printed as rtnl_talk() would
+ * and then passed to errfn with the tag of the failed request.
+ *
+ * rtnl_pipe_bulk() goes further and packs the requests back to back into
+ * one datagram of up to RTNL_BULK_SIZE bytes.  Only the last request of a
+ * datagram asks for an ACK: the kernel answers the others only if they
+ * fail, in order, so that ACK also tells that all of them are done.
+ */
+#define RTNL_PIPE_SLOT		1024	/* a capped ACK with extack */
+#define RTNL_BULK_SIZE		32768	/* fits the SO_SNDBUF of rtnl_open() */
+
+struct rtnl_pipe_req {
+	__u32			seq;
+	int			tag;
+};
+
+struct rtnl_pipe {
+	unsigned int		depth;
+	unsigned int		head;		/* oldest request in flight */
+	unsigned int		inflight;
+	int			tag;
+	rtnl_pipe_err_fn_t	errfn;
+	void			*arg;
+	struct mmsghdr		*msgs;
+	struct iovec		*iov;
+	char			*slots;
+	char			*sbuf;		/* packed, not sent yet */
+	size_t			slen;
+	size_t			last;		/* offset of the last one */
+	struct rtnl_pipe_req	reqs[];
+};
+
+static void rtnl_pipe_free(struct rtnl_pipe *p)
+{
+	if (!p)
+		return;
+	free(p->msgs);
+	free(p->iov);
+	free(p->slots);
+	free(p->sbuf);
+	free(p);
+}
+
+int rtnl_pipe_open(struct rtnl_handle *rth, unsigned int depth,
+		   rtnl_pipe_err_fn_t errfn, void *arg)
+{
+	struct rtnl_pipe *p;
+	int one = 1;
+
+	if (!depth || rth->pipe) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	p = calloc(1, sizeof(*p) + depth * sizeof(p->reqs[0]));
+	if (!p)
+		return -1;
+
+	p->msgs = calloc(depth, sizeof(*p->msgs));
+	p->iov = calloc(depth, sizeof(*p->iov));
+	p->slots = malloc(depth * RTNL_PIPE_SLOT);
+	if (!p->msgs || !p->iov || !p->slots) {
+		rtnl_pipe_free(p);
+		return -1;
+	}
+
+	p->depth = depth;
+	p->errfn = errfn;
+	p->arg = arg;
+	rth->pipe = p;
+
+	/* keep error replies small, they wait in the receive queue */
+	setsockopt(rth->fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+	return 0;
+}
+
+/* pack up to "depth" requests per datagram from now on */
+int rtnl_pipe_bulk(struct rtnl_handle *rth)
+{
+	struct rtnl_pipe *p = rth->pipe;
+
+	if (!p) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!p->sbuf) {
+		p->sbuf = malloc(RTNL_BULK_SIZE);
+		if (!p->sbuf)
+			return -1;
+	}
+	return 0;
+}
+
+/* tag the requests sent from now on, batch mode uses the line number */
+void rtnl_pipe_tag(struct rtnl_handle *rth, int tag)
+{
+	if (rth->pipe)
+		rth->pipe->tag = tag;
+}
+
+static void rtnl_pipe_ack(struct rtnl_handle *rth, struct nlmsghdr *h)
+{
+	struct rtnl_pipe *p = rth->pipe;
+	struct nlmsgerr *err = NLMSG_DATA(h);
+	unsigned int k;
+	int tag;
+
+	if (h->nlmsg_type != NLMSG_ERROR ||
+	    h->nlmsg_pid != rth->local.nl_pid)
+		return;
+
+	/* normally the oldest, any in front had no NLM_F_ACK and succeeded */
+	for (k = 0; k < p->inflight; k++)
+		if (p->reqs[(p->head + k) % p->depth].seq == h->nlmsg_seq)
+			break;
+	if (k == p->inflight)
+		return;
+
+	tag = p->reqs[(p->head + k) % p->depth].tag;
+	p->head = (p->head + k + 1) % p->depth;
+	p->inflight -= k + 1;
+
+	if (h->nlmsg_len < NLMSG_LENGTH(sizeof(*err))) {
+		fprintf(stderr, "ERROR truncated\n");
+		if (p->errfn)
+			p->errfn(tag, -EBADMSG, p->arg);
+		return;
+	}
+
+	if (!err->error) {
+		nl_dump_ext_ack(h, NULL);
+		return;
+	}
+
+	rtnl_talk_error(h, err, NULL);
+	if (p->errfn)
+		p->errfn(tag, err->error, p->arg);
+}
+
+/* the socket overran or went away, nothing is known about these */
+static void rtnl_pipe_lost(struct rtnl_pipe *p, int error)
+{
+	while (p->inflight) {
+		if (p->errfn)
+			p->errfn(p->reqs[p->head].tag, error, p->arg);
+		p->head = (p->head + 1) % p->depth;
+		p->inflight--;
+	}
+}
+
+/* read ACKs until no more than limit requests are in flight */
+static int rtnl_pipe_wait(struct rtnl_handle *rth, unsigned int limit)
+{
+	struct rtnl_pipe *p = rth->pipe;
+
+	while (p->inflight > limit) {
+		unsigned int i, vlen = p->inflight;
+		int count;
+
+		for (i = 0; i < vlen; i++) {
+			p->iov[i].iov_base = p->slots + i * RTNL_PIPE_SLOT;
+			p->iov[i].iov_len = RTNL_PIPE_SLOT;
+			p->msgs[i].msg_hdr = (struct msghdr) {
+				.msg_iov = &p->iov[i],
+				.msg_iovlen = 1,
+			};
+		}
+
+		count = recvmmsg(rth->fd, p->msgs, vlen, MSG_WAITFORONE, NULL);
+		if (count < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			fprintf(stderr, "netlink receive error %s (%d)\n",
+				strerror(errno), errno);
+			rtnl_pipe_lost(p, -errno);
+			return -1;
+		}
+
+		for (i = 0; i < count; i++) {
+			struct nlmsghdr *h = p->iov[i].iov_base;
+			int len = p->msgs[i].msg_len;
+
+			/* a truncated error still names its request */
+			if (p->msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+				len = RTNL_PIPE_SLOT;
+			for (; NLMSG_OK(h, len); h = NLMSG_NEXT(h, len))
+				rtnl_pipe_ack(rth, h);
+		}
+	}
+	return 0;
+}
+
+static void rtnl_pipe_push(struct rtnl_pipe *p, __u32 seq)
+{
+	unsigned int tail = (p->head + p->inflight++) % p->depth;
+
+	p->reqs[tail].seq = seq;
+	p->reqs[tail].tag = p->tag;
+}
+
+/* send the packed requests and wait until the kernel is through them */
+static int rtnl_pipe_kick(struct rtnl_handle *rtnl)
+{
+	struct rtnl_pipe *p = rtnl->pipe;
+	struct nlmsghdr *last = (struct nlmsghdr *)(p->sbuf + p->last);
+	size_t len = p->slen;
+
+	if (!len)
+		return rtnl_pipe_wait(rtnl, 0);
+
+	last->nlmsg_flags |= NLM_F_ACK;
+	p->slen = 0;
+	if (send(rtnl->fd, p->sbuf, len, 0) < 0) {
+		int err = errno;
+
+		perror("Cannot talk to rtnetlink");
+		rtnl_pipe_lost(p, -err);
+		return -1;
+	}
+	return rtnl_pipe_wait(rtnl, 0);
+}
+
+static int rtnl_pipe_pack(struct rtnl_handle *rtnl, struct msghdr *msg)
+{
+	struct rtnl_pipe *p = rtnl->pipe;
+	size_t i, len = 0;
+
+	for (i = 0; i < msg->msg_iovlen; i++)
+		len += NLMSG_ALIGN(msg->msg_iov[i].iov_len);
+
+	if (p->slen + len > RTNL_BULK_SIZE ||
+	    p->inflight + msg->msg_iovlen > p->depth) {
+		if (rtnl_pipe_kick(rtnl) < 0)
+			return -1;
+	}
+
+	for (i = 0; i < msg->msg_iovlen; i++) {
+		struct nlmsghdr *h = msg->msg_iov[i].iov_base;
+
+		h->nlmsg_seq = ++rtnl->seq;
+		h->nlmsg_flags &= ~NLM_F_ACK;
+		p->last = p->slen;
+		memcpy(p->sbuf + p->slen, h, msg->msg_iov[i].iov_len);
+		p->slen += NLMSG_ALIGN(msg->msg_iov[i].iov_len);
+		rtnl_pipe_push(p, h->nlmsg_seq);
+	}
+	return 0;
+}
+
+static int rtnl_pipe_send(struct rtnl_handle *rtnl, struct msghdr *msg)
+{
+	struct rtnl_pipe *p = rtnl->pipe;
+	unsigned int i;
+
+	if (p->sbuf) {
+		size_t len = 0;
+
+		for (i = 0; i < msg->msg_iovlen; i++)
+			len += NLMSG_ALIGN(msg->msg_iov[i].iov_len);
+		if (len <= RTNL_BULK_SIZE)
+			return rtnl_pipe_pack(rtnl, msg);
+		/* too big to pack, send it on its own */
+		if (rtnl_pipe_kick(rtnl) < 0)
+			return -1;
+	}
+
+	if (rtnl_pipe_wait(rtnl, p->depth - msg->msg_iovlen) < 0)
+		return -1;
+
+	for (i = 0; i < msg->msg_iovlen; i++) {
+		struct nlmsghdr *h = msg->msg_iov[i].iov_base;
+
+		h->nlmsg_seq = ++rtnl->seq;
+		h->nlmsg_flags |= NLM_F_ACK;
+	}
+
+	if (sendmsg(rtnl->fd, msg, 0) < 0) {
+		perror("Cannot talk to rtnetlink");
+		return -1;
+	}
+
+	for (i = 0; i < msg->msg_iovlen; i++) {
+		struct nlmsghdr *h = msg->msg_iov[i].iov_base;
+
+		rtnl_pipe_push(p, h->nlmsg_seq);
+	}
+
+	/* when packing, only what is in sbuf may be outstanding */
+	if (p->sbuf)
+		return rtnl_pipe_wait(rtnl, 0);
+	return 0;
+}
+
+/* wait for every request in flight, the ordering barrier of batch mode */
+int rtnl_pipe_flush(struct rtnl_handle *rth)
+{
+	if (!rth->pipe)
+		return 0;
+	if (rth->pipe->sbuf)
+		return rtnl_pipe_kick(rth);
+	return rtnl_pipe_wait(rth, 0);
+}
+
+/* forget the packed requests that were not sent yet */
+void rtnl_pipe_abort(struct rtnl_handle *rth)
+{
+	struct rtnl_pipe *p = rth->pipe;
+
+	if (p && p->slen) {
+		p->slen = 0;
+		p->inflight = 0;
+	}
+}
+
+void rtnl_pipe_close(struct rtnl_handle *rth)
+{
+	if (!rth->pipe)
+		return;
+	rtnl_pipe_flush(rth);
+	rtnl_pipe_free(rth->pipe);
+	rth->pipe = NULL;
+}
+
 static int __rtnl_talk_iov(struct rtnl_handle *rtnl, struct iovec *iov,
 			   size_t iovlen, struct nlmsghdr **answer,
 			   bool show_rtnl_err, nl_ext_ack_fn_t errfn)
@@ -919,6 +1528,14 @@ static int __rtnl_talk_iov(struct rtnl_handle *rtnl, struct iovec *iov,
 	int i, status;
 	char *buf;
 
+	if (rtnl->pipe) {
+		if (!answer && show_rtnl_err && !errfn &&
+		    iovlen <= rtnl->pipe->depth)
+			return rtnl_pipe_send(rtnl, &msg);
+		if (rtnl_pipe_flush(rtnl) < 0)
+			return -1;
+	}
+
 	for (i = 0; i < iovlen; i++) {
 		h = iov[i].iov_base;
 		h->nlmsg_seq = seq = ++rtnl->seq;
@@ -938,7 +1555,7 @@ static int __rtnl_talk_iov(struct rtnl_handle *rtnl, struct iovec *iov,
 	i = 0;
 	while (1) {
 next:
-		status = rtnl_recvmsg(rtnl->fd, &msg, &buf);
+		status = rtnl_recvmsg(rtnl, &msg, &buf);
 		++i;
 
 		if (status < 0)
@@ -957,7 +1574,7 @@ next:
 			if (l < 0 || len > status) {
 				if (msg.msg_flags & MSG_TRUNC) {
 					fprintf(stderr, "Truncated message\n");
-					free(buf);
+					rtnl_put_buf(rtnl, buf, riov.iov_len);
 					return -1;
 				}
 				fprintf(stderr,
@@ -968,7 +1585,7 @@ next:
 
 			if (nladdr.nl_pid != 0 ||
 			    h->nlmsg_pid != rtnl->local.nl_pid ||
-			    h->nlmsg_seq > seq || h->nlmsg_seq < seq - iovlen) {
+			    h->nlmsg_seq > seq || h->nlmsg_seq <= seq - iovlen) {
 				/* Don't forget to skip that message. */
 				status -= NLMSG_ALIGN(len);
 				h = (struct nlmsghdr *)((char *)h + NLMSG_ALIGN(len));
@@ -981,7 +1598,7 @@ next:
 
 				if (l < sizeof(struct nlmsgerr)) {
 					fprintf(stderr, "ERROR truncated\n");
-					free(buf);
+					rtnl_put_buf(rtnl, buf, riov.iov_len);
 					return -1;
 				}
 
@@ -997,9 +1614,8 @@ next:
 				}
 
 				if (answer)
-					*answer = (struct nlmsghdr *)buf;
-				else
-					free(buf);
+					*answer = rtnl_answer_dup(h);
+				rtnl_put_buf(rtnl, buf, riov.iov_len);
 
 				if (i < iovlen)
 					goto next;
@@ -1007,8 +1623,9 @@ next:
 			}
 
 			if (answer) {
-				*answer = (struct nlmsghdr *)buf;
-				return 0;
+				*answer = rtnl_answer_dup(h);
+				rtnl_put_buf(rtnl, buf, riov.iov_len);
+				return *answer ? 0 : -1;
 			}
 
 			fprintf(stderr, "Unexpected reply!!!\n");
@@ -1016,7 +1633,7 @@ next:
 			status -= NLMSG_ALIGN(len);
 			h = (struct nlmsghdr *)((char *)h + NLMSG_ALIGN(len));
 		}
-		free(buf);
+		rtnl_put_buf(rtnl, buf, riov.iov_len);
 
 		if (msg.msg_flags & MSG_TRUNC) {
 			fprintf(stderr, "Message truncated\n");
@@ -1101,11 +1718,18 @@ int rtnl_listen(struct rtnl_handle *rtnl,
 		struct cmsghdr *cmsg;
 
 		iov.iov_len = sizeof(buf);
+		/* recvmsg() shrinks msg_controllen to what it returned */
+		if (rtnl->flags & RTNL_HANDLE_F_LISTEN_ALL_NSID)
+			msg.msg_controllen = sizeof(cmsgbuf);
 		status = recvmsg(rtnl->fd, &msg, 0);
 
 		if (status < 0) {
 			if (errno == EINTR || errno == EAGAIN)
 				continue;
+			/* the caller resyncs, notifications were lost */
+			if (errno == ENOBUFS &&
+			    (rtnl->flags & RTNL_HANDLE_F_LISTEN_ENOBUFS))
+				return -ENOBUFS;
 			fprintf(stderr, "netlink receive error %s (%d)\n",
 				strerror(errno), errno);
 			if (errno == ENOBUFS)
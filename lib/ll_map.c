@@ -17,6 +17,7 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <string.h>
+#include <errno.h>
 #include <net/if.h>
 
 #include "libnetlink.h"
@@ -25,54 +26,180 @@
 #include "utils.h"
 
 struct ll_cache {
-	struct hlist_node idx_hash;
 	struct hlist_node name_hash;
 	unsigned	flags;
 	unsigned 	index;
+	unsigned	hash;
 	unsigned short	type;
 	struct list_head altnames_list;
 	char		name[];
 };
 
 #define IDXMAP_SIZE	1024
-static struct hlist_head idx_head[IDXMAP_SIZE];
-static struct hlist_head name_head[IDXMAP_SIZE];
+
+/* All entries by name, altnames included: chained buckets, doubled
+ * whenever there would be more entries than buckets.
+ */
+static struct hlist_head *name_head;
+static unsigned int name_size;
+static unsigned int name_count;
+
+/* Parent entries by ifindex: open addressing with linear probing, grown
+ * to keep it at most half full.  Interface indexes are mostly dense, so
+ * the low bits alone spread them well.
+ */
+static struct ll_cache **idx_map;
+static unsigned int idx_size;
+static unsigned int idx_count;
 
 static struct ll_cache *ll_get_by_index(unsigned index)
 {
-	struct hlist_node *n;
-	unsigned h = index & (IDXMAP_SIZE - 1);
+	unsigned int mask = idx_size - 1;
+	unsigned int h;
 
-	hlist_for_each(n, &idx_head[h]) {
-		struct ll_cache *im
-			= container_of(n, struct ll_cache, idx_hash);
-		if (im->index == index)
-			return im;
+	if (!idx_size)
+		return NULL;
+
+	for (h = index & mask; idx_map[h]; h = (h + 1) & mask) {
+		if (idx_map[h]->index == index)
+			return idx_map[h];
 	}
 
 	return NULL;
 }
 
+static void ll_idx_place(struct ll_cache *im)
+{
+	unsigned int mask = idx_size - 1;
+	unsigned int h;
+
+	for (h = im->index & mask; idx_map[h]; h = (h + 1) & mask)
+		;
+	idx_map[h] = im;
+}
+
+static int ll_idx_insert(struct ll_cache *im)
+{
+	if (2 * (idx_count + 1) > idx_size) {
+		unsigned int i, old_size = idx_size;
+		struct ll_cache **old = idx_map;
+
+		idx_map = calloc(old_size ? old_size * 2 : IDXMAP_SIZE,
+				 sizeof(*idx_map));
+		if (!idx_map) {
+			idx_map = old;
+			return -1;
+		}
+		idx_size = old_size ? old_size * 2 : IDXMAP_SIZE;
+
+		for (i = 0; i < old_size; i++) {
+			if (old[i])
+				ll_idx_place(old[i]);
+		}
+		free(old);
+	}
+
+	ll_idx_place(im);
+	idx_count++;
+	return 0;
+}
+
+static void ll_idx_remove(struct ll_cache *im)
+{
+	unsigned int mask = idx_size - 1;
+	unsigned int i, j;
+
+	for (i = im->index & mask; idx_map[i] != im; i = (i + 1) & mask)
+		;
+
+	/* pull back later entries whose probe sequence crosses the hole */
+	for (j = (i + 1) & mask; idx_map[j]; j = (j + 1) & mask) {
+		unsigned int h = idx_map[j]->index & mask;
+
+		if (((j - h) & mask) >= ((j - i) & mask)) {
+			idx_map[i] = idx_map[j];
+			i = j;
+		}
+	}
+
+	idx_map[i] = NULL;
+	idx_count--;
+}
+
+/* Word at a time multiply and xorshift, finished with the murmur3
+ * avalanche.  Interface names mostly differ in their last characters
+ * (veth1234, eth0.100), which needs every input bit to reach the low
+ * bits used for the bucket.
+ */
 unsigned namehash(const char *str)
 {
-	unsigned hash = 5381;
+	size_t len = strlen(str);
+	__u64 h = 0x9e3779b97f4a7c15ULL ^ len;
+	__u64 w;
+
+	for (; len >= sizeof(w); len -= sizeof(w), str += sizeof(w)) {
+		memcpy(&w, str, sizeof(w));
+		h = (h ^ w) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	}
+	w = 0;
+	memcpy(&w, str, len);
+	h = (h ^ w) * 0xff51afd7ed558ccdULL;
+
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
 
-	while (*str)
-		hash = ((hash << 5) + hash) + *str++; /* hash * 33 + c */
+static void ll_name_insert(struct ll_cache *im)
+{
+	if (name_count + 1 > name_size) {
+		unsigned int i, old_size = name_size;
+		unsigned int size = old_size ? old_size * 2 : IDXMAP_SIZE;
+		struct hlist_head *old = name_head;
+		struct hlist_node *n, *tmp;
+
+		/* without memory, live with longer chains */
+		name_head = calloc(size, sizeof(*name_head));
+		if (!name_head) {
+			name_head = old;
+		} else {
+			name_size = size;
+			for (i = 0; i < old_size; i++) {
+				hlist_for_each_safe(n, tmp, &old[i]) {
+					struct ll_cache *e = container_of(n,
+						struct ll_cache, name_hash);
+
+					hlist_add_head(&e->name_hash,
+						&name_head[e->hash & (size - 1)]);
+				}
+			}
+			free(old);
+		}
+	}
 
-	return hash;
+	/* left unhashed if not even the first table could be had */
+	if (!name_size)
+		return;
+	hlist_add_head(&im->name_hash, &name_head[im->hash & (name_size - 1)]);
+	name_count++;
 }
 
 static struct ll_cache *ll_get_by_name(const char *name)
 {
 	struct hlist_node *n;
-	unsigned h = namehash(name) & (IDXMAP_SIZE - 1);
+	unsigned h;
+
+	if (!name_size)
+		return NULL;
 
-	hlist_for_each(n, &name_head[h]) {
+	h = namehash(name);
+	hlist_for_each(n, &name_head[h & (name_size - 1)]) {
 		struct ll_cache *im
 			= container_of(n, struct ll_cache, name_hash);
 
-		if (strcmp(im->name, name) == 0)
+		if (im->hash == h && strcmp(im->name, name) == 0)
 			return im;
 	}
 
@@ -84,12 +211,13 @@ static struct ll_cache *ll_entry_create(struct ifinfomsg *ifi,
 					struct ll_cache *parent_im)
 {
 	struct ll_cache *im;
-	unsigned int h;
 
 	im = malloc(sizeof(*im) + strlen(ifname) + 1);
 	if (!im)
 		return NULL;
 	im->index = ifi->ifi_index;
+	im->hash = namehash(ifname);
+	im->name_hash.pprev = NULL;
 	strcpy(im->name, ifname);
 	im->type = ifi->ifi_type;
 	im->flags = ifi->ifi_flags;
@@ -98,37 +226,34 @@ static struct ll_cache *ll_entry_create(struct ifinfomsg *ifi,
 		list_add_tail(&im->altnames_list, &parent_im->altnames_list);
 	} else {
 		/* This is parent, insert to index hash. */
-		h = ifi->ifi_index & (IDXMAP_SIZE - 1);
-		hlist_add_head(&im->idx_hash, &idx_head[h]);
+		if (ll_idx_insert(im) < 0) {
+			free(im);
+			return NULL;
+		}
 		INIT_LIST_HEAD(&im->altnames_list);
 	}
 
-	h = namehash(ifname) & (IDXMAP_SIZE - 1);
-	hlist_add_head(&im->name_hash, &name_head[h]);
+	ll_name_insert(im);
 	return im;
 }
 
 static void ll_entry_destroy(struct ll_cache *im, bool im_is_parent)
 {
-	hlist_del(&im->name_hash);
+	if (im->name_hash.pprev) {
+		hlist_del(&im->name_hash);
+		name_count--;
+	}
 	if (im_is_parent)
-		hlist_del(&im->idx_hash);
+		ll_idx_remove(im);
 	else
 		list_del(&im->altnames_list);
 	free(im);
 }
 
-static void ll_entry_update(struct ll_cache *im, struct ifinfomsg *ifi,
-			    const char *ifname)
+static void ll_entry_update(struct ll_cache *im, struct ifinfomsg *ifi)
 {
-	unsigned int h;
-
+	im->type = ifi->ifi_type;
 	im->flags = ifi->ifi_flags;
-	if (!strcmp(im->name, ifname))
-		return;
-	hlist_del(&im->name_hash);
-	h = namehash(ifname) & (IDXMAP_SIZE - 1);
-	hlist_add_head(&im->name_hash, &name_head[h]);
 }
 
 static void ll_altname_entries_create(struct ll_cache *parent_im,
@@ -215,9 +340,7 @@ static void ll_entries_destroy(struct ll_cache *parent_im)
 static void ll_entries_update(struct ll_cache *parent_im,
 			      struct ifinfomsg *ifi, struct rtattr **tb)
 {
-	if (tb[IFLA_IFNAME])
-		ll_entry_update(parent_im, ifi,
-				rta_getattr_str(tb[IFLA_IFNAME]));
+	ll_entry_update(parent_im, ifi);
 	ll_altname_entries_update(parent_im, ifi, tb);
 }
 
@@ -242,6 +365,14 @@ int ll_remember_index(struct nlmsghdr *n, void *arg)
 
 	parse_rtattr_flags(tb, IFLA_MAX, IFLA_RTA(ifi),
 			   IFLA_PAYLOAD(n), NLA_F_NESTED);
+
+	/* the name is stored inline, a renamed link starts over */
+	if (im && tb[IFLA_IFNAME] &&
+	    strcmp(im->name, rta_getattr_str(tb[IFLA_IFNAME]))) {
+		ll_entries_destroy(im);
+		im = NULL;
+	}
+
 	if (im)
 		ll_entries_update(im, ifi, tb);
 	else
@@ -249,6 +380,133 @@ int ll_remember_index(struct nlmsghdr *n, void *arg)
 	return 0;
 }
 
+/*
+ * Subscription mode: a socket joined to RTNLGRP_LINK before the initial
+ * dump feeds every later RTM_NEWLINK/RTM_DELLINK into the cache, so that
+ * it never goes stale and a miss means the link does not exist.  Nothing
+ * is read until ll_map_sync() is called, typically when the descriptor
+ * returned by ll_map_subscribe() polls readable, or on a lookup miss.
+ */
+static struct rtnl_handle ll_sub = { .fd = -1 };
+static int ll_map_loaded;
+
+static void ll_map_flush(void)
+{
+	unsigned int i;
+
+	/* removal may shift a later entry into slot i */
+	for (i = 0; i < idx_size; i++) {
+		while (idx_map[i])
+			ll_entries_destroy(idx_map[i]);
+	}
+}
+
+/* Drop the cache and load it again from a full dump */
+static int ll_map_resync(void)
+{
+	struct rtnl_handle rth = { .fd = -1 };
+	int err = -1;
+
+	ll_map_flush();
+	ll_map_loaded = 0;
+
+	if (rtnl_open(&rth, 0) < 0)
+		return -1;
+
+	if (rtnl_linkdump_req_filter(&rth, AF_UNSPEC,
+				     RTEXT_FILTER_SKIP_STATS) < 0) {
+		perror("Cannot send dump request");
+		goto out;
+	}
+	if (rtnl_dump_filter(&rth, ll_remember_index, NULL) < 0) {
+		fprintf(stderr, "Dump terminated\n");
+		goto out;
+	}
+
+	ll_map_loaded = 1;
+	err = 0;
+out:
+	rtnl_close(&rth);
+	return err;
+}
+
+/* Load every link and keep the cache current from link notifications.
+ * Returns the descriptor to poll for ll_map_sync(), or -1 on error.
+ */
+int ll_map_subscribe(void)
+{
+	if (ll_sub.fd >= 0)
+		return ll_sub.fd;
+
+	/* join first so that nothing after the dump is missed */
+	if (rtnl_open(&ll_sub, RTMGRP_LINK) < 0)
+		return -1;
+
+	if (ll_map_resync() < 0) {
+		rtnl_close(&ll_sub);
+		ll_sub.fd = -1;
+		return -1;
+	}
+	return ll_sub.fd;
+}
+
+bool ll_map_subscribed(void)
+{
+	return ll_sub.fd >= 0;
+}
+
+/* Apply the pending link notifications without blocking.  Returns the
+ * number of messages applied, or -1 on error.  If the kernel dropped any
+ * or one did not fit, the cache is reloaded from scratch.
+ */
+int ll_map_sync(void)
+{
+	struct sockaddr_nl nladdr;
+	char buf[32768];
+	struct iovec iov = {
+		.iov_base = buf,
+		.iov_len = sizeof(buf),
+	};
+	struct msghdr msg = {
+		.msg_name = &nladdr,
+		.msg_namelen = sizeof(nladdr),
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+	int applied = 0;
+
+	if (ll_sub.fd < 0)
+		return 0;
+
+	while (1) {
+		struct nlmsghdr *h;
+		int len;
+
+		len = recvmsg(ll_sub.fd, &msg, MSG_DONTWAIT);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return applied;
+			if (errno != ENOBUFS)
+				return -1;
+		}
+
+		if (len < 0 || msg.msg_flags & MSG_TRUNC) {
+			if (ll_map_resync() < 0)
+				return -1;
+			applied++;
+			continue;
+		}
+
+		for (h = (struct nlmsghdr *)buf; NLMSG_OK(h, len);
+		     h = NLMSG_NEXT(h, len)) {
+			ll_remember_index(h, NULL);
+			applied++;
+		}
+	}
+}
+
 const char *ll_idx_n2a(unsigned int idx)
 {
 	static char buf[IFNAMSIZ];
@@ -321,6 +579,15 @@ const char *ll_index_to_name(unsigned int idx)
 	if (im)
 		return im->name;
 
+	if (ll_map_subscribed()) {
+		if (ll_map_sync() > 0) {
+			im = ll_get_by_index(idx);
+			if (im)
+				return im->name;
+		}
+		return ll_idx_n2a(idx);
+	}
+
 	if (ll_link_get(NULL, idx) == idx) {
 		im = ll_get_by_index(idx);
 		if (im)
@@ -367,6 +634,15 @@ unsigned ll_name_to_index(const char *name)
 	if (im)
 		return im->index;
 
+	if (ll_map_subscribed()) {
+		if (ll_map_sync() > 0) {
+			im = ll_get_by_name(name);
+			if (im)
+				return im->index;
+		}
+		return ll_idx_a2n(name);
+	}
+
 	idx = ll_link_get(name, 0);
 	if (idx == 0)
 		idx = if_nametoindex(name);
@@ -383,17 +659,12 @@ void ll_drop_by_index(unsigned index)
 	if (!im)
 		return;
 
-	hlist_del(&im->idx_hash);
-	hlist_del(&im->name_hash);
-
-	free(im);
+	ll_entries_destroy(im);
 }
 
 void ll_init_map(struct rtnl_handle *rth)
 {
-	static int initialized;
-
-	if (initialized)
+	if (ll_map_loaded)
 		return;
 
 	if (rtnl_linkdump_req(rth, AF_UNSPEC) < 0) {
@@ -406,5 +677,5 @@ void ll_init_map(struct rtnl_handle *rth)
 		exit(1);
 	}
 
-	initialized = 1;
+	ll_map_loaded = 1;
 }
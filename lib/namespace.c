@@ -46,12 +46,14 @@ static void bind_etc(const char *name)
 	closedir(dir);
 }
 
-int netns_switch(char *name)
+/* Move the calling thread into the network namespace of name, without
+ * touching the mount namespace.  Enough for anything that only talks
+ * netlink; use netns_switch() when /sys or /etc must match as well.
+ */
+int netns_switch_net(char *name)
 {
 	char net_path[PATH_MAX];
 	int netns;
-	unsigned long mountflags = 0;
-	struct statvfs fsstat;
 
 	snprintf(net_path, sizeof(net_path), "/proc/%s/ns/net", name);
 	netns = open(net_path, O_RDONLY | O_CLOEXEC);
@@ -68,6 +70,16 @@ int netns_switch(char *name)
 		return -1;
 	}
 	close(netns);
+	return 0;
+}
+
+int netns_switch(char *name)
+{
+	unsigned long mountflags = 0;
+	struct statvfs fsstat;
+
+	if (netns_switch_net(name) < 0)
+		return -1;
 
 	if (unshare(CLONE_NEWNS) < 0) {
 		fprintf(stderr, "unshare failed: %s\n", strerror(errno));
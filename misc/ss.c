@@ -28,6 +28,8 @@
 #include <stdbool.h>
 #include <limits.h>
 #include <stdarg.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "ss_util.h"
 #include "utils.h"
@@ -114,6 +116,14 @@ static int sctp_ino;
 static int show_tipcinfo;
 static int show_tos;
 static int show_cgroup;
+static int parallel_dumps;
+static int stream_output;
+static unsigned int interval_secs;
+static unsigned int top_k;
+static int top_by = -1;
+static int group_by;
+static unsigned int group_prefixlen;
+static bool sockdiag_planning;
 int oneline;
 
 enum col_id {
@@ -183,6 +193,7 @@ static struct {
 	struct buf_chunk *head;	/* First chunk */
 	struct buf_chunk *tail;	/* Current chunk */
 	int chunks;		/* Number of allocated chunks */
+	unsigned int tokens;	/* Number of flushed tokens */
 } buffer;
 
 static const char *TCP_PROTO = "tcp";
@@ -480,6 +491,10 @@ static FILE *generic_proc_open(const char *env, const char *name)
 	const char *p = getenv(env);
 	char store[128];
 
+	/* nothing but sock_diag requests while planning */
+	if (sockdiag_planning)
+		return NULL;
+
 	if (!p) {
 		p = getenv("PROC_ROOT") ? : "/proc";
 		snprintf(store, sizeof(store)-1, "%s/%s", p, name);
@@ -752,6 +767,343 @@ next:
 	return cnt;
 }
 
+/* --lazy-users: nothing is read from /proc up front.  proc_ctx_print()
+ * records the socket inode with its position in the output buffer (token
+ * number and offset, kept aside so no socket data can forge one) and
+ * render() resolves all of them at once.  The fds of every process are
+ * read by proc_threads threads into a sorted index of (ino, pid, fd);
+ * only processes that own a printed socket get their name looked up.
+ * The index is kept: with --events it is rebuilt on a miss at most once
+ * a second, with --users-uid (only processes running as one of the
+ * socket owners are read) when a new owner shows up.
+ */
+#define USER_PROC_HASH_SIZE	1024
+
+struct user_fd {
+	unsigned int	ino;
+	int		pid;
+	int		fd;
+};
+
+struct user_proc {
+	struct user_proc *next;
+	int		pid;
+	char		name[16];
+};
+
+/* where the owners of a socket go in the buffered output */
+struct user_ref {
+	unsigned int	token;
+	unsigned int	off;
+	unsigned int	ino;
+};
+
+static int lazy_users;
+static int users_by_uid;
+static unsigned int proc_threads = 1;
+
+static struct {
+	struct user_fd	*fds;
+	size_t		count;
+	bool		built;
+	time_t		stamp;		/* of the last build */
+	struct user_ref	*refs;		/* in buffer order */
+	size_t		nrefs;
+	size_t		refs_size;
+	char		*users;		/* last user_lazy_format() */
+	int		users_size;
+	unsigned int	misses;		/* refs not in the index */
+	unsigned int	*uids;		/* socket owners, sorted */
+	size_t		nuids;
+	size_t		uids_built;
+	struct user_proc *procs[USER_PROC_HASH_SIZE];
+} user_lazy;
+
+
+static int user_uid_cmp(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a;
+	unsigned int y = *(const unsigned int *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void user_lazy_add_uid(unsigned int uid)
+{
+	unsigned int *uids;
+	size_t i;
+
+	if (bsearch(&uid, user_lazy.uids, user_lazy.nuids,
+		    sizeof(uid), user_uid_cmp))
+		return;
+
+	uids = realloc(user_lazy.uids, (user_lazy.nuids + 1) * sizeof(uid));
+	if (!uids)
+		abort();
+	for (i = user_lazy.nuids; i > 0 && uids[i - 1] > uid; i--)
+		uids[i] = uids[i - 1];
+	uids[i] = uid;
+	user_lazy.uids = uids;
+	user_lazy.nuids++;
+}
+
+struct user_fds {
+	struct user_fd	*fds;
+	size_t		count;
+	size_t		size;
+};
+
+static void user_fds_push(struct user_fds *v, unsigned int ino,
+			  int pid, int fd)
+{
+	if (v->count == v->size) {
+		v->size = v->size ? v->size * 2 : 256;
+		v->fds = realloc(v->fds, v->size * sizeof(*v->fds));
+		if (!v->fds) {
+			fprintf(stderr, "ss: failed to malloc buffer\n");
+			abort();
+		}
+	}
+	v->fds[v->count++] = (struct user_fd) {
+		.ino = ino, .pid = pid, .fd = fd,
+	};
+}
+
+struct user_scan {
+	const char	*root;
+	int		*pids;
+	size_t		npids;
+	size_t		next;
+	pthread_mutex_t	lock;
+	struct user_fds	all;
+};
+
+static void *user_scan_thread(void *arg)
+{
+	struct user_scan *sc = arg;
+	struct user_fds mine = {};
+	char name[1024];
+
+	while (1) {
+		struct dirent *d;
+		size_t i;
+		DIR *dir;
+		int pid;
+
+		pthread_mutex_lock(&sc->lock);
+		i = sc->next++;
+		pthread_mutex_unlock(&sc->lock);
+		if (i >= sc->npids)
+			break;
+
+		pid = sc->pids[i];
+		snprintf(name, sizeof(name), "%s/%d/fd", sc->root, pid);
+		dir = opendir(name);
+		if (!dir)
+			continue;
+
+		while ((d = readdir(dir)) != NULL) {
+			const char *pattern = "socket:[";
+			unsigned int ino;
+			char lnk[64];
+			ssize_t len;
+			int fd;
+			char crap;
+
+			if (sscanf(d->d_name, "%d%c", &fd, &crap) != 1)
+				continue;
+
+			len = readlinkat(dirfd(dir), d->d_name, lnk,
+					 sizeof(lnk) - 1);
+			if (len < (ssize_t)strlen(pattern))
+				continue;
+			lnk[len] = '\0';
+
+			if (strncmp(lnk, pattern, strlen(pattern)) ||
+			    sscanf(lnk, "socket:[%u]", &ino) != 1)
+				continue;
+
+			user_fds_push(&mine, ino, pid, fd);
+		}
+		closedir(dir);
+	}
+
+	pthread_mutex_lock(&sc->lock);
+	if (!sc->all.fds) {
+		sc->all = mine;
+		mine.fds = NULL;
+	} else {
+		size_t i;
+
+		for (i = 0; i < mine.count; i++)
+			user_fds_push(&sc->all, mine.fds[i].ino,
+				      mine.fds[i].pid, mine.fds[i].fd);
+	}
+	pthread_mutex_unlock(&sc->lock);
+	free(mine.fds);
+	return NULL;
+}
+
+static int user_fd_cmp(const void *a, const void *b)
+{
+	const struct user_fd *x = a, *y = b;
+
+	if (x->ino != y->ino)
+		return x->ino < y->ino ? -1 : 1;
+	if (x->pid != y->pid)
+		return x->pid < y->pid ? -1 : 1;
+	return x->fd < y->fd ? -1 : x->fd > y->fd;
+}
+
+static void user_lazy_build(void)
+{
+	struct user_scan sc = {
+		.root = getenv("PROC_ROOT") ? : "/proc",
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+	};
+	pthread_t *threads;
+	struct dirent *d;
+	unsigned int i, n;
+	size_t size = 0;
+	DIR *dir;
+
+	dir = opendir(sc.root);
+	if (!dir)
+		return;
+
+	while ((d = readdir(dir)) != NULL) {
+		struct stat st;
+		int pid;
+		char crap;
+
+		if (sscanf(d->d_name, "%d%c", &pid, &crap) != 1)
+			continue;
+
+		/* /proc/<pid> belongs to the effective uid of the process */
+		if (users_by_uid &&
+		    (fstatat(dirfd(dir), d->d_name, &st, 0) < 0 ||
+		     !bsearch(&st.st_uid, user_lazy.uids, user_lazy.nuids,
+			      sizeof(unsigned int), user_uid_cmp)))
+			continue;
+
+		if (sc.npids == size) {
+			size = size ? size * 2 : 1024;
+			sc.pids = realloc(sc.pids, size * sizeof(*sc.pids));
+			if (!sc.pids)
+				abort();
+		}
+		sc.pids[sc.npids++] = pid;
+	}
+	closedir(dir);
+
+	n = min(proc_threads, (unsigned int)sc.npids);
+	threads = calloc(n ? n : 1, sizeof(*threads));
+	if (!threads)
+		abort();
+	for (i = 1; i < n; i++)
+		if (pthread_create(&threads[i], NULL, user_scan_thread, &sc))
+			break;
+	user_scan_thread(&sc);
+	while (--i > 0)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	free(sc.pids);
+
+	qsort(sc.all.fds, sc.all.count, sizeof(*sc.all.fds), user_fd_cmp);
+
+	free(user_lazy.fds);
+	user_lazy.fds = sc.all.fds;
+	user_lazy.count = sc.all.count;
+	user_lazy.built = true;
+	user_lazy.stamp = time(NULL);
+	user_lazy.uids_built = user_lazy.nuids;
+}
+
+static const char *user_proc_name(int pid)
+{
+	struct user_proc **pp = &user_lazy.procs[pid % USER_PROC_HASH_SIZE];
+	struct user_proc *p;
+	char tmp[1024];
+	FILE *fp;
+
+	for (p = *pp; p; p = p->next)
+		if (p->pid == pid)
+			return p->name;
+
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		abort();
+	p->pid = pid;
+	snprintf(tmp, sizeof(tmp), "%s/%d/stat",
+		 getenv("PROC_ROOT") ? : "/proc", pid);
+	fp = fopen(tmp, "r");
+	if (fp) {
+		if (fscanf(fp, "%*d (%15[^)])", p->name) < 1)
+			; /* ignore */
+		fclose(fp);
+	}
+	p->next = *pp;
+	*pp = p;
+	return p->name;
+}
+
+static struct user_fd *user_lazy_find(unsigned int ino)
+{
+	size_t lo = 0, hi = user_lazy.count;
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+
+		if (user_lazy.fds[mid].ino < ino)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == user_lazy.count || user_lazy.fds[lo].ino != ino)
+		return NULL;
+	return &user_lazy.fds[lo];
+}
+
+/* " users:(...)" for the inode like find_entry(), into user_lazy.users,
+ * growing it as needed; returns the length, 0 if the inode has no owner
+ */
+static int user_lazy_format(unsigned int ino)
+{
+	struct user_fd *first = user_lazy_find(ino), *p, *last;
+	int len;
+
+	if (!first)
+		return 0;
+
+	for (last = first; last < user_lazy.fds + user_lazy.count &&
+	     last->ino == ino; last++)
+		;
+
+again:
+	/* newest pid first, the order user_ent_hash_build() gives */
+	len = snprintf(user_lazy.users, user_lazy.users_size, " users:(");
+	for (p = last; p-- > first && len < user_lazy.users_size; )
+		len += snprintf(user_lazy.users + len,
+				user_lazy.users_size - len,
+				"(\"%s\",pid=%d,fd=%d)%s",
+				user_proc_name(p->pid), p->pid, p->fd,
+				p > first ? "," : ")");
+
+	if (len >= user_lazy.users_size) {
+		char *new_buf;
+
+		new_buf = realloc(user_lazy.users, len + ENTRY_BUF_SIZE);
+		if (!new_buf) {
+			fprintf(stderr, "ss: failed to malloc buffer\n");
+			abort();
+		}
+		user_lazy.users = new_buf;
+		user_lazy.users_size = len + ENTRY_BUF_SIZE;
+		goto again;
+	}
+	return len;
+}
+
 static unsigned long long cookie_sk_get(const uint32_t *cookie)
 {
 	return (((unsigned long long)cookie[1] << 31) << 1) | cookie[0];
@@ -1081,6 +1433,7 @@ static void field_flush(struct column *f)
 	if (f->disabled)
 		return;
 
+	buffer.tokens++;
 	chunk = buffer.tail;
 	pad = buffer.cur->len % 2;
 
@@ -1134,6 +1487,25 @@ static void buf_free_all(void)
 	}
 	buffer.head = NULL;
 	buffer.chunks = 0;
+	buffer.tokens = 0;
+}
+
+/* Drop all buffered content but keep the first chunk for reuse */
+static void buf_reset(void)
+{
+	struct buf_chunk *head = buffer.head, *tmp;
+
+	while ((tmp = head->next)) {
+		head->next = tmp->next;
+		free(tmp);
+	}
+
+	buffer.tail = head;
+	buffer.cur = (struct buf_token *)head->data;
+	buffer.cur->len = 0;
+	head->end = buffer.cur->data;
+	buffer.chunks = 1;
+	buffer.tokens = 0;
 }
 
 /* Get current screen width, returns -1 if TIOCGWINSZ fails */
@@ -1253,11 +1625,173 @@ newline:
 	}
 }
 
+/* --stream: fix the widths up front from the headers and the longest value a
+ * column usually takes for the tables shown, so that each socket can be
+ * printed as soon as its line is complete.  Longer values shift the rest of
+ * their line.
+ */
+static void stream_calc_width(struct filter *f)
+{
+	int addr = 0, port = 0;
+	struct column *c;
+
+	if (f->dbs & INET_DBM) {
+		/* "255.255.255.255" or a bracketed IPv6 address */
+		addr = filter_af_get(f, AF_INET6) ? 41 : 15;
+		port = 5;
+	}
+	/* inode numbers and interface names */
+	if (f->dbs & (UNIX_DBM | PACKET_DBM | VSOCK_DBM))
+		port = 10;
+
+	columns[COL_NETID].max_len = 5;
+	columns[COL_STATE].max_len = strlen("FIN-WAIT-1");
+	columns[COL_ADDR].max_len = columns[COL_RADDR].max_len = addr;
+	columns[COL_SERV].max_len = columns[COL_RSERV].max_len = port;
+
+	for (c = columns; c - columns < COL_MAX; c++) {
+		int len = strlen(c->header);
+
+		if (c->max_len < len)
+			c->max_len = len;
+	}
+
+	render_calc_width();
+}
+
+static void user_lazy_mark(const struct sockstat *s)
+{
+	struct user_ref *r;
+
+	if (!s->ino || current_field->disabled)
+		return;
+
+	if (users_by_uid)
+		user_lazy_add_uid(s->uid);
+
+	if (!buffer.head)
+		buffer.head = buf_chunk_new();
+	if (user_lazy.nrefs == user_lazy.refs_size) {
+		user_lazy.refs_size = user_lazy.refs_size ?
+				      user_lazy.refs_size * 2 : 1024;
+		user_lazy.refs = realloc(user_lazy.refs, user_lazy.refs_size *
+					 sizeof(*user_lazy.refs));
+		if (!user_lazy.refs)
+			abort();
+	}
+	r = &user_lazy.refs[user_lazy.nrefs++];
+	r->token = buffer.tokens;
+	r->off = buffer.cur->len;
+	r->ino = s->ino;
+}
+
+/* First ref of token number idx at or after r, NULL if it has none */
+static const struct user_ref *user_lazy_refs(const struct user_ref *r,
+					     unsigned int idx)
+{
+	const struct user_ref *end = user_lazy.refs + user_lazy.nrefs;
+
+	while (r < end && r->token < idx)
+		r++;
+	return r < end && r->token == idx ? r : NULL;
+}
+
+/* Length of a token with the owners from its refs inserted, also
+ * written to fp
+ */
+static int user_lazy_expand(const struct buf_token *t,
+			    const struct user_ref *r, FILE *fp)
+{
+	const struct user_ref *end = user_lazy.refs + user_lazy.nrefs;
+	unsigned int idx = r->token, off = 0;
+	int len = 0;
+
+	for (; r < end && r->token == idx; r++) {
+		/* the token may have been cut short, see buf_update() */
+		unsigned int at = r->off < t->len ? r->off : t->len;
+		int n;
+
+		if (fp)
+			fwrite(t->data + off, 1, at - off, fp);
+		len += at - off;
+		off = at;
+
+		n = user_lazy_format(r->ino);
+		if (!n)
+			user_lazy.misses++;
+		else if (fp)
+			fwrite(user_lazy.users, 1, n, fp);
+		len += n;
+	}
+	if (fp)
+		fwrite(t->data + off, 1, t->len - off, fp);
+	return len + t->len - off;
+}
+
+/* Widen the columns for the expanded refs, count the misses */
+static void user_lazy_measure(void)
+{
+	const struct user_ref *r = user_lazy.refs, *tr;
+	struct buf_chunk *tail = buffer.tail;
+	struct buf_token *token;
+	unsigned int idx = 0;
+	struct column *f;
+
+	for (f = columns; f->disabled; f++)
+		;
+	buffer.tail = buffer.head;
+	token = (struct buf_token *)buffer.head->data;
+	user_lazy.misses = 0;
+	for (; token; idx++) {
+		/* the current token was never flushed, field_flush() would
+		 * not have counted it either
+		 */
+		tr = user_lazy_refs(r, idx);
+		if (tr) {
+			r = tr;
+			if (token != buffer.cur) {
+				int len = user_lazy_expand(token, tr, NULL);
+
+				if (len > f->max_len)
+					f->max_len = len;
+			}
+		}
+
+		do {
+			f = field_is_last(f) ? columns : f + 1;
+		} while (f->disabled);
+		token = buf_token_next(token);
+	}
+	buffer.tail = tail;
+}
+
+/* Called by render(): make sure the index covers the buffered sockets */
+static void user_lazy_resolve(void)
+{
+	/* keep the end alignment render() relies on while walking */
+	int pad = buffer.cur->len % 2;
+
+	buffer.tail->end += pad;
+	if (!user_lazy.built ||
+	    (users_by_uid && user_lazy.nuids != user_lazy.uids_built))
+		user_lazy_build();
+
+	user_lazy_measure();
+	if (user_lazy.misses && follow_events &&
+	    time(NULL) - user_lazy.stamp >= 1) {
+		user_lazy_build();
+		user_lazy_measure();
+	}
+	buffer.tail->end -= pad;
+}
+
 /* Render buffered output with spacing and delimiters, then free up buffers */
 static void render(void)
 {
+	const struct user_ref *r = user_lazy.refs, *tr;
 	struct buf_token *token;
 	int printed, line_started = 0;
+	unsigned int idx = 0;
 	struct column *f;
 
 	if (!buffer.head)
@@ -1265,10 +1799,15 @@ static void render(void)
 
 	token = (struct buf_token *)buffer.head->data;
 
+	if (user_lazy.nrefs)
+		user_lazy_resolve();
+
 	/* Ensure end alignment of last token, it wasn't necessarily flushed */
 	buffer.tail->end += buffer.cur->len % 2;
 
-	render_calc_width();
+	/* Streamed output keeps the widths from stream_calc_width() */
+	if (!stream_output)
+		render_calc_width();
 
 	/* Rewind and replay */
 	buffer.tail = buffer.head;
@@ -1285,8 +1824,16 @@ static void render(void)
 			printed = 0;
 
 		/* Print field content from token data with spacing */
-		printed += print_left_spacing(f, token->len, printed);
-		printed += fwrite(token->data, 1, token->len, stdout);
+		tr = user_lazy.nrefs ? user_lazy_refs(r, idx++) : NULL;
+		if (tr) {
+			r = tr;
+			printed += print_left_spacing(f,
+				user_lazy_expand(token, tr, NULL), printed);
+			printed += user_lazy_expand(token, tr, stdout);
+		} else {
+			printed += print_left_spacing(f, token->len, printed);
+			printed += fwrite(token->data, 1, token->len, stdout);
+		}
 		print_right_spacing(f, printed);
 
 		/* Go to next non-empty field, deal with end-of-line */
@@ -1308,16 +1855,21 @@ static void render(void)
 	if (line_started)
 		printf("\n");
 
-	buf_free_all();
+	if (stream_output)
+		buf_reset();
+	else
+		buf_free_all();
 	current_field = columns;
+	user_lazy.nrefs = 0;
 }
 
 /* Move to next field, and render buffer if we reached the maximum number of
- * chunks, at the last field in a line.
+ * chunks, or on every line when streaming, at the last field in a line.
  */
 static void field_next(void)
 {
-	if (field_is_last(current_field) && buffer.chunks >= BUF_CHUNKS_MAX) {
+	if (field_is_last(current_field) &&
+	    (stream_output || buffer.chunks >= BUF_CHUNKS_MAX)) {
 		render();
 		return;
 	}
@@ -2355,6 +2907,8 @@ static void proc_ctx_print(struct sockstat *s)
 			out(" users:(%s)", buf);
 			free(buf);
 		}
+	} else if (lazy_users) {
+		user_lazy_mark(s);
 	} else if (show_users) {
 		if (find_entry(s->ino, &buf, USERS) > 0) {
 			out(" users:(%s)", buf);
@@ -3391,6 +3945,10 @@ static int tcpdiag_send(int fd, int protocol, struct filter *f)
 		req.r.idiag_ext |= (1<<(INET_DIAG_TCLASS-1));
 	}
 
+	/* the counters --interval and --group-by work on */
+	if (interval_secs || group_by)
+		req.r.idiag_ext |= (1<<(INET_DIAG_INFO-1));
+
 	iov[0] = (struct iovec){
 		.iov_base = &req,
 		.iov_len = sizeof(req)
@@ -3458,6 +4016,10 @@ static int sockdiag_send(int family, int fd, int protocol, struct filter *f)
 		req.r.idiag_ext |= (1<<(INET_DIAG_TCLASS-1));
 	}
 
+	/* the counters --interval and --group-by work on */
+	if (interval_secs || group_by)
+		req.r.idiag_ext |= (1<<(INET_DIAG_INFO-1));
+
 	iov[0] = (struct iovec){
 		.iov_base = &req,
 		.iov_len = sizeof(req)
@@ -3500,51 +4062,1072 @@ static int sockdiag_send(int family, int fd, int protocol, struct filter *f)
 	return 0;
 }
 
-struct inet_diag_arg {
-	struct filter *f;
-	int protocol;
-	struct rtnl_handle *rth;
+/* Concurrent sock_diag dumps (--parallel)
+ *
+ * A planning pass over the usual dump sequence sends every request on its
+ * own NETLINK_SOCK_DIAG socket and starts a thread per dump that receives
+ * the replies into a queue of chunks.  The real pass then replays each
+ * queue, in the usual order, through the usual callbacks, so output and
+ * column widths don't change.  Whatever can't be replayed (the kernel
+ * rejected the request, nothing was prefetched) is dumped serially as
+ * before.
+ */
+#define SOCKDIAG_CHUNK		(64 * 1024)
+#define SOCKDIAG_QUEUE_MAX	64	/* chunks buffered ahead per dump */
+#define SOCKDIAG_RETRY		1
+
+struct sockdiag_chunk {
+	struct sockdiag_chunk	*next;
+	int			len;
+	char			data[SOCKDIAG_CHUNK];
 };
 
-static int kill_inet_sock(struct nlmsghdr *h, void *arg, struct sockstat *s)
+struct sockdiag_dump {
+	struct sockdiag_dump	*next;
+	int			family;
+	int			protocol;
+	struct rtnl_handle	rth;
+	FILE			*fp;	/* TCPDIAG_FILE instead of netlink */
+	pthread_t		thread;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	struct sockdiag_chunk	*head, *tail;
+	int			queued;
+	bool			done;
+	bool			stop;
+	int			error;	/* errno of a receive failure */
+	const char		*errmsg;
+	struct nlmsghdr		held;	/* file header read ahead */
+	bool			has_held;
+};
+
+static struct sockdiag_dump *sockdiag_dumps;
+
+static bool sockdiag_msg_last(const char *buf, int len)
 {
-	struct inet_diag_msg *d = NLMSG_DATA(h);
-	struct inet_diag_arg *diag_arg = arg;
-	struct rtnl_handle *rth = diag_arg->rth;
+	const struct nlmsghdr *h = (const struct nlmsghdr *)buf;
 
-	DIAG_REQUEST(req, struct inet_diag_req_v2 r);
+	for (; NLMSG_OK(h, len); h = NLMSG_NEXT(h, len))
+		if (h->nlmsg_type == NLMSG_DONE ||
+		    h->nlmsg_type == NLMSG_ERROR)
+			return true;
+	return false;
+}
 
-	req.nlh.nlmsg_type = SOCK_DESTROY;
-	req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
-	req.nlh.nlmsg_seq = ++rth->seq;
-	req.r.sdiag_family = d->idiag_family;
-	req.r.sdiag_protocol = diag_arg->protocol;
-	req.r.id = d->id;
+/* Fill a chunk with whole messages from the TCPDIAG_FILE */
+static int sockdiag_file_read(struct sockdiag_dump *d, char *buf)
+{
+	int len = 0;
 
-	if (diag_arg->protocol == IPPROTO_RAW) {
-		struct inet_diag_req_raw *raw = (void *)&req.r;
+	while (1) {
+		struct nlmsghdr *h = (struct nlmsghdr *)(buf + len);
+		size_t size;
+
+		if (d->has_held) {
+			*h = d->held;
+			d->has_held = false;
+		} else if (fread(h, 1, sizeof(*h), d->fp) != sizeof(*h)) {
+			d->errmsg = "Reading header from $TCPDIAG_FILE";
+			break;
+		}
 
-		BUILD_BUG_ON(sizeof(req.r) != sizeof(*raw));
-		raw->sdiag_raw_protocol = s->raw_prot;
+		size = NLMSG_ALIGN(h->nlmsg_len);
+		if (size < sizeof(*h) || size > SOCKDIAG_CHUNK) {
+			d->errmsg = "Reading $TCPDIAG_FILE";
+			d->error = EMSGSIZE;
+			return len;
+		}
+		if (len + size > SOCKDIAG_CHUNK) {
+			d->held = *h;
+			d->has_held = true;
+			return len;
+		}
+		if (fread(h + 1, 1, size - sizeof(*h), d->fp) !=
+		    size - sizeof(*h)) {
+			d->errmsg = "Reading $TCPDIAG_FILE";
+			break;
+		}
+
+		len += size;
+		if (h->nlmsg_type == NLMSG_DONE ||
+		    h->nlmsg_type == NLMSG_ERROR ||
+		    len + sizeof(*h) > SOCKDIAG_CHUNK)
+			return len;
 	}
 
-	return rtnl_talk(rth, &req.nlh, NULL);
+	/* no error with an errmsg is a premature end of file */
+	if (ferror(d->fp))
+		d->error = errno;
+	return len;
 }
 
-static int show_one_inet_sock(struct nlmsghdr *h, void *arg)
+static int sockdiag_recv(struct sockdiag_dump *d, char *buf)
 {
-	int err;
-	struct inet_diag_arg *diag_arg = arg;
-	struct inet_diag_msg *r = NLMSG_DATA(h);
-	struct sockstat s = {};
-
-	if (!(diag_arg->f->families & FAMILY_MASK(r->idiag_family)))
-		return 0;
+	struct iovec iov = { .iov_base = buf, .iov_len = SOCKDIAG_CHUNK };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	int len;
 
-	parse_diag_msg(h, &s);
-	s.type = diag_arg->protocol;
+	do {
+		len = recvmsg(d->rth.fd, &msg, 0);
+	} while (len < 0 && errno == EINTR);
 
-	if (diag_arg->f->f && run_ssfilter(diag_arg->f->f, &s) == 0)
+	if (len <= 0) {
+		d->error = len ? errno : ENODATA;
+		return 0;
+	}
+	if (msg.msg_flags & MSG_TRUNC) {
+		d->error = EMSGSIZE;
+		return 0;
+	}
+	return len;
+}
+
+static void *sockdiag_thread(void *arg)
+{
+	struct sockdiag_dump *d = arg;
+	bool last = false;
+
+	while (!last) {
+		struct sockdiag_chunk *c = malloc(sizeof(*c));
+
+		if (!c) {
+			d->error = ENOMEM;
+			break;
+		}
+		c->next = NULL;
+		c->len = d->fp ? sockdiag_file_read(d, c->data) :
+				 sockdiag_recv(d, c->data);
+		last = d->error || d->errmsg ||
+		       sockdiag_msg_last(c->data, c->len);
+
+		pthread_mutex_lock(&d->lock);
+		while (d->queued >= SOCKDIAG_QUEUE_MAX && !d->stop)
+			pthread_cond_wait(&d->cond, &d->lock);
+		if (d->stop) {
+			pthread_mutex_unlock(&d->lock);
+			free(c);
+			break;
+		}
+		if (d->tail)
+			d->tail->next = c;
+		else
+			d->head = c;
+		d->tail = c;
+		d->queued++;
+		pthread_cond_broadcast(&d->cond);
+		pthread_mutex_unlock(&d->lock);
+	}
+
+	pthread_mutex_lock(&d->lock);
+	d->done = true;
+	pthread_cond_broadcast(&d->cond);
+	pthread_mutex_unlock(&d->lock);
+	return NULL;
+}
+
+/* Planning pass: start a dump of REQ, or of the inet sockets of
+ * FAMILY/PROTOCOL if REQ is NULL, or of the TCPDIAG_FILE if FP is set.
+ */
+static int sockdiag_prefetch(int family, int protocol, struct filter *f,
+			     struct nlmsghdr *req, size_t size, FILE *fp)
+{
+	struct sockdiag_dump *d, **pos;
+
+	d = calloc(1, sizeof(*d));
+	if (!d)
+		return 0;
+
+	d->family = family;
+	d->protocol = protocol;
+	d->rth.fd = -1;
+	d->fp = fp;
+	if (!fp) {
+		if (rtnl_open_byproto(&d->rth, 0, NETLINK_SOCK_DIAG))
+			goto err;
+		if (req ? rtnl_send(&d->rth, req, size) < 0 :
+			  sockdiag_send(family, d->rth.fd, protocol, f)) {
+			/* sockdiag_send() closes the socket on failure */
+			if (!req)
+				d->rth.fd = -1;
+			goto err;
+		}
+	}
+
+	pthread_mutex_init(&d->lock, NULL);
+	pthread_cond_init(&d->cond, NULL);
+	if (pthread_create(&d->thread, NULL, sockdiag_thread, d))
+		goto err;
+
+	for (pos = &sockdiag_dumps; *pos; pos = &(*pos)->next)
+		;
+	*pos = d;
+	return 0;
+
+err:
+	/* not fatal, the real pass will dump serially */
+	if (d->rth.fd >= 0)
+		rtnl_close(&d->rth);
+	if (fp)
+		fclose(fp);
+	free(d);
+	return 0;
+}
+
+static void sockdiag_dump_free(struct sockdiag_dump *d)
+{
+	struct sockdiag_chunk *c;
+
+	pthread_mutex_lock(&d->lock);
+	d->stop = true;
+	pthread_cond_broadcast(&d->cond);
+	pthread_mutex_unlock(&d->lock);
+	pthread_join(d->thread, NULL);
+
+	while ((c = d->head)) {
+		d->head = c->next;
+		free(c);
+	}
+	if (d->fp)
+		fclose(d->fp);
+	else
+		rtnl_close(&d->rth);
+	pthread_mutex_destroy(&d->lock);
+	pthread_cond_destroy(&d->cond);
+	free(d);
+}
+
+static void sockdiag_dumps_free(void)
+{
+	struct sockdiag_dump *d;
+
+	while ((d = sockdiag_dumps)) {
+		sockdiag_dumps = d->next;
+		sockdiag_dump_free(d);
+	}
+}
+
+/* Unlink the prefetched dump for FAMILY/PROTOCOL, if any */
+static struct sockdiag_dump *sockdiag_take(int family, int protocol)
+{
+	struct sockdiag_dump *d, **pos;
+
+	for (pos = &sockdiag_dumps; (d = *pos); pos = &d->next) {
+		if (d->family == family && d->protocol == protocol) {
+			*pos = d->next;
+			return d;
+		}
+	}
+	return NULL;
+}
+
+static struct sockdiag_chunk *sockdiag_pop(struct sockdiag_dump *d)
+{
+	struct sockdiag_chunk *c;
+
+	pthread_mutex_lock(&d->lock);
+	while (!d->head && !d->done)
+		pthread_cond_wait(&d->cond, &d->lock);
+	c = d->head;
+	if (c) {
+		d->head = c->next;
+		if (!d->head)
+			d->tail = NULL;
+		d->queued--;
+		pthread_cond_broadcast(&d->cond);
+	}
+	pthread_mutex_unlock(&d->lock);
+	return c;
+}
+
+/* Feed a prefetched dump to FILTER, like rtnl_dump_filter() would.  Return
+ * SOCKDIAG_RETRY if the dump failed before anything was delivered, the
+ * caller then repeats it serially and reports errors the usual way.
+ */
+static int sockdiag_replay(struct sockdiag_dump *d, rtnl_filter_t filter,
+			   void *arg)
+{
+	struct sockdiag_chunk *c;
+	bool delivered = false, intr = false, found_done = false;
+	int err = 0;
+
+	while (!found_done && !err && (c = sockdiag_pop(d))) {
+		struct nlmsghdr *h = (struct nlmsghdr *)c->data;
+		int len = c->len;
+
+		for (; NLMSG_OK(h, len); h = NLMSG_NEXT(h, len)) {
+			int error = 0;
+
+			if (!d->fp && h->nlmsg_seq != MAGIC_SEQ)
+				continue;
+
+			if (h->nlmsg_flags & NLM_F_DUMP_INTR)
+				intr = true;
+
+			if (h->nlmsg_type == NLMSG_DONE) {
+				if (!d->fp &&
+				    h->nlmsg_len >= NLMSG_LENGTH(sizeof(int)))
+					error = *(int *)NLMSG_DATA(h);
+				found_done = true;
+			} else if (h->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *e = NLMSG_DATA(h);
+
+				error = h->nlmsg_len <
+					NLMSG_LENGTH(sizeof(*e)) ?
+					-EBADMSG : e->error;
+				found_done = true;
+				if (!error)
+					error = -EBADMSG;
+			} else {
+				err = filter(h, arg);
+				delivered = true;
+				if (err < 0)
+					break;
+				err = 0;
+				continue;
+			}
+
+			if (error < 0) {
+				if (!delivered) {
+					err = SOCKDIAG_RETRY;
+				} else {
+					errno = -error;
+					perror("RTNETLINK answers");
+					err = -1;
+				}
+			}
+			break;
+		}
+		free(c);
+	}
+
+	if (!found_done && !err) {
+		if (!delivered) {
+			err = SOCKDIAG_RETRY;
+		} else if (d->errmsg) {
+			errno = d->error;
+			if (errno)
+				perror(d->errmsg);
+			else
+				fprintf(stderr,
+					"Unexpected EOF reading $TCPDIAG_FILE");
+			err = -1;
+		} else {
+			fprintf(stderr, "netlink receive error %s (%d)\n",
+				strerror(d->error), d->error);
+			err = -1;
+		}
+	}
+	if (intr && !err)
+		fprintf(stderr,
+			"Dump was interrupted and may be inconsistent.\n");
+
+	sockdiag_dump_free(d);
+	return err;
+}
+
+struct inet_diag_arg {
+	struct filter *f;
+	int protocol;
+	struct rtnl_handle *rth;
+};
+
+static int kill_inet_sock(struct nlmsghdr *h, void *arg, struct sockstat *s)
+{
+	struct inet_diag_msg *d = NLMSG_DATA(h);
+	struct inet_diag_arg *diag_arg = arg;
+	struct rtnl_handle *rth = diag_arg->rth;
+
+	DIAG_REQUEST(req, struct inet_diag_req_v2 r);
+
+	req.nlh.nlmsg_type = SOCK_DESTROY;
+	req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	req.nlh.nlmsg_seq = ++rth->seq;
+	req.r.sdiag_family = d->idiag_family;
+	req.r.sdiag_protocol = diag_arg->protocol;
+	req.r.id = d->id;
+
+	if (diag_arg->protocol == IPPROTO_RAW) {
+		struct inet_diag_req_raw *raw = (void *)&req.r;
+
+		BUILD_BUG_ON(sizeof(req.r) != sizeof(*raw));
+		raw->sdiag_raw_protocol = s->raw_prot;
+	}
+
+	return rtnl_talk(rth, &req.nlh, NULL);
+}
+
+/* --interval: per socket deltas between two dumps
+ *
+ * Every round remembers the counters of each TCP socket, keyed by its
+ * sock_diag cookie, and prints what changed since the previous round.
+ * Sockets missing from a round are forgotten and at most IVL_MAX_SOCKS are
+ * tracked, so memory follows the live sockets.  With --top K only the K
+ * busiest sockets of a round are kept, in a min heap, and printed sorted
+ * once the round is complete.
+ */
+#define IVL_MAX_SOCKS	(1 << 20)
+
+enum {
+	TOP_BY_THROUGHPUT,
+	TOP_BY_RETRANS,
+	TOP_BY_SOCKETS,
+	TOP_BY_BYTES,
+};
+
+/* the tcpstat counters a delta is taken of */
+struct ivl_sock {
+	struct ivl_sock		*next;
+	unsigned long long	cookie;
+	unsigned int		round;	/* last seen in, 0 if new */
+	unsigned long long	bytes_acked;
+	unsigned long long	bytes_received;
+	unsigned long long	bytes_retrans;
+	unsigned int		retrans_total;
+	double			rtt;
+};
+
+struct ivl_delta {
+	double			tx_bps;
+	double			rx_bps;
+	unsigned long long	bytes_retrans;
+	unsigned int		retrans;
+	double			rtt;
+	double			rtt_delta;
+};
+
+struct ivl_top {
+	struct ivl_delta	d;
+	struct nlmsghdr		*h;	/* copy of the socket's message */
+	int			protocol;
+};
+
+static struct {
+	struct ivl_sock		**hash;
+	unsigned int		hash_size;
+	unsigned int		count;
+	unsigned int		round;
+	double			elapsed;	/* since the previous round */
+	bool			full;
+	struct ivl_top		*top;
+	unsigned int		ntop;
+} ivl;
+
+static unsigned int ivl_hashfn(unsigned long long cookie)
+{
+	return (unsigned int)((cookie * 0x9e3779b97f4a7c15ULL) >> 32) &
+	       (ivl.hash_size - 1);
+}
+
+static void ivl_grow(void)
+{
+	unsigned int i, old_size = ivl.hash_size;
+	struct ivl_sock **old = ivl.hash;
+
+	ivl.hash_size = old_size ? old_size * 2 : 1024;
+	ivl.hash = calloc(ivl.hash_size, sizeof(*ivl.hash));
+	if (!ivl.hash) {
+		fprintf(stderr, "ss: failed to malloc buffer\n");
+		abort();
+	}
+
+	for (i = 0; i < old_size; i++) {
+		struct ivl_sock *e, *next;
+
+		for (e = old[i]; e; e = next) {
+			unsigned int h = ivl_hashfn(e->cookie);
+
+			next = e->next;
+			e->next = ivl.hash[h];
+			ivl.hash[h] = e;
+		}
+	}
+	free(old);
+}
+
+static struct ivl_sock *ivl_get(unsigned long long cookie)
+{
+	struct ivl_sock *e;
+	unsigned int h;
+
+	if (ivl.hash_size) {
+		for (e = ivl.hash[ivl_hashfn(cookie)]; e; e = e->next)
+			if (e->cookie == cookie)
+				return e;
+	}
+
+	if (ivl.count >= IVL_MAX_SOCKS) {
+		if (!ivl.full)
+			fprintf(stderr, "ss: tracking only %u sockets\n",
+				IVL_MAX_SOCKS);
+		ivl.full = true;
+		return NULL;
+	}
+	if (ivl.count >= ivl.hash_size)
+		ivl_grow();
+
+	e = calloc(1, sizeof(*e));
+	if (!e) {
+		fprintf(stderr, "ss: failed to malloc buffer\n");
+		abort();
+	}
+	e->cookie = cookie;
+	h = ivl_hashfn(cookie);
+	e->next = ivl.hash[h];
+	ivl.hash[h] = e;
+	ivl.count++;
+	return e;
+}
+
+/* Forget the sockets that were not in this round */
+static void ivl_sweep(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < ivl.hash_size; i++) {
+		struct ivl_sock **pos = &ivl.hash[i], *e;
+
+		while ((e = *pos)) {
+			if (e->round == ivl.round) {
+				pos = &e->next;
+				continue;
+			}
+			*pos = e->next;
+			free(e);
+			ivl.count--;
+		}
+	}
+}
+
+static int ivl_cmp(const struct ivl_delta *a, const struct ivl_delta *b)
+{
+	double x = a->tx_bps + a->rx_bps, y = b->tx_bps + b->rx_bps;
+
+	if (top_by == TOP_BY_RETRANS && a->retrans != b->retrans)
+		return a->retrans < b->retrans ? -1 : 1;
+	if (top_by == TOP_BY_RETRANS && a->bytes_retrans != b->bytes_retrans)
+		return a->bytes_retrans < b->bytes_retrans ? -1 : 1;
+	return x < y ? -1 : x > y;
+}
+
+static void ivl_top_swap(unsigned int i, unsigned int j)
+{
+	struct ivl_top tmp = ivl.top[i];
+
+	ivl.top[i] = ivl.top[j];
+	ivl.top[j] = tmp;
+}
+
+/* Keep the K busiest sockets, the least busy one at the root */
+static void ivl_top_push(const struct nlmsghdr *h, int protocol,
+			 const struct ivl_delta *d)
+{
+	unsigned int i = ivl.ntop;
+
+	if (!ivl.top) {
+		ivl.top = calloc(top_k, sizeof(*ivl.top));
+		if (!ivl.top) {
+			fprintf(stderr, "ss: failed to malloc buffer\n");
+			abort();
+		}
+	}
+
+	if (ivl.ntop == top_k) {
+		if (ivl_cmp(d, &ivl.top[0].d) <= 0)
+			return;
+		free(ivl.top[0].h);
+		ivl.top[0] = ivl.top[--ivl.ntop];
+
+		/* sift the last entry down from the root */
+		for (i = 0; ; ) {
+			unsigned int l = 2 * i + 1, r = l + 1, min = i;
+
+			if (l < ivl.ntop &&
+			    ivl_cmp(&ivl.top[l].d, &ivl.top[min].d) < 0)
+				min = l;
+			if (r < ivl.ntop &&
+			    ivl_cmp(&ivl.top[r].d, &ivl.top[min].d) < 0)
+				min = r;
+			if (min == i)
+				break;
+			ivl_top_swap(i, min);
+			i = min;
+		}
+		i = ivl.ntop;
+	}
+
+	ivl.top[i].d = *d;
+	ivl.top[i].protocol = protocol;
+	ivl.top[i].h = malloc(h->nlmsg_len);
+	if (!ivl.top[i].h) {
+		fprintf(stderr, "ss: failed to malloc buffer\n");
+		abort();
+	}
+	memcpy(ivl.top[i].h, h, h->nlmsg_len);
+	ivl.ntop++;
+
+	while (i && ivl_cmp(&ivl.top[i].d, &ivl.top[(i - 1) / 2].d) < 0) {
+		ivl_top_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static int ivl_top_cmp(const void *a, const void *b)
+{
+	/* busiest first */
+	return ivl_cmp(&((const struct ivl_top *)b)->d,
+		       &((const struct ivl_top *)a)->d);
+}
+
+static void ivl_delta_print(const struct ivl_delta *d)
+{
+	char b1[64];
+
+	out(" tx %sbps", sprint_bw(b1, d->tx_bps));
+	out(" rx %sbps", sprint_bw(b1, d->rx_bps));
+	out(" retrans:+%u", d->retrans);
+	if (d->bytes_retrans)
+		out(" bytes_retrans:+%llu", d->bytes_retrans);
+	out(" rtt:%g(%+g)", d->rtt, d->rtt_delta);
+}
+
+/* Called instead of inet_show_sock() with --interval */
+static int ivl_show_sock(struct nlmsghdr *h, struct sockstat *s,
+			 int protocol)
+{
+	struct inet_diag_msg *r = NLMSG_DATA(h);
+	struct rtattr *tb[INET_DIAG_MAX + 1];
+	struct tcp_info info = {};
+	struct ivl_delta d = {};
+	struct ivl_sock *e;
+	bool seen;
+	int err;
+
+	parse_rtattr(tb, INET_DIAG_MAX, (struct rtattr *)(r + 1),
+		     h->nlmsg_len - NLMSG_LENGTH(sizeof(*r)));
+	if (!tb[INET_DIAG_INFO])
+		return 0;
+
+	/* older kernels have less fields */
+	memcpy(&info, RTA_DATA(tb[INET_DIAG_INFO]),
+	       min(RTA_PAYLOAD(tb[INET_DIAG_INFO]), sizeof(info)));
+
+	e = ivl_get(s->sk);
+	if (!e)
+		return 0;
+
+	seen = e->round;
+	if (seen && ivl.elapsed > 0) {
+		if (info.tcpi_bytes_acked > e->bytes_acked)
+			d.tx_bps = (info.tcpi_bytes_acked - e->bytes_acked) *
+				   8. / ivl.elapsed;
+		if (info.tcpi_bytes_received > e->bytes_received)
+			d.rx_bps = (info.tcpi_bytes_received -
+				    e->bytes_received) * 8. / ivl.elapsed;
+		if (info.tcpi_bytes_retrans > e->bytes_retrans)
+			d.bytes_retrans = info.tcpi_bytes_retrans -
+					  e->bytes_retrans;
+		if (info.tcpi_total_retrans > e->retrans_total)
+			d.retrans = info.tcpi_total_retrans - e->retrans_total;
+	}
+	d.rtt = (double)info.tcpi_rtt / 1000;
+	d.rtt_delta = seen ? d.rtt - e->rtt : 0;
+
+	e->bytes_acked = info.tcpi_bytes_acked;
+	e->bytes_received = info.tcpi_bytes_received;
+	e->bytes_retrans = info.tcpi_bytes_retrans;
+	e->retrans_total = info.tcpi_total_retrans;
+	e->rtt = d.rtt;
+	e->round = ivl.round;
+
+	/* the first round only takes the baseline */
+	if (!seen)
+		return 0;
+
+	if (top_k) {
+		ivl_top_push(h, protocol, &d);
+		return 0;
+	}
+
+	err = inet_show_sock(h, s);
+	ivl_delta_print(&d);
+	return err;
+}
+
+/* Print the --top sockets of the round */
+static void ivl_top_flush(void)
+{
+	unsigned int i;
+
+	qsort(ivl.top, ivl.ntop, sizeof(*ivl.top), ivl_top_cmp);
+	for (i = 0; i < ivl.ntop; i++) {
+		struct sockstat s = {};
+
+		parse_diag_msg(ivl.top[i].h, &s);
+		s.type = ivl.top[i].protocol;
+		inet_show_sock(ivl.top[i].h, &s);
+		ivl_delta_print(&ivl.top[i].d);
+		free(ivl.top[i].h);
+	}
+	ivl.ntop = 0;
+}
+
+/* --group-by: aggregate sockets instead of listing them
+ *
+ * show_one_inet_sock() folds each matching socket into the group of its
+ * key and only the groups are printed, as one table at the end.  Groups
+ * keep sums and a log-linear rtt histogram (8 buckets per power of two,
+ * so quantiles are within 12.5%), never the sockets themselves.  Past
+ * AGG_MAX_GROUPS distinct keys, sockets go to an "(other)" group.
+ */
+#define AGG_HASH_SIZE		4096
+#define AGG_MAX_GROUPS		16384
+#define AGG_RTT_BUCKETS		240
+
+enum {
+	AGG_BY_NONE,
+	AGG_BY_DST,
+	AGG_BY_SPORT,
+	AGG_BY_DPORT,
+	AGG_BY_CGROUP,
+	AGG_BY_MARK,
+	AGG_BY_PROCESS,
+};
+
+struct agg_key {
+	__u8		family;		/* 0 for the "(other)" group */
+	__u8		prefixlen;
+	__u16		port;
+	__u32		mark;
+	__u64		cgroup_id;
+	__u8		addr[16];
+	char		comm[16];
+};
+
+struct agg_group {
+	struct agg_group	*next;
+	struct agg_key		key;
+	unsigned int		sockets;
+	unsigned long long	rq;
+	unsigned long long	wq;
+	unsigned long long	bytes_acked;
+	unsigned long long	bytes_received;
+	unsigned long long	retrans;
+	unsigned int		rtt_samples;
+	unsigned int		rtt_hist[AGG_RTT_BUCKETS];
+};
+
+static struct {
+	struct agg_group	*hash[AGG_HASH_SIZE];
+	struct agg_group	*other;
+	unsigned int		count;
+} agg;
+
+static unsigned int agg_hashfn(const struct agg_key *k)
+{
+	const unsigned char *p = (const unsigned char *)k;
+	unsigned int h = 2166136261u, i;
+
+	for (i = 0; i < sizeof(*k); i++)
+		h = (h ^ p[i]) * 16777619u;
+	return h & (AGG_HASH_SIZE - 1);
+}
+
+static struct agg_group *agg_get(const struct agg_key *k)
+{
+	struct agg_group *g, **head = &agg.hash[agg_hashfn(k)];
+
+	for (g = *head; g; g = g->next)
+		if (!memcmp(&g->key, k, sizeof(*k)))
+			return g;
+
+	if (agg.count >= AGG_MAX_GROUPS) {
+		if (!agg.other) {
+			agg.other = calloc(1, sizeof(*agg.other));
+			if (!agg.other)
+				abort();
+		}
+		return agg.other;
+	}
+
+	g = calloc(1, sizeof(*g));
+	if (!g) {
+		fprintf(stderr, "ss: failed to malloc buffer\n");
+		abort();
+	}
+	g->key = *k;
+	g->next = *head;
+	*head = g;
+	agg.count++;
+	return g;
+}
+
+static unsigned int agg_rtt_bucket(__u32 us)
+{
+	unsigned int e;
+
+	if (us < 8)
+		return us;
+	e = 31 - __builtin_clz(us);
+	return 8 + (e - 3) * 8 + ((us >> (e - 3)) & 7);
+}
+
+/* Middle of a histogram bucket, in ms like the rest of ss */
+static double agg_rtt_value(unsigned int b)
+{
+	double lo, width;
+
+	if (b < 8)
+		return b / 1000.;
+	width = (double)(1ULL << ((b - 8) / 8));
+	lo = (8 + (b - 8) % 8) * width;
+	return (lo + width / 2) / 1000.;
+}
+
+static double agg_rtt_quantile(const struct agg_group *g, double q)
+{
+	unsigned int b, seen = 0, want;
+
+	if (!g->rtt_samples)
+		return 0;
+
+	want = q * g->rtt_samples;
+	if (want < 1)
+		want = 1;
+	for (b = 0; b < AGG_RTT_BUCKETS; b++) {
+		seen += g->rtt_hist[b];
+		if (seen >= want)
+			break;
+	}
+	return agg_rtt_value(b);
+}
+
+/* Called instead of inet_show_sock() with --group-by */
+static int agg_sock(struct nlmsghdr *h, struct sockstat *s)
+{
+	struct inet_diag_msg *r = NLMSG_DATA(h);
+	struct rtattr *tb[INET_DIAG_MAX + 1];
+	struct agg_key k = {};
+	struct agg_group *g;
+	struct user_fd *u;
+	unsigned int i;
+
+	k.family = s->local.family;
+	switch (group_by) {
+	case AGG_BY_DST:
+		k.prefixlen = min(group_prefixlen,
+				  (unsigned int)s->remote.bytelen * 8);
+		memcpy(k.addr, s->remote.data, s->remote.bytelen);
+		for (i = 0; i < sizeof(k.addr); i++) {
+			if (i * 8 >= k.prefixlen)
+				k.addr[i] = 0;
+			else if (i * 8 + 8 > k.prefixlen)
+				k.addr[i] &= 0xff << (8 - k.prefixlen % 8);
+		}
+		break;
+	case AGG_BY_SPORT:
+		k.family = 1;
+		k.port = s->lport;
+		break;
+	case AGG_BY_DPORT:
+		k.family = 1;
+		k.port = s->rport;
+		break;
+	case AGG_BY_CGROUP:
+		k.family = 1;
+		k.cgroup_id = s->cgroup_id;
+		break;
+	case AGG_BY_MARK:
+		k.family = 1;
+		k.mark = s->mark;
+		break;
+	case AGG_BY_PROCESS:
+		k.family = 1;
+		if (!user_lazy.built)
+			user_lazy_build();
+		u = user_lazy_find(s->ino);
+		strncpy(k.comm, u ? user_proc_name(u->pid) : "-",
+			sizeof(k.comm) - 1);
+		break;
+	}
+
+	g = agg_get(&k);
+	g->sockets++;
+	g->rq += s->rq;
+	g->wq += s->wq;
+
+	parse_rtattr(tb, INET_DIAG_MAX, (struct rtattr *)(r + 1),
+		     h->nlmsg_len - NLMSG_LENGTH(sizeof(*r)));
+	if (s->type == IPPROTO_TCP && tb[INET_DIAG_INFO]) {
+		struct tcp_info info = {};
+
+		/* older kernels have less fields */
+		memcpy(&info, RTA_DATA(tb[INET_DIAG_INFO]),
+		       min(RTA_PAYLOAD(tb[INET_DIAG_INFO]), sizeof(info)));
+		g->bytes_acked += info.tcpi_bytes_acked;
+		g->bytes_received += info.tcpi_bytes_received;
+		g->retrans += info.tcpi_total_retrans;
+		if (info.tcpi_rtt) {
+			g->rtt_hist[agg_rtt_bucket(info.tcpi_rtt)]++;
+			g->rtt_samples++;
+		}
+	}
+
+	return 0;
+}
+
+static int agg_cmp(const void *a, const void *b)
+{
+	const struct agg_group *x = *(const struct agg_group **)a;
+	const struct agg_group *y = *(const struct agg_group **)b;
+	unsigned long long vx, vy;
+
+	switch (top_by) {
+	case TOP_BY_BYTES:
+		vx = x->bytes_acked + x->bytes_received;
+		vy = y->bytes_acked + y->bytes_received;
+		break;
+	case TOP_BY_RETRANS:
+		vx = x->retrans;
+		vy = y->retrans;
+		break;
+	default:
+		vx = x->sockets;
+		vy = y->sockets;
+		break;
+	}
+
+	/* largest first, then the busiest */
+	if (vx != vy)
+		return vx < vy ? 1 : -1;
+	if (x->sockets != y->sockets)
+		return x->sockets < y->sockets ? 1 : -1;
+	return memcmp(&x->key, &y->key, sizeof(x->key));
+}
+
+static void agg_key_print(const struct agg_group *g, char *buf, size_t len)
+{
+	const struct agg_key *k = &g->key;
+	char addr[INET6_ADDRSTRLEN];
+
+	if (!k->family) {
+		snprintf(buf, len, "(other)");
+		return;
+	}
+
+	switch (group_by) {
+	case AGG_BY_DST:
+		inet_ntop(k->family, k->addr, addr, sizeof(addr));
+		snprintf(buf, len, "%s/%u", addr, k->prefixlen);
+		break;
+	case AGG_BY_SPORT:
+	case AGG_BY_DPORT:
+		snprintf(buf, len, "%u", k->port);
+		break;
+	case AGG_BY_CGROUP:
+		snprintf(buf, len, "%s", k->cgroup_id ?
+			 cg_id_to_path(k->cgroup_id) : "-");
+		break;
+	case AGG_BY_MARK:
+		snprintf(buf, len, "0x%x", k->mark);
+		break;
+	case AGG_BY_PROCESS:
+		snprintf(buf, len, "%s", k->comm);
+		break;
+	}
+}
+
+#define AGG_COLS	10
+
+static void agg_print(void)
+{
+	static const char * const keys[] = {
+		[AGG_BY_DST]	 = "Peer-Prefix",
+		[AGG_BY_SPORT]	 = "Local-Port",
+		[AGG_BY_DPORT]	 = "Peer-Port",
+		[AGG_BY_CGROUP]	 = "Cgroup",
+		[AGG_BY_MARK]	 = "Mark",
+		[AGG_BY_PROCESS] = "Process",
+	};
+	const char *hdr[AGG_COLS] = {
+		keys[group_by], "Sockets", "Recv-Q", "Send-Q", "Bytes-Acked",
+		"Bytes-Received", "Retrans", "RTT-p50", "RTT-p90", "RTT-p99",
+	};
+	struct agg_group **rows, *g;
+	unsigned int i, j, n = 0;
+	char (*cells)[AGG_COLS][64];
+	size_t width[AGG_COLS];
+
+	rows = malloc((agg.count + 1) * sizeof(*rows));
+	if (!rows)
+		return;
+	for (i = 0; i < AGG_HASH_SIZE; i++)
+		for (g = agg.hash[i]; g; g = g->next)
+			rows[n++] = g;
+	qsort(rows, n, sizeof(*rows), agg_cmp);
+	if (top_k && n > top_k)
+		n = top_k;
+	/* whatever did not fit goes last */
+	if (agg.other)
+		rows[n++] = agg.other;
+
+	cells = calloc(n ? n : 1, sizeof(*cells));
+	if (!cells) {
+		free(rows);
+		return;
+	}
+
+	for (j = 0; j < AGG_COLS; j++)
+		width[j] = show_header ? strlen(hdr[j]) : 0;
+
+	for (i = 0; i < n; i++) {
+		g = rows[i];
+		agg_key_print(g, cells[i][0], sizeof(cells[i][0]));
+		snprintf(cells[i][1], 64, "%u", g->sockets);
+		snprintf(cells[i][2], 64, "%llu", g->rq);
+		snprintf(cells[i][3], 64, "%llu", g->wq);
+		snprintf(cells[i][4], 64, "%llu", g->bytes_acked);
+		snprintf(cells[i][5], 64, "%llu", g->bytes_received);
+		snprintf(cells[i][6], 64, "%llu", g->retrans);
+		snprintf(cells[i][7], 64, "%.3f", agg_rtt_quantile(g, 0.5));
+		snprintf(cells[i][8], 64, "%.3f", agg_rtt_quantile(g, 0.9));
+		snprintf(cells[i][9], 64, "%.3f", agg_rtt_quantile(g, 0.99));
+
+		for (j = 0; j < AGG_COLS; j++)
+			if (strlen(cells[i][j]) > width[j])
+				width[j] = strlen(cells[i][j]);
+	}
+
+	/* key left aligned, numbers right aligned */
+	if (show_header) {
+		for (j = 0; j < AGG_COLS; j++)
+			printf(j ? " %*s" : "%-*s", (int)width[j], hdr[j]);
+		printf("\n");
+	}
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < AGG_COLS; j++)
+			printf(j ? " %*s" : "%-*s", (int)width[j],
+			       cells[i][j]);
+		printf("\n");
+	}
+
+	free(cells);
+	free(rows);
+}
+
+static int show_one_inet_sock(struct nlmsghdr *h, void *arg)
+{
+	int err;
+	struct inet_diag_arg *diag_arg = arg;
+	struct inet_diag_msg *r = NLMSG_DATA(h);
+	struct sockstat s = {};
+
+	if (!(diag_arg->f->families & FAMILY_MASK(r->idiag_family)))
+		return 0;
+
+	parse_diag_msg(h, &s);
+	s.type = diag_arg->protocol;
+
+	if (diag_arg->f->f && run_ssfilter(diag_arg->f->f, &s) == 0)
 		return 0;
 
 	if (diag_arg->f->kill && kill_inet_sock(h, arg, &s) != 0) {
@@ -3557,6 +5140,11 @@ static int show_one_inet_sock(struct nlmsghdr *h, void *arg)
 		}
 	}
 
+	if (interval_secs)
+		return ivl_show_sock(h, &s, diag_arg->protocol);
+	if (group_by)
+		return agg_sock(h, &s);
+
 	err = inet_show_sock(h, &s);
 	if (err < 0)
 		return err;
@@ -3570,6 +5158,15 @@ static int inet_show_netlink(struct filter *f, FILE *dump_fp, int protocol)
 	struct rtnl_handle rth, rth2;
 	int family = PF_INET;
 	struct inet_diag_arg arg = { .f = f, .protocol = protocol };
+	struct sockdiag_dump *d;
+
+	if (sockdiag_planning) {
+		if (preferred_family != PF_INET6)
+			sockdiag_prefetch(PF_INET, protocol, f, NULL, 0, NULL);
+		if (preferred_family != PF_INET)
+			sockdiag_prefetch(PF_INET6, protocol, f, NULL, 0, NULL);
+		return 0;
+	}
 
 	if (rtnl_open_byproto(&rth, 0, NETLINK_SOCK_DIAG))
 		return -1;
@@ -3588,10 +5185,15 @@ static int inet_show_netlink(struct filter *f, FILE *dump_fp, int protocol)
 		family = PF_INET6;
 
 again:
-	if ((err = sockdiag_send(family, rth.fd, protocol, f)))
-		goto Exit;
+	d = sockdiag_take(family, protocol);
+	err = d ? sockdiag_replay(d, show_one_inet_sock, &arg) : SOCKDIAG_RETRY;
+	if (err == SOCKDIAG_RETRY) {
+		if ((err = sockdiag_send(family, rth.fd, protocol, f)))
+			goto Exit;
+		err = rtnl_dump_filter(&rth, show_one_inet_sock, &arg);
+	}
 
-	if ((err = rtnl_dump_filter(&rth, show_one_inet_sock, &arg))) {
+	if (err) {
 		if (family != PF_UNSPEC) {
 			family = PF_UNSPEC;
 			goto again;
@@ -3610,11 +5212,47 @@ Exit:
 	return err;
 }
 
+static int show_one_file_sock(struct nlmsghdr *h, void *arg)
+{
+	struct filter *f = arg;
+	struct sockstat s = {};
+
+	parse_diag_msg(h, &s);
+	s.type = IPPROTO_TCP;
+
+	if (f && f->f && run_ssfilter(f->f, &s) == 0)
+		return 0;
+
+	if (interval_secs)
+		return ivl_show_sock(h, &s, IPPROTO_TCP);
+	if (group_by)
+		return agg_sock(h, &s);
+
+	return inet_show_sock(h, &s);
+}
+
 static int tcp_show_netlink_file(struct filter *f)
 {
 	FILE	*fp;
 	char	buf[16384];
 	int	err = -1;
+	struct sockdiag_dump *d;
+
+	if (sockdiag_planning) {
+		fp = fopen(getenv("TCPDIAG_FILE"), "r");
+		if (fp)
+			sockdiag_prefetch(PF_UNSPEC, IPPROTO_TCP, f,
+					  NULL, 0, fp);
+		return 0;
+	}
+
+	d = sockdiag_take(PF_UNSPEC, IPPROTO_TCP);
+	if (d) {
+		err = sockdiag_replay(d, show_one_file_sock, f);
+		if (err != SOCKDIAG_RETRY)
+			return err;
+		err = -1;
+	}
 
 	if ((fp = fopen(getenv("TCPDIAG_FILE"), "r")) == NULL) {
 		perror("fopen($TCPDIAG_FILE)");
@@ -3625,7 +5263,6 @@ static int tcp_show_netlink_file(struct filter *f)
 		int err2;
 		size_t status, nitems;
 		struct nlmsghdr *h = (struct nlmsghdr *)buf;
-		struct sockstat s = {};
 
 		status = fread(buf, 1, sizeof(*h), fp);
 		if (status != sizeof(*h)) {
@@ -3665,13 +5302,7 @@ static int tcp_show_netlink_file(struct filter *f)
 			break;
 		}
 
-		parse_diag_msg(h, &s);
-		s.type = IPPROTO_TCP;
-
-		if (f && f->f && run_ssfilter(f->f, &s) == 0)
-			continue;
-
-		err2 = inet_show_sock(h, &s);
+		err2 = show_one_file_sock(h, f);
 		if (err2 < 0) {
 			err = err2;
 			break;
@@ -4014,9 +5645,22 @@ static int unix_show_sock(struct nlmsghdr *nlh, void *arg)
 static int handle_netlink_request(struct filter *f, struct nlmsghdr *req,
 		size_t size, rtnl_filter_t show_one_sock)
 {
+	struct sock_diag_req *r = NLMSG_DATA(req);
+	struct sockdiag_dump *d;
 	int ret = -1;
 	struct rtnl_handle rth;
 
+	if (sockdiag_planning)
+		return sockdiag_prefetch(r->sdiag_family, r->sdiag_protocol,
+					 f, req, size, NULL);
+
+	d = sockdiag_take(r->sdiag_family, r->sdiag_protocol);
+	if (d) {
+		ret = sockdiag_replay(d, show_one_sock, f);
+		if (ret != SOCKDIAG_RETRY)
+			return ret ? -1 : 0;
+	}
+
 	if (rtnl_open_byproto(&rth, 0, NETLINK_SOCK_DIAG))
 		return -1;
 
@@ -5181,6 +6825,20 @@ static void _usage(FILE *dest)
 "   -e, --extended      show detailed socket information\n"
 "   -m, --memory        show socket memory usage\n"
 "   -p, --processes     show process using socket\n"
+"       --lazy-users    like -p, but only look up the sockets shown\n"
+"       --proc-threads=N\n"
+"                       read /proc with N threads for --lazy-users\n"
+"       --users-uid     only look at processes owned by the socket uid\n"
+"       --parallel      run the socket dumps concurrently\n"
+"       --stream        print each socket at once, with fixed column widths\n"
+"       --interval=N    print TCP socket deltas and rates every N seconds\n"
+"       --group-by={dst[/LEN]|sport|dport|cgroup|mark|process}\n"
+"                       print one line of totals per group of sockets\n"
+"       --top=K         only the K busiest sockets or groups\n"
+"       --top-by={throughput|retrans|sockets|bytes}\n"
+"                       what --top sorts by: throughput (the default) or\n"
+"                       retrans with --interval, sockets (the default),\n"
+"                       bytes (acked and received) or retrans with --group-by\n"
 "   -i, --info          show internal TCP information\n"
 "       --tipcinfo      show internal tipc socket information\n"
 "   -s, --summary       show socket usage summary\n"
@@ -5299,6 +6957,16 @@ static int scan_state(const char *state)
 
 #define OPT_CGROUP 261
 
+#define OPT_LAZY_USERS 262
+#define OPT_PROC_THREADS 263
+#define OPT_USERS_UID 264
+#define OPT_PARALLEL 265
+#define OPT_STREAM 266
+#define OPT_INTERVAL 267
+#define OPT_TOP 268
+#define OPT_TOP_BY 269
+#define OPT_GROUP_BY 270
+
 static const struct option long_opts[] = {
 	{ "numeric", 0, 0, 'n' },
 	{ "resolve", 0, 0, 'r' },
@@ -5336,6 +7004,15 @@ static const struct option long_opts[] = {
 	{ "tipcinfo", 0, 0, OPT_TIPCINFO},
 	{ "tos", 0, 0, OPT_TOS },
 	{ "cgroup", 0, 0, OPT_CGROUP },
+	{ "lazy-users", 0, 0, OPT_LAZY_USERS },
+	{ "proc-threads", 1, 0, OPT_PROC_THREADS },
+	{ "users-uid", 0, 0, OPT_USERS_UID },
+	{ "parallel", 0, 0, OPT_PARALLEL },
+	{ "stream", 0, 0, OPT_STREAM },
+	{ "interval", 1, 0, OPT_INTERVAL },
+	{ "top", 1, 0, OPT_TOP },
+	{ "top-by", 1, 0, OPT_TOP_BY },
+	{ "group-by", 1, 0, OPT_GROUP_BY },
 	{ "kill", 0, 0, 'K' },
 	{ "no-header", 0, 0, 'H' },
 	{ "xdp", 0, 0, OPT_XDPSOCK},
@@ -5345,6 +7022,72 @@ static const struct option long_opts[] = {
 
 };
 
+/* --interval: dump the TCP sockets every interval_secs seconds and print
+ * what changed since the previous dump
+ */
+static int interval_loop(struct filter *f)
+{
+	struct timespec next, now, prev;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	prev = next;
+
+	for (ivl.round = 1; ; ivl.round++) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		ivl.elapsed = now.tv_sec - prev.tv_sec +
+			      (now.tv_nsec - prev.tv_nsec) / 1e9;
+		prev = now;
+
+		/* the first header waits in the buffer for the second round */
+		if (ivl.round > 2 && show_header)
+			print_header();
+
+		tcp_show(f);
+		ivl_top_flush();
+		ivl_sweep();
+
+		if (ivl.round > 1) {
+			render();
+			fflush(stdout);
+		}
+
+		next.tv_sec += interval_secs;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+				       &next, NULL) == EINTR)
+			;
+	}
+
+	return 0;
+}
+
+static void show_sockets(struct filter *f)
+{
+	if (f->dbs & (1<<NETLINK_DB))
+		netlink_show(f);
+	if (f->dbs & PACKET_DBM)
+		packet_show(f);
+	if (f->dbs & UNIX_DBM)
+		unix_show(f);
+	if (f->dbs & (1<<RAW_DB))
+		raw_show(f);
+	if (f->dbs & (1<<UDP_DB))
+		udp_show(f);
+	if (f->dbs & (1<<TCP_DB))
+		tcp_show(f);
+	if (f->dbs & (1<<DCCP_DB))
+		dccp_show(f);
+	if (f->dbs & (1<<SCTP_DB))
+		sctp_show(f);
+	if (f->dbs & VSOCK_DBM)
+		vsock_show(f);
+	if (f->dbs & (1<<TIPC_DB))
+		tipc_show(f);
+	if (f->dbs & (1<<XDP_DB))
+		xdp_show(f);
+	if (f->dbs & (1<<MPTCP_DB))
+		mptcp_show(f);
+}
+
 int main(int argc, char *argv[])
 {
 	int saw_states = 0;
@@ -5380,7 +7123,6 @@ int main(int argc, char *argv[])
 			break;
 		case 'p':
 			show_users++;
-			user_ent_hash_build();
 			break;
 		case 'b':
 			show_options = 1;
@@ -5530,6 +7272,94 @@ int main(int argc, char *argv[])
 		case OPT_CGROUP:
 			show_cgroup = 1;
 			break;
+		case OPT_LAZY_USERS:
+			show_users++;
+			lazy_users = 1;
+			break;
+		case OPT_PROC_THREADS:
+			if (get_unsigned(&proc_threads, optarg, 0) ||
+			    !proc_threads) {
+				fprintf(stderr, "ss: invalid thread count: %s\n",
+					optarg);
+				exit(-1);
+			}
+			break;
+		case OPT_USERS_UID:
+			users_by_uid = 1;
+			break;
+		case OPT_PARALLEL:
+			parallel_dumps = 1;
+			break;
+		case OPT_STREAM:
+			stream_output = 1;
+			break;
+		case OPT_INTERVAL:
+			if (get_unsigned(&interval_secs, optarg, 0) ||
+			    !interval_secs) {
+				fprintf(stderr, "ss: invalid interval: %s\n",
+					optarg);
+				exit(-1);
+			}
+			break;
+		case OPT_TOP:
+			if (get_unsigned(&top_k, optarg, 0) || !top_k) {
+				fprintf(stderr, "ss: invalid top count: %s\n",
+					optarg);
+				exit(-1);
+			}
+			break;
+		case OPT_TOP_BY:
+			if (matches(optarg, "throughput") == 0) {
+				top_by = TOP_BY_THROUGHPUT;
+			} else if (matches(optarg, "retrans") == 0) {
+				top_by = TOP_BY_RETRANS;
+			} else if (matches(optarg, "sockets") == 0) {
+				top_by = TOP_BY_SOCKETS;
+			} else if (matches(optarg, "bytes") == 0) {
+				top_by = TOP_BY_BYTES;
+			} else {
+				fprintf(stderr, "ss: invalid top key: %s\n",
+					optarg);
+				exit(-1);
+			}
+			break;
+		case OPT_GROUP_BY:
+		{
+			char *len = strchr(optarg, '/');
+
+			if (len)
+				*len++ = '\0';
+			group_by = AGG_BY_NONE;
+			group_prefixlen = 128;
+			if (strcmp(optarg, "dst") == 0)
+				group_by = AGG_BY_DST;
+			else if (len)
+				; /* only dst takes a length */
+			else if (strcmp(optarg, "sport") == 0)
+				group_by = AGG_BY_SPORT;
+			else if (strcmp(optarg, "dport") == 0)
+				group_by = AGG_BY_DPORT;
+			else if (strcmp(optarg, "cgroup") == 0)
+				group_by = AGG_BY_CGROUP;
+			else if (strcmp(optarg, "mark") == 0)
+				group_by = AGG_BY_MARK;
+			else if (strcmp(optarg, "process") == 0)
+				group_by = AGG_BY_PROCESS;
+			if (!group_by) {
+				if (len)
+					len[-1] = '/';
+				fprintf(stderr, "ss: invalid group key: %s\n",
+					optarg);
+				exit(-1);
+			}
+			if (len && (get_unsigned(&group_prefixlen, len, 0) ||
+				    group_prefixlen > 128)) {
+				fprintf(stderr, "ss: invalid prefix length: %s\n",
+					len);
+				exit(-1);
+			}
+			break;
+		}
 		case 'K':
 			current_filter.kill = 1;
 			break;
@@ -5550,6 +7380,9 @@ int main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
+	if (show_users && !lazy_users)
+		user_ent_hash_build();
+
 	if (do_summary) {
 		print_summary();
 		if (do_default && argc == 0)
@@ -5584,6 +7417,29 @@ int main(int argc, char *argv[])
 	filter_states_set(&current_filter, state_filter);
 	filter_merge_defaults(&current_filter);
 
+	if (interval_secs && group_by) {
+		fprintf(stderr, "ss: --group-by and --interval are exclusive\n");
+		exit(-1);
+	}
+	if (interval_secs) {
+		current_filter.dbs &= 1 << TCP_DB;
+	} else if (group_by) {
+		current_filter.dbs &= INET_DBM;
+	} else if (top_k) {
+		fprintf(stderr, "ss: --top needs --interval or --group-by\n");
+		exit(-1);
+	}
+	/* groups only have lifetime counters, no rates */
+	if (top_by == TOP_BY_THROUGHPUT && !interval_secs) {
+		fprintf(stderr, "ss: --top-by throughput needs --interval\n");
+		exit(-1);
+	}
+	if ((top_by == TOP_BY_SOCKETS || top_by == TOP_BY_BYTES) &&
+	    !group_by) {
+		fprintf(stderr, "ss: --top-by sockets or bytes needs --group-by\n");
+		exit(-1);
+	}
+
 	if (!numeric && resolve_hosts &&
 	    (current_filter.dbs & (UNIX_DBM|INET_L4_DBM)))
 		init_service_resolver();
@@ -5629,7 +7485,14 @@ int main(int argc, char *argv[])
 	if (!(current_filter.states & (current_filter.states - 1)))
 		columns[COL_STATE].disabled = 1;
 
-	if (show_header)
+	if (stream_output) {
+		/* fewer, larger writes, but leave --events alone */
+		if (!follow_events)
+			setvbuf(stdout, NULL, _IOFBF, BUF_CHUNK);
+		stream_calc_width(&current_filter);
+	}
+
+	if (show_header && !group_by)
 		print_header();
 
 	fflush(stdout);
@@ -5637,35 +7500,24 @@ int main(int argc, char *argv[])
 	if (follow_events)
 		exit(handle_follow_request(&current_filter));
 
-	if (current_filter.dbs & (1<<NETLINK_DB))
-		netlink_show(&current_filter);
-	if (current_filter.dbs & PACKET_DBM)
-		packet_show(&current_filter);
-	if (current_filter.dbs & UNIX_DBM)
-		unix_show(&current_filter);
-	if (current_filter.dbs & (1<<RAW_DB))
-		raw_show(&current_filter);
-	if (current_filter.dbs & (1<<UDP_DB))
-		udp_show(&current_filter);
-	if (current_filter.dbs & (1<<TCP_DB))
-		tcp_show(&current_filter);
-	if (current_filter.dbs & (1<<DCCP_DB))
-		dccp_show(&current_filter);
-	if (current_filter.dbs & (1<<SCTP_DB))
-		sctp_show(&current_filter);
-	if (current_filter.dbs & VSOCK_DBM)
-		vsock_show(&current_filter);
-	if (current_filter.dbs & (1<<TIPC_DB))
-		tipc_show(&current_filter);
-	if (current_filter.dbs & (1<<XDP_DB))
-		xdp_show(&current_filter);
-	if (current_filter.dbs & (1<<MPTCP_DB))
-		mptcp_show(&current_filter);
+	if (interval_secs)
+		exit(interval_loop(&current_filter));
+
+	if (parallel_dumps && !current_filter.kill) {
+		sockdiag_planning = true;
+		show_sockets(&current_filter);
+		sockdiag_planning = false;
+	}
+	show_sockets(&current_filter);
+	sockdiag_dumps_free();
 
 	if (show_users || show_proc_ctx || show_sock_ctx)
 		user_ent_destroy();
 
 	render();
 
+	if (group_by)
+		agg_print();
+
 	return 0;
 }
@@ -23,9 +23,11 @@
 #include <arpa/inet.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/wait.h>
 
 #include "version.h"
 #include "utils.h"
+#include "ll_map.h"
 #include "tc_util.h"
 #include "tc_common.h"
 #include "namespace.h"
@@ -196,7 +198,7 @@ static void usage(void)
 {
 	fprintf(stderr,
 		"Usage:	tc [ OPTIONS ] OBJECT { COMMAND | help }\n"
-		"	tc [-force] -batch filename\n"
+		"	tc [-force] [-pipeline N] [-bulk] [-jobs N] -batch filename\n"
 		"where  OBJECT := { qdisc | class | filter | chain |\n"
 		"		    action | monitor | exec }\n"
 		"       OPTIONS := { -V[ersion] | -s[tatistics] | -d[etails] | -r[aw] |\n"
@@ -231,6 +233,371 @@ static int do_cmd(int argc, char **argv)
 	return -1;
 }
 
+/* requests in flight with -pipeline, 0 waits for every ACK */
+static unsigned int pipeline;
+/* pack them into datagrams, ACK only the last of each */
+static int bulk;
+static int pipe_failed;
+/* worker processes with -jobs, 0 runs the batch in order */
+static unsigned int jobs;
+
+static void batch_pipe_err(int lineno, int error, void *name)
+{
+	fprintf(stderr, "Command failed %s:%d\n", (const char *)name, lineno);
+	pipe_failed = 1;
+}
+
+static int batch_open(const char *name)
+{
+	if (rtnl_open(&rth, 0) < 0) {
+		fprintf(stderr, "Cannot open rtnetlink\n");
+		return -1;
+	}
+
+	if (bulk && !pipeline)
+		pipeline = 256;
+	if (pipeline &&
+	    (rtnl_pipe_open(&rth, pipeline, batch_pipe_err, (void *)name) < 0 ||
+	     (bulk && rtnl_pipe_bulk(&rth) < 0))) {
+		perror("Cannot pipeline requests");
+		rtnl_close(&rth);
+		return -1;
+	}
+	return 0;
+}
+
+/* run one batch line, nonzero if it or a pipelined one before it failed */
+static int batch_line(const char *name, char *line, int lineno)
+{
+	char *largv[100];
+	int largc;
+
+	largc = makeargs(line, largv, 100);
+	if (largc == 0)
+		return 0;	/* blank line */
+
+	cmdlineno = lineno;
+	rtnl_pipe_tag(&rth, lineno);
+	if (do_cmd(largc, largv)) {
+		fprintf(stderr, "Command failed %s:%d\n", name, lineno);
+		return 1;
+	}
+	return pipe_failed;
+}
+
+/*
+ * With -jobs the batch is read up front and every line is given to a
+ * shard by the device or block it names.  A run of sharded lines is
+ * handed to one forked worker per shard, each with its own netlink
+ * socket, and every worker runs its lines in file order, so the order
+ * per device is kept.  Lines that name neither, or bind a device to a
+ * shared block, are barriers: the parent runs them itself once the
+ * workers before them are done.  The workers write their output to
+ * files together with a record per line, and the parent replays those
+ * in line order, so the output does not depend on scheduling.
+ */
+struct batch_cmd {
+	char		*line;
+	int		lineno;
+	int		shard;		/* -1 for a barrier */
+};
+
+struct batch_rec {
+	int		lineno;
+	int		failed;
+	off_t		out[2];
+	off_t		err[2];
+};
+
+struct batch_job {
+	pid_t		pid;
+	FILE		*out;
+	FILE		*err;
+	FILE		*rec;
+};
+
+struct batch_out {
+	struct batch_rec rec;
+	unsigned int	job;
+	unsigned int	idx;
+};
+
+/* returns the number of words, the shard is -1 for a barrier */
+static int batch_shard(const char *line, int *shard)
+{
+	char *copy, *argv[100];
+	int argc, i, key = 0;
+
+	*shard = -1;
+	copy = strdup(line);
+	if (!copy)
+		return -1;
+
+	argc = makeargs(copy, argv, 100);
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "ingress_block") == 0 ||
+		    strcmp(argv[i], "egress_block") == 0) {
+			key = 0;
+			break;
+		}
+		if (!key && i + 1 < argc &&
+		    (strcmp(argv[i], "dev") == 0 ||
+		     strcmp(argv[i], "block") == 0))
+			key = i;
+	}
+	/* "dev 5" and "block 5" are different keys */
+	if (key)
+		*shard = (namehash(argv[key + 1]) ^ (argv[key][0] == 'b'))
+			 % jobs;
+
+	free(copy);
+	return argc;
+}
+
+static int batch_job_run(const char *name, struct batch_cmd *cmds,
+			 int first, int last, int shard, FILE *rec)
+{
+	struct batch_rec r = {};
+	int i, ret = 0;
+
+	/* the parent keeps its socket, this one gets its own */
+	rtnl_close(&rth);
+	pipe_failed = 0;
+	if (batch_open(name) < 0)
+		return 1;
+
+	for (i = first; i < last; i++) {
+		if (cmds[i].shard != shard)
+			continue;
+
+		r.lineno = cmds[i].lineno;
+		r.out[0] = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+		r.err[0] = lseek(STDERR_FILENO, 0, SEEK_CUR);
+		r.failed = batch_line(name, cmds[i].line, cmds[i].lineno);
+		fflush(stdout);
+		fflush(stderr);
+		r.out[1] = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+		r.err[1] = lseek(STDERR_FILENO, 0, SEEK_CUR);
+		fwrite(&r, sizeof(r), 1, rec);
+
+		if (r.failed) {
+			ret = 1;
+			if (!force) {
+				if (pipe_failed)
+					rtnl_pipe_abort(&rth);
+				break;
+			}
+		}
+	}
+
+	/* whatever is still in flight is reported after the last line */
+	r.out[0] = r.out[1];
+	r.err[0] = r.err[1];
+	if (rtnl_pipe_flush(&rth) < 0)
+		pipe_failed = 1;
+	fflush(stdout);
+	fflush(stderr);
+	r.out[1] = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+	r.err[1] = lseek(STDERR_FILENO, 0, SEEK_CUR);
+	r.failed = pipe_failed;
+	fwrite(&r, sizeof(r), 1, rec);
+
+	rtnl_close(&rth);
+	fflush(rec);
+	return ret || pipe_failed;
+}
+
+static void batch_replay(FILE *from, const off_t *range, FILE *to)
+{
+	char buf[4096];
+	off_t off = range[0];
+
+	while (off < range[1]) {
+		size_t len = range[1] - off;
+		ssize_t cc;
+
+		cc = pread(fileno(from), buf,
+			   len < sizeof(buf) ? len : sizeof(buf), off);
+		if (cc <= 0)
+			break;
+		fwrite(buf, 1, cc, to);
+		off += cc;
+	}
+}
+
+static int batch_out_cmp(const void *a, const void *b)
+{
+	const struct batch_out *x = a, *y = b;
+
+	if (x->rec.lineno != y->rec.lineno)
+		return x->rec.lineno < y->rec.lineno ? -1 : 1;
+	if (x->job != y->job)
+		return x->job < y->job ? -1 : 1;
+	return x->idx < y->idx ? -1 : x->idx > y->idx;
+}
+
+/* run cmds[first..last) on the workers and replay their output */
+static int batch_fork(const char *name, struct batch_cmd *cmds,
+		      int first, int last)
+{
+	struct batch_out *outs = NULL;
+	struct batch_job *job;
+	unsigned int k, n = 0;
+	int i, ret = 0;
+
+	job = calloc(jobs, sizeof(*job));
+	if (!job)
+		return 1;
+
+	/* nothing buffered may be written twice */
+	fflush(stdout);
+	fflush(stderr);
+
+	for (i = first; i < last; i++) {
+		struct batch_job *j = &job[cmds[i].shard];
+
+		if (j->rec)
+			continue;
+		j->out = tmpfile();
+		j->err = tmpfile();
+		j->rec = tmpfile();
+		if (!j->out || !j->err || !j->rec) {
+			perror("Cannot create batch output");
+			ret = 1;
+			goto out;
+		}
+
+		j->pid = fork();
+		if (j->pid < 0) {
+			perror("fork");
+			ret = 1;
+			goto out;
+		}
+		if (j->pid == 0) {
+			dup2(fileno(j->out), STDOUT_FILENO);
+			dup2(fileno(j->err), STDERR_FILENO);
+			_exit(batch_job_run(name, cmds, first, last,
+					    cmds[i].shard, j->rec));
+		}
+	}
+
+out:
+	for (k = 0; k < jobs; k++) {
+		int status;
+
+		if (job[k].pid <= 0)
+			continue;
+		if (waitpid(job[k].pid, &status, 0) < 0 ||
+		    !WIFEXITED(status) || WEXITSTATUS(status))
+			ret = 1;
+	}
+
+	for (k = 0; k < jobs; k++) {
+		struct batch_rec r;
+		unsigned int idx = 0;
+
+		if (!job[k].pid)
+			continue;
+		rewind(job[k].rec);
+		while (fread(&r, sizeof(r), 1, job[k].rec) == 1) {
+			struct batch_out *o;
+
+			o = realloc(outs, (n + 1) * sizeof(*outs));
+			if (!o) {
+				ret = 1;
+				break;
+			}
+			outs = o;
+			outs[n].rec = r;
+			outs[n].job = k;
+			outs[n++].idx = idx++;
+		}
+	}
+
+	qsort(outs, n, sizeof(*outs), batch_out_cmp);
+	for (k = 0; k < n; k++) {
+		struct batch_job *j = &job[outs[k].job];
+
+		batch_replay(j->out, outs[k].rec.out, stdout);
+		fflush(stdout);
+		batch_replay(j->err, outs[k].rec.err, stderr);
+		if (outs[k].rec.failed)
+			ret = 1;
+	}
+
+	for (k = 0; k < jobs; k++) {
+		if (job[k].out)
+			fclose(job[k].out);
+		if (job[k].err)
+			fclose(job[k].err);
+		if (job[k].rec)
+			fclose(job[k].rec);
+	}
+	free(outs);
+	free(job);
+	return ret;
+}
+
+static int batch_parallel(const char *name)
+{
+	struct batch_cmd *cmds = NULL;
+	char *line = NULL;
+	size_t len = 0;
+	int i, n = 0, ret = 0;
+
+	cmdlineno = 0;
+	while (getcmdline(&line, &len, stdin) != -1) {
+		struct batch_cmd *c;
+		int shard;
+
+		if (batch_shard(line, &shard) <= 0)
+			continue;	/* blank line */
+
+		c = realloc(cmds, (n + 1) * sizeof(*cmds));
+		if (!c)
+			goto oom;
+		cmds = c;
+		cmds[n].line = strdup(line);
+		if (!cmds[n].line)
+			goto oom;
+		cmds[n].lineno = cmdlineno;
+		cmds[n++].shard = shard;
+	}
+
+	for (i = 0; i < n; ) {
+		int end;
+
+		if (cmds[i].shard < 0) {
+			if (batch_line(name, cmds[i].line, cmds[i].lineno))
+				ret = 1;
+			fflush(stdout);
+			i++;
+		} else {
+			for (end = i; end < n && cmds[end].shard >= 0; end++)
+				;
+			/* the workers must see what the barriers did */
+			if (rtnl_pipe_flush(&rth) < 0)
+				ret = 1;
+			if (batch_fork(name, cmds, i, end))
+				ret = 1;
+			i = end;
+		}
+		if (ret && !force)
+			break;
+	}
+	goto out;
+
+oom:
+	fprintf(stderr, "Out of memory\n");
+	ret = 1;
+out:
+	for (i = 0; i < n; i++)
+		free(cmds[i].line);
+	free(cmds);
+	free(line);
+	return ret;
+}
+
 static int batch(const char *name)
 {
 	char *line = NULL;
@@ -249,30 +616,32 @@ static int batch(const char *name)
 
 	tc_core_init();
 
-	if (rtnl_open(&rth, 0) < 0) {
-		fprintf(stderr, "Cannot open rtnetlink\n");
+	if (batch_open(name) < 0)
 		return -1;
+
+	if (jobs) {
+		ret = batch_parallel(name);
+		goto out;
 	}
 
 	cmdlineno = 0;
 	while (getcmdline(&line, &len, stdin) != -1) {
-		char *largv[100];
-		int largc;
-
-		largc = makeargs(line, largv, 100);
-		if (largc == 0)
-			continue;	/* blank line */
-
-		if (do_cmd(largc, largv)) {
-			fprintf(stderr, "Command failed %s:%d\n",
-				name, cmdlineno);
+		if (batch_line(name, line, cmdlineno)) {
 			ret = 1;
-			if (!force)
+			if (!force) {
+				/* a pipelined failure shows up a few lines late */
+				if (pipe_failed)
+					rtnl_pipe_abort(&rth);
 				break;
+			}
 		}
 		fflush(stdout);
 	}
 
+out:
+	if (rtnl_pipe_flush(&rth) < 0 || pipe_failed)
+		ret = 1;
+
 	free(line);
 	rtnl_close(&rth);
 	return ret;
@@ -313,6 +682,12 @@ int main(int argc, char **argv)
 			if (argc <= 1)
 				usage();
 			batch_file = argv[1];
+		} else if (matches(argv[1], "-pipeline") == 0) {
+			NEXT_ARG();
+			if (get_unsigned(&pipeline, argv[1], 0) || !pipeline)
+				invarg("invalid pipeline depth", argv[1]);
+		} else if (matches(argv[1], "-bulk") == 0) {
+			bulk = 1;
 		} else if (matches(argv[1], "-netns") == 0) {
 			NEXT_ARG();
 			if (netns_switch(argv[1]))
@@ -334,6 +709,10 @@ int main(int argc, char **argv)
 			++timestamp_short;
 		} else if (matches(argv[1], "-json") == 0) {
 			++json;
+		} else if (matches(argv[1], "-jobs") == 0) {
+			NEXT_ARG();
+			if (get_unsigned(&jobs, argv[1], 0) || !jobs)
+				invarg("invalid number of jobs", argv[1]);
 		} else if (matches(argv[1], "-oneline") == 0) {
 			++oneline;
 		} else {
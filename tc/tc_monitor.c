@@ -39,6 +39,10 @@ static int accept_tcmsg(struct rtnl_ctrl_data *ctrl,
 {
 	FILE *fp = (FILE *)arg;
 
+	/* link events only keep the device names current */
+	if (n->nlmsg_type == RTM_NEWLINK || n->nlmsg_type == RTM_DELLINK)
+		return ll_remember_index(n, NULL);
+
 	if (timestamp)
 		print_timestamp(fp);
 
@@ -74,7 +78,7 @@ int do_tcmonitor(int argc, char **argv)
 {
 	struct rtnl_handle rth;
 	char *file = NULL;
-	unsigned int groups = nl_mgrp(RTNLGRP_TC);
+	unsigned int groups = nl_mgrp(RTNLGRP_TC) | nl_mgrp(RTNLGRP_LINK);
 
 	while (argc > 0) {
 		if (matches(*argv, "file") == 0) {
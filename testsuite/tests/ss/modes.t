@@ -0,0 +1,64 @@
+#!/bin/sh
+
+. lib/generic.sh
+
+# --parallel, --stream and --group-by only change how the dump is read,
+# printed or summed up: compare them against a plain run over ss1.dump.
+export TCPDIAG_FILE="$(dirname $0)/ss1.dump"
+
+PLAIN="$(mktemp)"
+
+# $1 description, $2 "squeeze" to ignore column widths, then ss arguments
+ss_same()
+{
+	DESC="$1"; shift
+	SQUEEZE="$1"; shift
+
+	echo -n "test on: $DESC"
+	"$SS" "$@" 2> $STD_ERR > $STD_OUT
+	if [ "$SQUEEZE" = "squeeze" ]; then
+		tr -s ' ' < "$PLAIN" > "$PLAIN.cmp"
+		tr -s ' ' < $STD_OUT > "$STD_OUT.cmp"
+	else
+		cp "$PLAIN" "$PLAIN.cmp"
+		cp $STD_OUT "$STD_OUT.cmp"
+	fi
+
+	if [ -s $STD_ERR ] || ! cmp -s "$PLAIN.cmp" "$STD_OUT.cmp"; then
+		pr_failed
+		ts_err "command: $SS $@"
+		diff "$PLAIN.cmp" "$STD_OUT.cmp" | ts_err_cat
+		ts_err_cat $STD_ERR
+	else
+		pr_success
+	fi
+	rm -f "$PLAIN.cmp" "$STD_OUT.cmp"
+}
+
+ts_log "[Testing output modes]"
+
+"$SS" -tna > "$PLAIN"
+ss_same "--parallel" none -tna --parallel
+ss_same "--stream" squeeze -tna --stream
+ss_same "--stream --parallel" squeeze -tna --stream --parallel
+
+"$SS" -tna dport = 22 > "$PLAIN"
+ss_same "--parallel with a filter" none -tna --parallel dport = 22
+
+"$SS" -tna --group-by dport > "$PLAIN"
+ss_same "--group-by --parallel" none -tna --group-by dport --parallel
+
+ts_ss "$0" "Group by peer port" -Htna --group-by dport
+test_lines_count 4
+test_on "^22 +1 +0 +0 "
+
+ts_ss "$0" "Group by peer /24" -Htna --group-by dst/24
+test_lines_count 2
+test_on "^10.0.0.0/24 +3 +0 +0 "
+test_on "^0.0.0.0/24 +1 +0 +128 "
+
+ts_ss "$0" "Group by local port, top 1" -Htna --group-by sport --top 1
+test_lines_count 1
+test_on "^22 +3 +0 +128 "
+
+rm "$PLAIN"
@@ -21,3 +21,86 @@ fi
 
 rm "$TMP"
 ts_ip "$0" "Del $DEV dummy interface" link del dev $DEV
+
+# The same checks with requests pipelined, packed into datagrams and run
+# on parallel workers: a failure is blamed on its own line, -force goes on
+# past it, and the output comes in file order.
+DEV2="$(rand_dev)"
+ts_ip "$0" "Add $DEV dummy interface" link add dev $DEV type dummy
+ts_ip "$0" "Add $DEV2 dummy interface" link add dev $DEV2 type dummy
+
+for MODE in "-pipeline 8" "-bulk" "-jobs 2"; do
+	ts_tc "$0" "Add htb qdisc" qdisc add dev $DEV root handle 1: htb
+
+	TMP="$(mktemp)"
+	echo class add dev $DEV parent 1: classid 1:10 htb rate 1mbit >> "$TMP"
+	echo class add dev $DEV parent 1: classid 1:10 htb rate 1mbit >> "$TMP"
+	echo class add dev $DEV parent 1: classid 1:20 htb rate 1mbit >> "$TMP"
+
+	"$TC" $MODE -b "$TMP" 2> $STD_ERR > $STD_OUT
+	if [ $? -eq 0 ]; then
+		ts_err "$0: $MODE batch passed when it should have failed"
+	elif ! grep -q "Command failed $TMP:2\$" $STD_ERR; then
+		ts_err "$0: $MODE batch did not blame line 2:"
+		ts_err_cat $STD_ERR
+	else
+		echo "$0: $MODE batch failed at line 2, as expected"
+	fi
+
+	# only the workers run strictly line by line, a pipeline may have
+	# sent the next line before the failure came back
+	if [ "$MODE" = "-jobs 2" ] &&
+	   "$TC" class show dev $DEV | grep -q "1:20 "; then
+		ts_err "$0: $MODE batch went on after a failure"
+	fi
+
+	ts_tc "$0" "Del htb qdisc" qdisc del dev $DEV root
+	ts_tc "$0" "Add htb qdisc" qdisc add dev $DEV root handle 1: htb
+
+	"$TC" -force $MODE -b "$TMP" 2> $STD_ERR > $STD_OUT
+	if [ $? -eq 0 ]; then
+		ts_err "$0: $MODE -force batch passed when it should have failed"
+	elif ! grep -q "Command failed $TMP:2\$" $STD_ERR; then
+		ts_err "$0: $MODE -force batch did not blame line 2:"
+		ts_err_cat $STD_ERR
+	elif ! "$TC" class show dev $DEV | grep -q "1:20 "; then
+		ts_err "$0: $MODE -force batch stopped at the failure"
+	else
+		echo "$0: $MODE -force batch ran past line 2, as expected"
+	fi
+
+	ts_tc "$0" "Del htb qdisc" qdisc del dev $DEV root
+	rm "$TMP"
+
+	# changes and dumps on two devices, the output of each dump must
+	# be the one of a plain batch
+	ts_tc "$0" "Add htb qdisc" qdisc add dev $DEV root handle 1: htb
+	ts_tc "$0" "Add htb qdisc" qdisc add dev $DEV2 root handle 1: htb
+
+	TMP="$(mktemp)"
+	for i in 1 2 3 4; do
+		echo class add dev $DEV parent 1: classid 1:$i htb rate ${i}mbit >> "$TMP"
+		echo class show dev $DEV >> "$TMP"
+		echo class add dev $DEV2 parent 1: classid 1:$i htb rate ${i}mbit >> "$TMP"
+		echo class show dev $DEV2 >> "$TMP"
+		echo qdisc show dev $DEV >> "$TMP"
+	done
+	sed -e 's/ add / del /' -e '/ show /d' "$TMP" > "$TMP.del"
+
+	"$TC" -b "$TMP" > "$TMP.plain" 2>&1
+	"$TC" -b "$TMP.del" 2> $STD_ERR
+	"$TC" $MODE -b "$TMP" 2> $STD_ERR > $STD_OUT
+	if ! cmp -s "$TMP.plain" $STD_OUT; then
+		ts_err "$0: $MODE batch output differs from a plain batch:"
+		diff "$TMP.plain" $STD_OUT | ts_err_cat
+	else
+		echo "$0: $MODE batch output is in file order"
+	fi
+
+	ts_tc "$0" "Del htb qdisc" qdisc del dev $DEV root
+	ts_tc "$0" "Del htb qdisc" qdisc del dev $DEV2 root
+	rm "$TMP" "$TMP.plain" "$TMP.del"
+done
+
+ts_ip "$0" "Del $DEV dummy interface" link del dev $DEV
+ts_ip "$0" "Del $DEV2 dummy interface" link del dev $DEV2
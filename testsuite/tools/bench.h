@@ -0,0 +1,28 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * bench.h	Timing helpers shared by the testsuite benchmarks
+ */
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <stdio.h>
+#include <time.h>
+
+static inline double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* "NAME  COUNT WHAT  T ns/PER" where T is elapsed time over OPS operations */
+static inline void bench_report(int width, const char *name,
+				unsigned int count, const char *what,
+				double elapsed, double ops, const char *per)
+{
+	printf("%-*s %8u %s %10.1f ns/%s\n", width, name, count, what,
+	       elapsed * 1e9 / ops, per);
+}
+
+#endif /* __BENCH_H__ */
@@ -0,0 +1,180 @@
+/*
+ * dump_bench.c	Compare rtnetlink dump receive strategies
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ *
+ * Fills a routing table with blackhole routes and dumps it repeatedly,
+ * once through rtnl_dump_filter() and once with the former MSG_PEEK and
+ * malloc per datagram loop, counting recvmsg() calls and wall time.
+ * Run it in a scratch namespace: unshare -n ./dump_bench [ROUTES [ROUNDS]]
+ */
+
+#include <libnetlink.h>
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include "bench.h"
+
+#define BENCH_TABLE	100
+
+static unsigned long recvmsg_calls;
+
+ssize_t __real_recvmsg(int fd, struct msghdr *msg, int flags);
+
+ssize_t __wrap_recvmsg(int fd, struct msghdr *msg, int flags)
+{
+	recvmsg_calls++;
+	return __real_recvmsg(fd, msg, flags);
+}
+
+static int fill_table(struct rtnl_handle *rth, int count)
+{
+	struct {
+		struct nlmsghdr	n;
+		struct rtmsg	r;
+		char		buf[64];
+	} req = {
+		.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg)),
+		.n.nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE | NLM_F_EXCL,
+		.n.nlmsg_type = RTM_NEWROUTE,
+		.r.rtm_family = AF_INET,
+		.r.rtm_dst_len = 32,
+		.r.rtm_table = BENCH_TABLE,
+		.r.rtm_protocol = RTPROT_STATIC,
+		.r.rtm_scope = RT_SCOPE_UNIVERSE,
+		.r.rtm_type = RTN_BLACKHOLE,
+	};
+	int i;
+
+	for (i = 0; i < count; i++) {
+		req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+		addattr32(&req.n, sizeof(req), RTA_DST, htonl(0x0a000000 + i));
+		if (rtnl_talk(rth, &req.n, NULL) < 0 && errno != EEXIST)
+			return -1;
+	}
+	return 0;
+}
+
+static int count_route(struct nlmsghdr *n, void *arg)
+{
+	(*(int *)arg)++;
+	return 0;
+}
+
+static int dump_handle(struct rtnl_handle *rth)
+{
+	int routes = 0;
+
+	if (rtnl_routedump_req(rth, AF_INET, NULL) < 0 ||
+	    rtnl_dump_filter(rth, count_route, &routes) < 0)
+		return -1;
+	return routes;
+}
+
+/* what rtnl_recvmsg() used to do for every datagram */
+static int dump_peek(struct rtnl_handle *rth)
+{
+	struct sockaddr_nl nladdr;
+	struct iovec iov;
+	struct msghdr msg = {
+		.msg_name = &nladdr,
+		.msg_namelen = sizeof(nladdr),
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+	int routes = 0;
+
+	if (rtnl_routedump_req(rth, AF_INET, NULL) < 0)
+		return -1;
+
+	while (1) {
+		struct nlmsghdr *h;
+		char *buf;
+		int len;
+
+		iov.iov_base = NULL;
+		iov.iov_len = 0;
+		len = recvmsg(rth->fd, &msg, MSG_PEEK | MSG_TRUNC);
+		if (len < 0)
+			return -1;
+		if (len < 32768)
+			len = 32768;
+
+		buf = malloc(len);
+		if (!buf)
+			return -1;
+		iov.iov_base = buf;
+		iov.iov_len = len;
+		len = recvmsg(rth->fd, &msg, 0);
+		if (len < 0) {
+			free(buf);
+			return -1;
+		}
+
+		for (h = (struct nlmsghdr *)buf; NLMSG_OK(h, len);
+		     h = NLMSG_NEXT(h, len)) {
+			if (h->nlmsg_type == NLMSG_DONE) {
+				free(buf);
+				return routes;
+			}
+			if (h->nlmsg_type == NLMSG_ERROR) {
+				free(buf);
+				return -1;
+			}
+			routes++;
+		}
+		free(buf);
+	}
+}
+
+static void run(const char *name, struct rtnl_handle *rth,
+		int (*dump)(struct rtnl_handle *rth), int rounds)
+{
+	unsigned long calls = recvmsg_calls;
+	double start = bench_now();
+	int i, routes = 0;
+
+	for (i = 0; i < rounds; i++) {
+		routes = dump(rth);
+		if (routes < 0) {
+			fprintf(stderr, "%s: dump failed\n", name);
+			exit(1);
+		}
+	}
+
+	printf("%-8s %8d routes %10.3f ms/dump %10.1f recvmsg/dump\n",
+	       name, routes, (bench_now() - start) * 1000 / rounds,
+	       (double)(recvmsg_calls - calls) / rounds);
+}
+
+int main(int argc, char **argv)
+{
+	struct rtnl_handle rth = { .fd = -1 };
+	int count = argc > 1 ? atoi(argv[1]) : 100000;
+	int rounds = argc > 2 ? atoi(argv[2]) : 10;
+
+	if (count <= 0 || rounds <= 0) {
+		fprintf(stderr, "Usage: dump_bench [ROUTES [ROUNDS]]\n");
+		return 1;
+	}
+
+	if (rtnl_open(&rth, 0) < 0)
+		return 1;
+
+	if (fill_table(&rth, count) < 0) {
+		perror("Cannot add routes");
+		return 1;
+	}
+
+	run("peek", &rth, dump_peek, rounds);
+	run("handle", &rth, dump_handle, rounds);
+
+	rtnl_close(&rth);
+	return 0;
+}
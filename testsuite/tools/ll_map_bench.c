@@ -0,0 +1,143 @@
+/*
+ * ll_map_bench.c	Measure ll_map lookups with many interfaces
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ *
+ * Feeds synthetic RTM_NEWLINK messages for veths, VLANs and altnames
+ * into ll_remember_index() and times ll_name_to_index() and
+ * ll_index_to_name() over all of them in a shuffled order.  No netlink
+ * socket is used, every lookup must hit the cache.
+ * Usage: ll_map_bench [LINKS [ROUNDS]]
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <net/if.h>
+
+#include "utils.h"
+#include "bench.h"
+
+/* names like the ones container runtimes and VLAN setups produce */
+static void link_name(char *buf, size_t len, unsigned int i)
+{
+	switch (i % 4) {
+	case 0:
+		snprintf(buf, len, "eth%u.%u", i / 4096, i % 4096);
+		break;
+	case 1:
+		snprintf(buf, len, "cali%011x", i * 2654435761u);
+		break;
+	default:
+		snprintf(buf, len, "veth%08x", i * 40503u);
+		break;
+	}
+}
+
+static void add_link(unsigned int i)
+{
+	struct {
+		struct nlmsghdr		n;
+		struct ifinfomsg	i;
+		char			buf[256];
+	} req = {
+		.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg)),
+		.n.nlmsg_type = RTM_NEWLINK,
+		.i.ifi_index = i + 1,
+	};
+	char name[IFNAMSIZ];
+
+	link_name(name, sizeof(name), i);
+	addattr_l(&req.n, sizeof(req), IFLA_IFNAME, name, strlen(name) + 1);
+
+	/* every eighth link also has an altname */
+	if (i % 8 == 0) {
+		struct rtattr *proplist;
+		char alt[64];
+
+		snprintf(alt, sizeof(alt), "pod-%u-host-side", i);
+		proplist = addattr_nest(&req.n, sizeof(req),
+					IFLA_PROP_LIST | NLA_F_NESTED);
+		addattr_l(&req.n, sizeof(req), IFLA_ALT_IFNAME, alt,
+			  strlen(alt) + 1);
+		addattr_nest_end(&req.n, proplist);
+	}
+
+	ll_remember_index(&req.n, NULL);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int count = argc > 1 ? atoi(argv[1]) : 100000;
+	int rounds = argc > 2 ? atoi(argv[2]) : 10;
+	unsigned int *order;
+	char (*names)[IFNAMSIZ];
+	double start, elapsed;
+	unsigned int i;
+	int r;
+
+	if (!count || rounds <= 0) {
+		fprintf(stderr, "Usage: ll_map_bench [LINKS [ROUNDS]]\n");
+		return 1;
+	}
+
+	order = malloc(count * sizeof(*order));
+	names = malloc(count * sizeof(*names));
+	if (!order || !names)
+		return 1;
+
+	for (i = 0; i < count; i++) {
+		order[i] = i;
+		link_name(names[i], sizeof(names[i]), i);
+	}
+	srand(1);
+	for (i = count - 1; i > 0; i--) {
+		unsigned int j = rand() % (i + 1), tmp = order[i];
+
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+
+	start = bench_now();
+	for (i = 0; i < count; i++)
+		add_link(order[i]);
+	elapsed = bench_now() - start;
+	bench_report(14, "populate", count, "links", elapsed, count, "link");
+
+	start = bench_now();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < count; i++) {
+			unsigned int k = order[i];
+
+			if (ll_name_to_index(names[k]) != k + 1) {
+				fprintf(stderr, "%s: wrong index\n", names[k]);
+				return 1;
+			}
+		}
+	}
+	elapsed = bench_now() - start;
+	bench_report(14, "name_to_index", count, "links", elapsed,
+		     (double)count * rounds, "lookup");
+
+	start = bench_now();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < count; i++) {
+			unsigned int k = order[i];
+
+			if (strcmp(ll_index_to_name(k + 1), names[k])) {
+				fprintf(stderr, "%u: wrong name\n", k + 1);
+				return 1;
+			}
+		}
+	}
+	elapsed = bench_now() - start;
+	bench_report(14, "index_to_name", count, "links", elapsed,
+		     (double)count * rounds, "lookup");
+
+	free(order);
+	free(names);
+	return 0;
+}
@@ -0,0 +1,161 @@
+/*
+ * ss_bench.c	Time ss over many synthetic TCP sockets
+ *
+ *		This program is free software; you can redistribute it and/or
+ *		modify it under the terms of the GNU General Public License
+ *		as published by the Free Software Foundation; either version
+ *		2 of the License, or (at your option) any later version.
+ *
+ * Writes a sock_diag dump of SOCKETS established IPv4 and IPv6 TCP sockets
+ * to a temporary file, then runs ss on it through $TCPDIAG_FILE, once with
+ * serial dumps and once with --parallel, output going to /dev/null.
+ * Usage: ss_bench [SOCKETS [SS]]
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+
+#include "bench.h"
+
+static void fill_sock(struct inet_diag_msg *r, unsigned int i)
+{
+	r->idiag_family = i % 4 ? AF_INET : AF_INET6;
+	r->idiag_state = 1;	/* TCP_ESTABLISHED */
+	r->id.idiag_sport = htons(1024 + i % 50000);
+	r->id.idiag_dport = htons(i % 3 ? 443 : 80);
+	if (r->idiag_family == AF_INET) {
+		r->id.idiag_src[0] = htonl(0x0a000001);
+		r->id.idiag_dst[0] = htonl(0x0a800000 + i / 16);
+	} else {
+		r->id.idiag_src[0] = htonl(0xfd000000);
+		r->id.idiag_src[3] = htonl(1);
+		r->id.idiag_dst[0] = htonl(0xfd000001);
+		r->id.idiag_dst[3] = htonl(i);
+	}
+	r->id.idiag_cookie[0] = i;
+	r->idiag_uid = 1000;
+	r->idiag_inode = 100000 + i;
+	r->idiag_rqueue = i % 7;
+	r->idiag_wqueue = i % 11 * 100;
+}
+
+static int write_dump(int fd, unsigned int count)
+{
+	struct {
+		struct nlmsghdr		n;
+		struct inet_diag_msg	r;
+	} msg[256];
+	unsigned int i, j;
+
+	for (i = 0; i < count; i += j) {
+		memset(msg, 0, sizeof(msg));
+		for (j = 0; j < 256 && i + j < count; j++) {
+			msg[j].n.nlmsg_len = sizeof(msg[j]);
+			msg[j].n.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+			msg[j].n.nlmsg_flags = NLM_F_MULTI;
+			fill_sock(&msg[j].r, i + j);
+		}
+		if (write(fd, msg, j * sizeof(msg[0])) != j * sizeof(msg[0]))
+			return -1;
+	}
+
+	memset(msg, 0, sizeof(msg[0]));
+	msg[0].n.nlmsg_len = NLMSG_LENGTH(sizeof(int));
+	msg[0].n.nlmsg_type = NLMSG_DONE;
+	msg[0].n.nlmsg_flags = NLM_F_MULTI;
+	if (write(fd, msg, msg[0].n.nlmsg_len) != msg[0].n.nlmsg_len)
+		return -1;
+	return 0;
+}
+
+static int run_ss(const char *ss, char *const argv[])
+{
+	int status;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		return -1;
+	if (pid == 0) {
+		int fd = open("/dev/null", O_WRONLY);
+
+		if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0)
+			_exit(127);
+		execv(ss, argv);
+		perror(ss);
+		_exit(127);
+	}
+	if (waitpid(pid, &status, 0) < 0 ||
+	    !WIFEXITED(status) || WEXITSTATUS(status))
+		return -1;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int count = argc > 1 ? atoi(argv[1]) : 1000000;
+	const char *ss = argc > 2 ? argv[2] : "../../misc/ss";
+	char path[] = "/tmp/ss_bench.XXXXXX";
+	static const char *const modes[][7] = {
+		{ "ss", "-Htn", NULL },
+		{ "ss", "-Htn", "--parallel", NULL },
+		{ "ss", "-Htn", "dport", "=", ":443", NULL },
+		{ "ss", "-Htn", "--parallel", "dport", "=", ":443", NULL },
+	};
+	double start, elapsed;
+	unsigned int i;
+	int fd, ret = 0;
+
+	if (!count) {
+		fprintf(stderr, "Usage: ss_bench [SOCKETS [SS]]\n");
+		return 1;
+	}
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+
+	start = bench_now();
+	if (write_dump(fd, count)) {
+		perror("write");
+		ret = 1;
+		goto out;
+	}
+	elapsed = bench_now() - start;
+	bench_report(32, "generate", count, "socks", elapsed, count, "sock");
+	setenv("TCPDIAG_FILE", path, 1);
+
+	for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+		char name[64] = "";
+		int j;
+
+		for (j = 1; modes[i][j]; j++)
+			snprintf(name + strlen(name), sizeof(name) - strlen(name),
+				 "%s%s", j > 1 ? " " : "", modes[i][j]);
+
+		start = bench_now();
+		if (run_ss(ss, (char *const *)modes[i])) {
+			fprintf(stderr, "%s %s failed\n", ss, name);
+			ret = 1;
+			break;
+		}
+		elapsed = bench_now() - start;
+		bench_report(32, name, count, "socks", elapsed, count, "sock");
+	}
+
+out:
+	close(fd);
+	unlink(path);
+	return ret;
+}